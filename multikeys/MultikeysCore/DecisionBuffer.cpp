@@ -0,0 +1,119 @@
+#include "stdafx.h"
+#include "DecisionBuffer.h"
+
+// Implementation of methods defined in DecisionBuffer.h
+
+static_assert((DECISION_BUFFER_CAPACITY & (DECISION_BUFFER_CAPACITY - 1)) == 0, "Capacity must be a power of two");
+static_assert((DECISION_BUFFER_BUCKETS & (DECISION_BUFFER_BUCKETS - 1)) == 0, "Bucket count must be a power of two");
+
+DecisionBuffer::DecisionBuffer()
+	: nextSlot(0), nextAbandoned(0)
+{
+	for (size_t i = 0; i < DECISION_ABANDONED_CAPACITY; i++)
+		abandoned[i].used = false;
+	for (size_t i = 0; i < DECISION_BUFFER_CAPACITY; i++)
+	{
+		slots[i].used = false;
+		slots[i].next = NO_SLOT;
+	}
+	for (size_t i = 0; i < DECISION_BUFFER_BUCKETS; i++)
+	{
+		first[i] = NO_SLOT;
+		last[i] = NO_SLOT;
+	}
+}
+
+void DecisionBuffer::_unlink(const unsigned short slot, const unsigned short previous)
+{
+	size_t bucket = _bucketOf(slots[slot].key);
+	if (previous == NO_SLOT)
+		first[bucket] = slots[slot].next;
+	else
+		slots[previous].next = slots[slot].next;
+	if (last[bucket] == slot)
+		last[bucket] = previous;
+	slots[slot].used = false;
+	slots[slot].next = NO_SLOT;
+}
+
+void DecisionBuffer::push(const DecisionRecord& record, const DWORD now)
+{
+	// The hook message that this decision belongs to was already answered
+	unsigned int key = MakeDecisionKey(record.keyboardInput);
+	for (size_t i = 0; i < DECISION_ABANDONED_CAPACITY; i++)
+	{
+		if (abandoned[i].used && abandoned[i].key == key && now - abandoned[i].time <= DECISION_ABANDONED_AGE)
+		{
+			abandoned[i].used = false;
+#if DEBUG
+			OutputDebugString(L"DecisionBuffer: Discarding a decision that arrived too late.\n");
+#endif
+			return;
+		}
+	}
+
+	unsigned short slot = (unsigned short)nextSlot;
+	nextSlot = (nextSlot + 1) & (DECISION_BUFFER_CAPACITY - 1);
+
+	// The buffer is full; the decision in this slot is the oldest one, and is discarded
+	if (slots[slot].used)
+	{
+		unsigned short previous = NO_SLOT;
+		for (unsigned short i = first[_bucketOf(slots[slot].key)]; i != slot; i = slots[i].next)
+			previous = i;
+		_unlink(slot, previous);
+#if DEBUG
+		OutputDebugString(L"DecisionBuffer: Full; discarding the oldest decision.\n");
+#endif
+	}
+
+	slots[slot].record = record;
+	slots[slot].key = key;
+	slots[slot].time = now;
+	slots[slot].next = NO_SLOT;
+	slots[slot].used = true;
+
+	// Append to the end of its bucket's list, so that the list stays in the order decisions were made
+	size_t bucket = _bucketOf(slots[slot].key);
+	if (last[bucket] == NO_SLOT)
+		first[bucket] = slot;
+	else
+		slots[last[bucket]].next = slot;
+	last[bucket] = slot;
+}
+
+void DecisionBuffer::abandon(const unsigned int key, const DWORD now)
+{
+	abandoned[nextAbandoned].key = key;
+	abandoned[nextAbandoned].time = now;
+	abandoned[nextAbandoned].used = true;
+	nextAbandoned = (nextAbandoned + 1) % DECISION_ABANDONED_CAPACITY;
+}
+
+bool DecisionBuffer::take(const unsigned int key, const DWORD now, OUT DecisionRecord *const out_record)
+{
+	unsigned short previous = NO_SLOT;
+	unsigned short slot = first[_bucketOf(key)];
+	while (slot != NO_SLOT)
+	{
+		unsigned short next = slots[slot].next;
+
+		// Unsigned subtraction is correct even when the tick count rolls over to 0
+		if (now - slots[slot].time > DECISION_MAX_AGE)
+		{
+			_unlink(slot, previous);		// <- previous stays the same
+		}
+		else if (slots[slot].key == key)
+		{
+			*out_record = slots[slot].record;
+			_unlink(slot, previous);
+			return true;
+		}
+		else
+		{
+			previous = slot;
+		}
+		slot = next;
+	}
+	return false;
+}
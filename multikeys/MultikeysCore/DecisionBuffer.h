@@ -0,0 +1,117 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MultikeysCore.h"
+
+// Maximum amount of decisions waiting for their hook message; must be a power of two.
+// When the buffer is full, the oldest decision is discarded.
+const size_t DECISION_BUFFER_CAPACITY = 64;
+
+// Amount of lists that decisions are spread into, by key; must be a power of two.
+const size_t DECISION_BUFFER_BUCKETS = 64;
+
+// Decisions older than this (in ms) are assumed to belong to a hook message that will never come
+// (or that already timed out), and are never matched.
+const DWORD DECISION_MAX_AGE = 1000;
+
+// Amount of hook messages that timed out whose late decisions are still expected, and how long
+// (in ms) they're expected for; a decision that arrives later than that is stored as usual.
+const size_t DECISION_ABANDONED_CAPACITY = 8;
+const DWORD DECISION_ABANDONED_AGE = 250;
+
+
+// Packs the parts of a keystroke that both the hook and Raw Input know about into a single value,
+// so that a hook message can be matched with the decision made for its Raw Input message.
+inline unsigned int MakeDecisionKey(const USHORT vKey, const USHORT scancode, const bool extended, const bool keyup)
+{
+	return ((unsigned int)(vKey & 0xff) << 16) | ((unsigned int)(scancode & 0xff) << 8)
+		| (extended ? 2u : 0u) | (keyup ? 1u : 0u);
+}
+
+// Same as above, from a Raw Input keystroke.
+inline unsigned int MakeDecisionKey(const RAWKEYBOARD& keyboard)
+{
+	return MakeDecisionKey(keyboard.VKey, keyboard.MakeCode,
+		(keyboard.Flags & RI_KEY_E0) != 0, (keyboard.Flags & RI_KEY_BREAK) != 0);
+}
+
+// Parts of a decision key.
+inline USHORT DecisionKeyVirtualKey(const unsigned int key) { return (USHORT)((key >> 16) & 0xff); }
+inline USHORT DecisionKeyScancode(const unsigned int key) { return (USHORT)((key >> 8) & 0xff); }
+
+
+// Keeps the decisions made for Raw Input messages until the matching hook message asks for them.
+// Decisions are kept in a fixed ring, in the order they were made, and are also linked into one of
+// several short lists by key; so finding the decision for a hook message only looks at decisions
+// with similar keys, and removing it leaves every other decision in place.
+// If several decisions have the same key, they're matched in the order they were made.
+// Only the window thread uses this.
+class DecisionBuffer
+{
+private:
+
+	// Marks the end of a list.
+	static const unsigned short NO_SLOT = 0xffff;
+
+	struct Slot
+	{
+		DecisionRecord record;
+		unsigned int key;
+		// When the decision was made (GetTickCount)
+		DWORD time;
+		// Next decision in the same bucket, in the order they were made
+		unsigned short next;
+		bool used;
+	};
+
+	Slot slots[DECISION_BUFFER_CAPACITY];
+
+	// First and last decision of each bucket's list
+	unsigned short first[DECISION_BUFFER_BUCKETS];
+	unsigned short last[DECISION_BUFFER_BUCKETS];
+
+	// Slot that receives the next decision; it's always the slot that was used the longest ago.
+	size_t nextSlot;
+
+	// Keys of hook messages that timed out, and when; their decisions are discarded when pushed.
+	// Also a ring, in which the oldest entry is overwritten.
+	struct Abandoned
+	{
+		unsigned int key;
+		DWORD time;
+		bool used;
+	};
+	Abandoned abandoned[DECISION_ABANDONED_CAPACITY];
+	size_t nextAbandoned;
+
+	static inline size_t _bucketOf(const unsigned int key)
+	{
+		// Mixes the virtual key and the scancode, so that neither decides the bucket alone
+		return (key ^ (key >> 8) ^ (key >> 16) ^ (key >> 5)) & (DECISION_BUFFER_BUCKETS - 1);
+	}
+
+	// Takes a slot out of its bucket's list; previous is the slot before it in that list.
+	void _unlink(const unsigned short slot, const unsigned short previous);
+
+public:
+
+	DecisionBuffer();
+
+	DecisionBuffer(const DecisionBuffer&) = delete;
+	DecisionBuffer& operator=(const DecisionBuffer&) = delete;
+
+	// Stores the decision made for a Raw Input message, unless its hook message was abandoned.
+	// now - current time, from GetTickCount.
+	void push(const DecisionRecord& record, const DWORD now);
+
+	// Marks the hook message with the given key as answered without its decision, which
+	// hasn't arrived yet; that decision is discarded when it's pushed (once, within
+	// DECISION_ABANDONED_AGE), so that the next hook message with the same key doesn't take it.
+	void abandon(const unsigned int key, const DWORD now);
+
+	// Looks for the oldest decision with the given key (see MakeDecisionKey) that is not too old,
+	// and removes it from the buffer. Decisions that are found to be too old are discarded.
+	// Returns false if there is no such decision.
+	bool take(const unsigned int key, const DWORD now, OUT DecisionRecord *const out_record);
+
+};
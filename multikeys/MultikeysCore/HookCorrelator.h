@@ -0,0 +1,175 @@
+#pragma once
+
+// Nothing in here depends on Windows; the window procedure provides the clock and the raw events,
+// so the same code can be driven by hand with made-up timings and orders of events.
+
+
+// Time in milliseconds, from any starting point. It may roll over to 0.
+class ICorrelationClock
+{
+public:
+	virtual ~ICorrelationClock() { }
+	virtual unsigned int now() = 0;
+};
+
+
+// What happened when the event source was asked for the next raw event.
+enum class RawEventStatus : unsigned int
+{
+	// No raw event has arrived yet.
+	None,
+	// A raw event was taken, and its decision was stored where the hook message will look for it.
+	Taken,
+	// A raw event was taken that shows the hook message will never have a matching one,
+	// and that it must be blocked (such as the fake Left Control sent before an AltGr).
+	Abandon
+};
+
+
+// Raw events that arrive while a hook message waits for its own.
+class IRawEventSource
+{
+public:
+	virtual ~IRawEventSource() { }
+
+	// Returns as soon as raw events are available, or after timeout milliseconds.
+	// Returns false if it timed out. It may return true early; the caller checks again.
+	virtual bool waitForEvent(const unsigned int timeout) = 0;
+
+	// Takes the next raw event that is already available, if any, and stores its decision.
+	// hookKey - decision key of the hook message that is waiting
+	// key - receives the decision key of the raw event that was taken
+	virtual RawEventStatus takeEvent(const unsigned int hookKey, unsigned int& key) = 0;
+};
+
+
+// How long a hook message waits for its raw event at most, and at least, in milliseconds.
+// The least is above one tick of the system scheduler (about 15.6 ms), since a wait may always
+// end up to a tick late.
+const unsigned int CORRELATION_MIN_TIMEOUT = 20;
+const unsigned int CORRELATION_MAX_TIMEOUT = 100;
+// Timeout used before any delay has been observed.
+const unsigned int CORRELATION_INITIAL_TIMEOUT = 50;
+
+
+// Outcome of waiting for the raw event of a hook message.
+enum class Correlation : unsigned int
+{
+	// The raw event arrived, and its decision is stored with the others.
+	Matched,
+	// The raw event did not arrive in time.
+	TimedOut,
+	// The event source decided the raw event will never arrive, and the hook message must be blocked.
+	Abandoned
+};
+
+
+// Waits for the raw event of a hook message that arrived before it.
+// Instead of checking every few milliseconds, this sleeps until raw events arrive, so it wakes up
+// as soon as the right one does. The time it waits is learned from how late raw events usually are:
+// a smoothed delay plus four times its smoothed deviation, the same estimate that TCP uses for
+// retransmission timeouts (RFC 6298). Like TCP, the timeout is doubled every time it runs out,
+// until the next raw event that does arrive in time sets it from the estimate again.
+// The clock must be finer than the delays measured (GetTickCount isn't). Only the window thread uses this.
+class HookCorrelator
+{
+private:
+
+	ICorrelationClock* clock;
+	IRawEventSource* source;
+
+	// Smoothed delay, times 8; and smoothed deviation of the delay, times 4.
+	unsigned int scaledDelay;
+	unsigned int scaledDeviation;
+	// False until the first delay is observed
+	bool hasDelay;
+
+	unsigned int timeout;
+
+	// Statistics, for debugging and measuring
+	unsigned int matchCount;
+	unsigned int timeoutCount;
+
+	// Includes a new delay into the estimate, and recomputes the timeout.
+	void _observe(const unsigned int delay)
+	{
+		if (!hasDelay)
+		{
+			hasDelay = true;
+			scaledDelay = delay << 3;
+			scaledDeviation = delay << 1;		// <- half the delay, times 4
+		}
+		else
+		{
+			int error = (int)delay - (int)(scaledDelay >> 3);
+			scaledDelay = (unsigned int)((int)scaledDelay + error);		// <- delay += error / 8
+			if (error < 0)
+				error = -error;
+			scaledDeviation = (unsigned int)((int)scaledDeviation + error - (int)(scaledDeviation >> 2));	// <- += (|error| - deviation) / 4
+		}
+
+		unsigned int estimate = (scaledDelay >> 3) + scaledDeviation;
+		timeout = estimate < CORRELATION_MIN_TIMEOUT ? CORRELATION_MIN_TIMEOUT
+			: estimate > CORRELATION_MAX_TIMEOUT ? CORRELATION_MAX_TIMEOUT
+			: estimate;
+	}
+
+	// Backs off after a raw event didn't arrive in time.
+	void _backOff()
+	{
+		timeout = (timeout * 2 > CORRELATION_MAX_TIMEOUT ? CORRELATION_MAX_TIMEOUT : timeout * 2);
+	}
+
+public:
+
+	// Neither object is owned by this one; both must outlive it.
+	HookCorrelator(ICorrelationClock* const clock, IRawEventSource* const source)
+		: clock(clock), source(source), scaledDelay(0), scaledDeviation(0), hasDelay(false),
+		timeout(CORRELATION_INITIAL_TIMEOUT), matchCount(0), timeoutCount(0)
+	{ }
+
+	HookCorrelator(const HookCorrelator&) = delete;
+	HookCorrelator& operator=(const HookCorrelator&) = delete;
+
+	// Takes raw events as they arrive until the one with the hook message's key is found.
+	// Every raw event taken, including the matching one, has its decision stored by the source.
+	// If this times out, the caller should make sure that the raw event's decision is never used
+	// when it arrives, since the hook message was already answered without it.
+	Correlation await(const unsigned int hookKey)
+	{
+		const unsigned int start = clock->now();
+		while (true)
+		{
+			unsigned int key;
+			RawEventStatus status;
+			while ((status = source->takeEvent(hookKey, key)) != RawEventStatus::None)
+			{
+				if (status == RawEventStatus::Abandon)
+					return Correlation::Abandoned;
+				if (key == hookKey)
+				{
+					matchCount++;
+					_observe(clock->now() - start);		// <- unsigned, so correct across a roll over
+					return Correlation::Matched;
+				}
+			}
+
+			unsigned int elapsed = clock->now() - start;
+			if (elapsed >= timeout)
+			{
+				// The delay of a raw event that arrives later can't be told apart from one that never
+				// arrives (such as for keys injected by other programs), so only the timeout is learned
+				timeoutCount++;
+				_backOff();
+				return Correlation::TimedOut;
+			}
+			source->waitForEvent(timeout - elapsed);
+		}
+	}
+
+	// Milliseconds that the next hook message will wait at most.
+	unsigned int getTimeout() const { return timeout; }
+
+	unsigned int getMatchCount() const { return matchCount; }
+	unsigned int getTimeoutCount() const { return timeoutCount; }
+};
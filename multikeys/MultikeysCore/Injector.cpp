@@ -0,0 +1,107 @@
+#include "stdafx.h"
+#include "Injector.h"
+
+// Implementation of methods defined in Injector.h
+
+Injector::Injector(Multikeys::PRemapper const remapper)
+	: remapper(remapper), sleeping(false), stopping(false)
+{
+	ZeroMemory(&macroCounters, sizeof(macroCounters));
+	wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	// The thread is started last, after every member it uses is initialized
+	worker = std::thread(&Injector::_run, this);
+}
+
+void Injector::post(const ResolvedAction& action)
+{
+	// Only one thread ever executes actions, so the window thread never executes them itself,
+	// not even when the queue is full.
+	while (!ring.push(action))
+	{
+#if DEBUG
+		OutputDebugString(L"Injector: Queue is full, waiting.\n");
+#endif
+		std::this_thread::yield();
+	}
+
+	// Only pay for waking the thread up if it's waiting
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.exchange(false))
+		SetEvent(wakeEvent);
+}
+
+void Injector::_run()
+{
+	ResolvedAction action;
+	while (true)
+	{
+		while (ring.pop(action))
+		{
+			if (!remapper->executeAction(action.action, action.keyup, action.repeated))
+			{
+#if DEBUG
+				OutputDebugString(L"Injector: Simulation failed!!\n");
+#endif
+			}
+		}
+
+		// Macros that reached a delay are continued here too, between actions
+		DWORD wait = remapper->executeDelayedSteps();
+
+		// Keys held by macros that can't finish anymore are released before leaving
+		bool stop = stopping.load();
+		if (stop && !ring.empty())
+			continue;		// <- posted right before stopping
+		if (stop)
+			remapper->abandonDelayedSteps();
+
+		Multikeys::MacroSchedulerCounters counters;
+		remapper->getMacroCounters(&counters);
+		{
+			std::lock_guard<std::mutex> lock(countersMutex);
+			macroCounters = counters;
+		}
+
+		if (stop)
+			break;
+
+		// Announce that this thread will wait, then look again, so that an action
+		// posted in between is never left waiting for the next one.
+		sleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!ring.empty() || stopping.load())
+		{
+			sleeping.store(false);
+			continue;
+		}
+		// Waits for the next action, or until the next delayed macro step is due
+		WaitForSingleObject(wakeEvent, wait);
+		sleeping.store(false);
+	}
+}
+
+Multikeys::MacroSchedulerCounters Injector::getMacroCounters()
+{
+	std::lock_guard<std::mutex> lock(countersMutex);
+	return macroCounters;
+}
+
+Injector::~Injector()
+{
+	stopping.store(true);
+	SetEvent(wakeEvent);
+	if (worker.joinable())
+		worker.join();
+	CloseHandle(wakeEvent);
+
+#if DEBUG
+	// How accurate delays were, and how much the scheduler had to do
+	WCHAR text[256];
+	swprintf_s(text, 256, L"Injector: %llu macro delays, %llu steps run, %llu ms late on average (at most %llu), "
+		L"%llu cascades, %llu overflows, %llu dropped\n",
+		macroCounters.scheduled, macroCounters.fired,
+		macroCounters.fired == 0 ? 0ull : macroCounters.totalLateness / macroCounters.fired,
+		macroCounters.maxLateness, macroCounters.cascades, macroCounters.overflows, macroCounters.dropped);
+	OutputDebugString(text);
+#endif
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MultikeysCore.h"
+#include "SpscRing.h"
+
+#include <thread>
+#include <mutex>
+
+// Maximum amount of actions waiting to be injected.
+const size_t INJECTOR_QUEUE_CAPACITY = 256;
+
+// Executes remapped actions in a thread of its own, so that the window procedure can answer
+// the keyboard hook as soon as a key is evaluated, instead of after the output is sent.
+// Actions are posted from the window thread only, and executed in the order they were posted.
+// Macros with delays are continued by the same thread, whenever their next steps are due.
+class Injector
+{
+private:
+
+	// Actions waiting to be executed; the window thread produces and the injector thread consumes.
+	SpscRing<ResolvedAction, INJECTOR_QUEUE_CAPACITY> ring;
+
+	// Remapper that executes the actions; not owned by this object.
+	Multikeys::PRemapper remapper;
+
+	// Auto-reset event used for waking up the injector thread when it's waiting for actions.
+	HANDLE wakeEvent;
+
+	// True while the injector thread is waiting (or about to wait) on wakeEvent, so that
+	// posting an action only signals the event when that's actually needed.
+	std::atomic<bool> sleeping;
+
+	// Set when the injector thread should finish.
+	std::atomic<bool> stopping;
+
+	std::thread worker;
+
+	// Copy of the remapper's macro counters, published by the injector thread for other threads.
+	std::mutex countersMutex;
+	Multikeys::MacroSchedulerCounters macroCounters;
+
+	// Body of the injector thread.
+	void _run();
+
+public:
+
+	// remapper - executes the actions; must outlive this object.
+	// The injector thread starts immediately.
+	Injector(Multikeys::PRemapper const remapper);
+
+	Injector(const Injector&) = delete;
+	Injector& operator=(const Injector&) = delete;
+
+	// Window thread only. Queues an action to be executed by the injector thread.
+	// In the rare case that the queue is full, this waits for a free slot.
+	void post(const ResolvedAction& action);
+
+	// Any thread. Counters of delayed macros (see IRemapper::getMacroCounters), as of the last
+	// time the injector thread ran them.
+	Multikeys::MacroSchedulerCounters getMacroCounters();
+
+	// Executes all actions still in the queue, releases the keys held by macros that are still
+	// waiting for a delay, then stops the injector thread.
+	~Injector();
+
+};
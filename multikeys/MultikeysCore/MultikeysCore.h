@@ -7,6 +7,7 @@
 
 #include "stdafx.h"
 #include "resource.h"
+#include "HookCorrelator.h"
 
 // Structure of a single record that will be saved in the decisionBuffer
 struct DecisionRecord
@@ -15,22 +16,62 @@ struct DecisionRecord
 	RAWKEYBOARD keyboardInput;
 
 	// Information about the action to be taken, if any
-	Multikeys::PKeystrokeCommand mappedAction;
+	// (a small value referring to commands of the remapper; see RemapperAPI.h)
+	Multikeys::KeystrokeAction mappedAction;
 
 	// TRUE - this keypress should be blocked, and mappedAction should be carried out
 	// FALSE - this keypress should not be blocked, and there is no mapped input to be carried out
 	BOOL decision;
 
+	DecisionRecord()
+		: keyboardInput(), mappedAction(), decision(FALSE)
+	{
+		// Constructor
+	}
+
 	DecisionRecord(RAWKEYBOARD _keyboardInput, BOOL _decision)
-		: keyboardInput(_keyboardInput), mappedAction(nullptr), decision(_decision)
+		: keyboardInput(_keyboardInput), mappedAction(), decision(_decision)
 	{
 		// Constructor
 	}
 
-	DecisionRecord(RAWKEYBOARD _keyboardInput, Multikeys::PKeystrokeCommand _mappedInput, BOOL _decision)
+	DecisionRecord(RAWKEYBOARD _keyboardInput, Multikeys::KeystrokeAction _mappedInput, BOOL _decision)
 		: keyboardInput(_keyboardInput), mappedAction(_mappedInput), decision(_decision)
 	{
 		// Constructor
 	}
 };
 
+
+// Everything needed to carry out a remapped keystroke, decided at the moment the key was evaluated.
+// These are handed from the window thread to the injector thread, which executes them in order.
+struct ResolvedAction
+{
+	// Action to be executed
+	Multikeys::KeystrokeAction action;
+
+	// Whether the keystroke that produced this was a key release
+	bool keyup;
+
+	// Whether the keystroke that produced this was a repetition of a key being held down
+	bool repeated;
+};
+
+
+// Clock used while waiting for Raw Input messages, in milliseconds; uses the performance counter,
+// since GetTickCount only changes about every 15.6 ms.
+class PerformanceClock : public ICorrelationClock
+{
+public:
+	unsigned int now() override;
+};
+
+
+// Raw Input messages that arrive in the window's queue while a hook message waits for its own.
+// Each message taken is evaluated, and its decision is stored in the decision buffer.
+class RawInputSource : public IRawEventSource
+{
+public:
+	bool waitForEvent(const unsigned int timeout) override;
+	RawEventStatus takeEvent(const unsigned int hookKey, unsigned int& key) override;
+};
\ No newline at end of file
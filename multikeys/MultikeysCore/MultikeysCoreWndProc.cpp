@@ -8,6 +8,8 @@
 #include "stdafx.h"
 #include "MultikeysCore.h"
 #include "Scancodes.h"
+#include "Injector.h"
+#include "DecisionBuffer.h"
 
 
 #define MAX_LOADSTRING 100
@@ -22,8 +24,11 @@ WCHAR szWindowClass[MAX_LOADSTRING] = L"Multikeys Core";            // the main
 HWND mainHwnd;
 // Windows message for communication between main executable and DLL module
 UINT const WM_HOOK = WM_APP + 1;
-// How long should hook processing wait for the matching Raw Input message (in ms)
-DWORD maxWaitingTime = 50;		// Hopefully no legitimate keystroke should have a delay as long as 0.05s
+// Waits for Raw Input messages that arrive after their hook message.
+// How long it waits is learned from how late they usually are (see HookCorrelator.h).
+PerformanceClock performanceClock;
+RawInputSource rawInputSource;
+HookCorrelator correlator(&performanceClock, &rawInputSource);
 
 								// Flag for AltGr. Used in the AltGr fix.
 BOOL AltGrBlockNextLCtrl = FALSE;
@@ -45,17 +50,17 @@ INPUT * input;
 Multikeys::PRemapper remapper;	// PRemapper is a pointer type
 								// Must be initialized
 
+// Executes remapped actions in another thread, so that the hook gets its answer right away
+Injector * injector;
+
 								// text to display on screen for debugging
 WCHAR* debugText = new WCHAR[DEBUG_TEXT_SIZE];
 WCHAR* debugTextKeyboardName = new WCHAR[DEBUG_TEXT_SIZE];
 WCHAR* debugTextBeingBlocked = new WCHAR[DEBUG_TEXT_SIZE];
 
-// Variables to hold timer values
-DWORD currentTime, startTime;
-
 // Buffer for the decisions whether to block the input with Hook
-std::deque<DecisionRecord> decisionBuffer;
-// Deque because we'll need to iterate through it.
+// Indexed by key, so the hook finds its decision without looking through the others.
+DecisionBuffer decisionBuffer;
 
 
 
@@ -100,29 +105,41 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	Multikeys::Create(&remapper);
 
+	std::wstring settingsFilename = L"C:\\MultiKeys\\MultiKeys.xml";
 	if (szArgList == NULL)
 	{					// Eventually we'll have to make these fail cases just fail.
 		OutputDebugString(L"No arguments found. Initializing with default file");
-		remapper->loadSettings(L"C:\\MultiKeys\\MultiKeys.xml");
+		remapper->loadSettings(settingsFilename);
 	}
 	else if (argCount != 2)
 	{
 		OutputDebugString(L"Incorrect number of arguments. Initializing with default file");
-		remapper->loadSettings(L"C:\\MultiKeys\\MultiKeys.xml");
+		remapper->loadSettings(settingsFilename);
 	}
 	else
 	{
 		// try this
-		if (!remapper->loadSettings(std::wstring(szArgList[1])))
+		if (remapper->loadSettings(std::wstring(szArgList[1])))
+		{
+			settingsFilename = szArgList[1];
+		}
+		else
 		{
 			OutputDebugString(L"Failed to open file. Initializing with default file");
-			remapper->loadSettings(L"C:\\MultiKeys\\MultiKeys.xml");
+			remapper->loadSettings(settingsFilename);
 		}
 	}
 
 	// return of CommandLineToArgvW is a contiguous memory of pointers
 	LocalFree(szArgList);
 
+	// Changes saved to the settings are loaded in the background, without restarting
+	if (!remapper->watchSettings(settingsFilename))
+		OutputDebugString(L"The settings will not be reloaded when they change.");
+
+	// Start the thread that sends the output of remapped keys
+	injector = new Injector(remapper);
+
 	// Initialize the work INPUT structure for use in the ResetKey function
 	input = new INPUT;
 	input->type = INPUT_KEYBOARD;
@@ -142,6 +159,9 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 		// }
 	}
 
+	// Send whatever is still queued before leaving
+	delete injector;
+
 	return (int)msg.wParam;
 }
 
@@ -209,7 +229,8 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 	RAWINPUTDEVICE rawInputDevice[1];
 	rawInputDevice[0].usUsagePage = 1;		// usage page = 1 is generic and usage = 6 is for keyboards
 	rawInputDevice[0].usUsage = 6;				// (2 is mouse, 4 is joystick, 6 is keyboard, there are others)
-	rawInputDevice[0].dwFlags = RIDEV_INPUTSINK;		// Receive input even if the registered window is in the background
+	rawInputDevice[0].dwFlags = RIDEV_INPUTSINK		// Receive input even if the registered window is in the background
+		| RIDEV_DEVNOTIFY;								// and receive WM_INPUT_DEVICE_CHANGE when keyboards come and go
 	rawInputDevice[0].hwndTarget = hWnd;				// Handle to the target window (NULL would make it follow kb focus)
 	RegisterRawInputDevices(rawInputDevice, 1, sizeof(rawInputDevice[0]));
 
@@ -232,6 +253,148 @@ BOOL ResetKey(SHORT vKey)
 }
 
 
+unsigned int PerformanceClock::now()
+{
+	static LARGE_INTEGER frequency = { };
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);		// <- never changes while the system runs
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned int)(counter.QuadPart / (frequency.QuadPart / 1000));		// <- rolls over like GetTickCount
+}
+
+bool RawInputSource::waitForEvent(const unsigned int timeout)
+{
+	// Sleeps until a Raw Input message is in the queue, instead of checking every few milliseconds.
+	// MWMO_INPUTAVAILABLE makes this return for messages that were already there, too.
+	// The hook sends its messages (SendMessage), and the hook of another key may be waiting for an
+	// answer as well; those are handled by peeking, which calls the window procedure for them.
+	DWORD result = MsgWaitForMultipleObjectsEx(0, NULL, timeout, QS_RAWINPUT | QS_SENDMESSAGE, MWMO_INPUTAVAILABLE);
+	if (result != WAIT_OBJECT_0)
+		return false;
+	MSG message;
+	PeekMessage(&message, NULL, 0, 0, PM_NOREMOVE);
+	return true;
+}
+
+// Takes the next Raw Input message while a hook message is waiting for its own.
+// A lot of code here is similar to that in the WM_INPUT case.
+// We can't wait for that case to be called, because we'd need to interrupt the WM_HOOK case.
+RawEventStatus RawInputSource::takeEvent(const unsigned int hookKey, unsigned int& key)
+{
+	MSG rawMessage;
+	if (!PeekMessage(&rawMessage, mainHwnd, WM_INPUT, WM_INPUT, PM_REMOVE))
+		return RawEventStatus::None;		// Message didn't arrive yet!
+
+	// The Raw Input message has arrived; decide whether to block the input
+	// We're still in that case that the raw message took long to arrive.
+	UINT bufferSize;
+
+	// See if we'll need more space
+	GetRawInputData((HRAWINPUT)rawMessage.lParam, RID_INPUT, NULL, &bufferSize, sizeof(RAWINPUTHEADER));
+	if (bufferSize > rawKeyboardBufferSize)
+	{
+		// Need more space!
+		rawKeyboardBufferSize = bufferSize;
+		delete[] rawKeyboardBuffer;
+		rawKeyboardBuffer = new BYTE[rawKeyboardBufferSize];
+#if DEBUG
+		OutputDebugString(L"Needed more space for the delayed raw input message.");
+#endif
+	}
+	// Load data into the buffer
+	GetRawInputData((HRAWINPUT)rawMessage.lParam, RID_INPUT, rawKeyboardBuffer, &rawKeyboardBufferSize, sizeof(RAWINPUTHEADER));
+
+	RAWINPUT* raw = (RAWINPUT*)rawKeyboardBuffer;		// <- casting into correct type for convenience
+
+#if DEBUG
+	WCHAR text[128];		// <- unnecessary allocation, but this is just for debug
+	swprintf_s(text, 128, L"(delayed) Raw Input: virtual key %X scancode %s%s%X (%s)\n",
+		raw->data.keyboard.VKey,		// virtual keycode
+		raw->data.keyboard.Flags & RI_KEY_E0 ? L"e0 " : L"",
+		raw->data.keyboard.Flags & RI_KEY_E1 ? L"e1 " : L"",
+		raw->data.keyboard.MakeCode,
+		raw->data.keyboard.Flags & RI_KEY_BREAK ? L"up" : L"down");		// keydown or keyup (make/break)
+	OutputDebugString(text);
+	memcpy_s(debugText, DEBUG_TEXT_SIZE, text, 128);	// will redraw later
+#endif
+
+
+	/*----Fix for fake shift----*/
+	// There is another copy of this on the Raw Input case, for when the message arrives in time.
+	// In there, we don't know which version of Shift (left or right) produced the raw message
+	// But if we're in here, we have that information. We check differently:
+	// 1. If this message is either shift:
+	// 2.		If the delayed raw input is a shift from a scancode that shouldn't produce it
+	// 3.				Then we change that message's scancode (and flip the keyup flag, which is wrong)
+	// 4. Continue normally.
+	if (DecisionKeyVirtualKey(hookKey) == 0x10		// This is a shift
+		&& (DecisionKeyScancode(hookKey) == 0x2a || DecisionKeyScancode(hookKey) == 0x36))	// yep. shift.
+	{
+		if (raw->data.keyboard.VKey == VK_SHIFT				// delayed signal is a shift
+			&& raw->data.keyboard.MakeCode != SCANCODE_LEFT_SHIFT		// but not produced by left shift physical key
+			&& raw->data.keyboard.MakeCode != SCANCODE_RIGHT_SHIFT)		// nor right shift physical key
+		{
+			// keyup flag will be wrong; invert it.
+			if (raw->data.keyboard.Flags & RI_KEY_BREAK)
+				raw->data.keyboard.Flags &= 0xfffe;		// unset last bit
+			else raw->data.keyboard.Flags |= RI_KEY_BREAK;	// set last bit
+
+			raw->data.keyboard.MakeCode = DecisionKeyScancode(hookKey);				// *You're the same as us*
+																			// That'll make this Hook continue, and recognize this delayed message as its match.
+		}
+	}
+	// (I wish we could fake RawInput messages. Doesn't seem like so).
+	/*---End of fix for Fake shift----*/
+
+	// Evaluate the message and store the decision, just like in the WM_INPUT case.
+	// If it's the one the hook is waiting for, the hook will find it right away
+	// (or find none, if the key is not remapped, and let it through).
+	if (!remapper->isPassThrough(&(raw->data.keyboard)))
+	{
+		Multikeys::KeystrokeAction possibleInput;
+		BOOL doBlock = remapper->evaluateKey(&(raw->data.keyboard), raw->header.hDevice, &possibleInput);
+		decisionBuffer.push(DecisionRecord(raw->data.keyboard, possibleInput, doBlock), GetTickCount());
+	}
+	key = MakeDecisionKey(raw->data.keyboard);
+	if (key == hookKey)
+		return RawEventStatus::Taken;
+
+	// Turns out this raw input message wasn't the one we were looking for.
+
+	/*--Checking for AltGr--*/
+	// Checking here because it never happens early
+	if (hookKey == MakeDecisionKey(VK_CONTROL, SCANCODE_CONTROL, false, false))		// Hook message generated by left control (scancode of LCtrl in translated set 2), down
+	{
+		if (raw->data.keyboard.MakeCode == SCANCODE_ALT		// <- Raw Input is Alt key
+			&& raw->data.keyboard.Flags & RI_KEY_E0)	// Right variant
+		{
+			// then we won't wait for the LCtrl Raw Input message because it'll never happen.
+			AltGrBlockNextLCtrl = TRUE;
+
+			return RawEventStatus::Abandon;	// <- will block
+		}
+	}
+	// if a LCtrl keydown was blocked because it was part of an AltGr,
+	// we should block the very next LCtrl up. Except if another LCtrl down was sent along the way.
+	if (hookKey == MakeDecisionKey(VK_CONTROL, SCANCODE_CONTROL, false, true))		// left control, up
+	{
+		if (AltGrBlockNextLCtrl)	// after a fake LCtrl down from an AltGr
+		{
+			AltGrBlockNextLCtrl = FALSE;
+			return RawEventStatus::Abandon;
+		}
+	}
+	// A Ctrl press while AltGr is down will cause AltGr to lose effect.
+	// That's okay because that happens normally. Do not be alarmed.
+	// Let's hope all keyboards we find use the translated scancode set 2.
+	// Or we'll have to implement support for different scancode sets.
+	/*--Finished checking for AltGr--*/
+
+	return RawEventStatus::Taken;
+}
+
+
 //
 //  FUNCTION: WndProc(HWND, UINT, WPARAM, LPARAM)
 //
@@ -292,22 +455,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 #endif
 
 
-		// We'll get the device name
-		// Check that our buffer is enough for the task:
-		GetRawInputDeviceInfo(raw->header.hDevice, RIDI_DEVICENAME, NULL, &bufferSize);
-		if (bufferSize > keyboardNameBufferSize)		// It needs more space than we have!
-		{
-			keyboardNameBufferSize = bufferSize;
-			delete[] keyboardNameBuffer;
-			keyboardNameBuffer = new WCHAR[keyboardNameBufferSize];
-#if DEBUG
-			OutputDebugString(L"Needed more space for device name buffer");
-#endif
-		}
-
-		// Load the device name into the buffer
-		GetRawInputDeviceInfo(raw->header.hDevice, RIDI_DEVICENAME, keyboardNameBuffer, &keyboardNameBufferSize);
-		// Now the buffer contains the name of the device that sent the signal
+		// The remapper finds the keyboard from the device handle (raw->header.hDevice);
+		// the device name is only retrieved here for debugging.
 
 
 		/*----Fix for Fake shift----*/
@@ -324,7 +473,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 			// Instead of storing the decision for this keystroke, store the decision for both a
 			// left shift and a right shift, since we don't know which one produced this message
 			OutputDebugString(L"Raw Input: Fake shift detected, storing two shift decisions.\n");
-			Multikeys::PKeystrokeCommand possibleAction;
+			Multikeys::KeystrokeAction possibleAction;
 
 			// keyup and keydown is wrong
 			if (raw->data.keyboard.Flags & RI_KEY_BREAK)
@@ -333,13 +482,13 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 															// pretend this is a left shift
 			raw->data.keyboard.MakeCode = 0x2a;
-			bool DoBlock = remapper->evaluateKey(&(raw->data.keyboard), keyboardNameBuffer, &possibleAction);
-			decisionBuffer.push_back(DecisionRecord(raw->data.keyboard, possibleAction, DoBlock));	// remember the answer
+			bool DoBlock = remapper->evaluateKey(&(raw->data.keyboard), raw->header.hDevice, &possibleAction);
+			decisionBuffer.push(DecisionRecord(raw->data.keyboard, possibleAction, DoBlock), GetTickCount());	// remember the answer
 
 																									// pretend this is a right shift
 			raw->data.keyboard.MakeCode = 0x36;
-			DoBlock = remapper->evaluateKey(&(raw->data.keyboard), keyboardNameBuffer, &possibleAction);		// ask
-			decisionBuffer.push_back(DecisionRecord(raw->data.keyboard, possibleAction, DoBlock));	// remember the answer
+			DoBlock = remapper->evaluateKey(&(raw->data.keyboard), raw->header.hDevice, &possibleAction);		// ask
+			decisionBuffer.push(DecisionRecord(raw->data.keyboard, possibleAction, DoBlock), GetTickCount());	// remember the answer
 
 			return 0;
 		}
@@ -349,6 +498,21 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 
 #if DEBUG
+		// We'll get the device name
+		// Check that our buffer is enough for the task:
+		GetRawInputDeviceInfo(raw->header.hDevice, RIDI_DEVICENAME, NULL, &bufferSize);
+		if (bufferSize > keyboardNameBufferSize)		// It needs more space than we have!
+		{
+			keyboardNameBufferSize = bufferSize;
+			delete[] keyboardNameBuffer;
+			keyboardNameBuffer = new WCHAR[keyboardNameBufferSize];
+			OutputDebugString(L"Needed more space for device name buffer");
+		}
+
+		// Load the device name into the buffer
+		GetRawInputDeviceInfo(raw->header.hDevice, RIDI_DEVICENAME, keyboardNameBuffer, &keyboardNameBufferSize);
+		// Now the buffer contains the name of the device that sent the signal
+
 		memcpy_s(debugTextKeyboardName, DEBUG_TEXT_SIZE, keyboardNameBuffer, keyboardNameBufferSize);
 		text = new WCHAR[200];
 		swprintf_s(text, 200, L"Raw Input: Keyboard name is %ls\n", keyboardNameBuffer);
@@ -358,12 +522,17 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 #endif
 
 
+		// Keys that no keyboard remaps don't need a decision; when the hook asks for one,
+		// it finds none, sees that the key is still not remapped, and lets it through.
+		if (remapper->isPassThrough(&(raw->data.keyboard)))
+			return 0;
+
 		// Call the function that decides whether to block or allow this keystroke
 		// Store that decision in the decisionBuffer; look for it when the hook asks.
 
 		// Check whether to block this key, and store the decision for when the hook asks for it
-		Multikeys::PKeystrokeCommand possibleAction = nullptr;		// <- we don't know yet if our key maps to anything
-		BOOL DoBlock = remapper->evaluateKey(&(raw->data.keyboard), keyboardNameBuffer, &possibleAction);		// ask
+		Multikeys::KeystrokeAction possibleAction = Multikeys::KeystrokeAction();		// <- we don't know yet if our key maps to anything
+		BOOL DoBlock = remapper->evaluateKey(&(raw->data.keyboard), raw->header.hDevice, &possibleAction);		// ask
 
 #if DEBUG
 		if (DoBlock)
@@ -372,7 +541,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 			OutputDebugString(L"Raw Input: This key should not be blocked, and will not be recorded.\n");
 #endif
 
-		decisionBuffer.push_back(DecisionRecord(raw->data.keyboard, possibleAction, DoBlock));	// remember the answer
+		decisionBuffer.push(DecisionRecord(raw->data.keyboard, possibleAction, DoBlock), GetTickCount());	// remember the answer
 
 
 		/*
@@ -395,6 +564,16 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 	}	// end of case WM_INPUT
 
 
+		// A keyboard was connected or disconnected
+	case WM_INPUT_DEVICE_CHANGE:
+	{
+		// Long parameter is the device handle. Windows may reuse a handle for another device,
+		// so the remapper shouldn't keep associating it with the same keyboard.
+		remapper->forgetDevice((HANDLE)lParam);
+		return 0;
+	}
+
+
 		// Message from Hooking DLL
 		// It means we need to look for a corresponding Raw Input message that should have arrived before
 		// That message is the one that can tell us whether or not to block the key,
@@ -448,10 +627,12 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		// In case this is the hook message generated by the Pause/Break key (which generates two Raw Input messages),
 		// look for (virtual key = 0x13, scancode = (e1) 1d) instead. Do not wait for the second Raw Input message,
 		// which should be intercepted somewhere else anyway.
+		bool isPause = false;
 		if (virtualKeyCode == 0x13		// <- vKey for Pause/Break
 			&& extractedScancode == 0x45)		// <- sc for NumLock
 		{
 			// Is pause/break
+			isPause = true;
 			extractedScancode = 0x1d;		// Will wait for (virtual key = 0x13, scancode = 1d) instead.
 											// That's why we don't declare everything const. Things change here.
 #if DEBUG
@@ -500,247 +681,75 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 		// Check the Raw Input buffer to see if this Hook message is supposed to be blocked; this WdnProc returns 1 if it is
 		bool blockThisHook = false;
-		bool recordFound = false;
-		if (!decisionBuffer.empty())
-		{
-			int index = 0;
-			// Search the buffer for the matching record (it should exist)
-			for (std::deque<DecisionRecord>::iterator iterator = decisionBuffer.begin();
-				iterator != decisionBuffer.end();
-				iterator++, index++)
-			{
-				if (iterator->keyboardInput.VKey == virtualKeyCode
-					&& iterator->keyboardInput.MakeCode == extractedScancode
-					&& !(iterator->keyboardInput.Flags & RI_KEY_BREAK) == keyPressed
-					&& ((iterator->keyboardInput.Flags & RI_KEY_E0) == RI_KEY_E0) == (isExtended > 0))		// match!
-				{
-					// Actually, this doesn't guarantee a match;
-					// Keys in two different keyboards corresponding to the same virtual key may be pressed in rapid succession
-					// We have to assume that people don't do that normally.
-
-#if DEBUG
-					if (iterator->decision) OutputDebugString(L"Hook: Must block this key.\n");
-					else if (iterator->decision == FALSE) OutputDebugString(L"Hook: Must let this key through.\n");
-#endif
-
-
-					// Now, if the decision was to block the hook, we must act on it at this point, just before popping it
-					if (iterator->decision) {
-
-						if (!iterator->mappedAction->execute(!keyPressed, previousStateFlagWasDown && keyPressed)) {
-#if DEBUG
-							OutputDebugString(L"Simulation failed!!\n");
-#endif
-						}
-					}
-
-					recordFound = TRUE;		// set the flags
-					blockThisHook = iterator->decision;
-
-					// Then, remove this and all preceding messages from the buffer
-					for (int i = 0; i <= index; i++)		// <- up until and including this one
-						decisionBuffer.pop_front();
-
-					// We found the item, so we break the for loop to stop looking:
-					break;
-
-				} // end if match
-
-			} // end for search
+		// Key of the Raw Input message that caused this hook message
+		const unsigned int hookKey = MakeDecisionKey(virtualKeyCode, extractedScancode, isExtended > 0, keyPressed == 0);
+		DecisionRecord record;
+		bool recordFound = decisionBuffer.take(hookKey, GetTickCount(), &record);
 
-		} // end if buffer.empty
-
-		  // At this point, recordFound is either TRUE or FALSE, and if TRUE, blockThisHook has the correct choice.
-
-		  // Wait for the matching Raw Input message if the decision buffer was empty or the matching record wasn't there
-
-
-		  // Variables used for timers are startTime and currentTime
-		startTime = GetTickCount();			// <- record start time
+		// Raw Input messages for keys that no keyboard remaps leave no decision, so don't wait for them
+		if (!recordFound)
+		{
+			RAWKEYBOARD hookKeystroke = RAWKEYBOARD();
+			hookKeystroke.MakeCode = extractedScancode;
+			hookKeystroke.VKey = virtualKeyCode;
+			hookKeystroke.Flags = (isPause ? RI_KEY_E1 : isExtended ? RI_KEY_E0 : 0) | (keyPressed ? 0 : RI_KEY_BREAK);
+			if (remapper->isPassThrough(&hookKeystroke))
+				return 0;
+		}
 
-											// Will only fall into this if we didn't find the correct record.
-											// It's a lot of work, but hopefully won't happen frequently.
-		while (!recordFound)
+		// Wait for the matching Raw Input message if the matching record wasn't there.
+		// Every Raw Input message that arrives in the meantime is evaluated and stored like in the WM_INPUT case,
+		// and this wakes up as soon as one arrives (no polling).
+		if (!recordFound)
 		{
-			MSG rawMessage;		// We're peeking the message; that is, we're trusting that the very next raw input message
-								// will be the one we're waiting for.
-								// Also, we can't wait for the other case in this switch to be called, because we'd need
-								// to interrupt this case.
-			while (!PeekMessage(&rawMessage, mainHwnd, WM_INPUT, WM_INPUT, PM_REMOVE))		// this does not remove the message
+			switch (correlator.await(hookKey))
 			{
-				// Message didn't arrive!
-
-				// Test for the maxWaitingTime
-				currentTime = GetTickCount();
-				// If current time is less than start, the time rolled over to 0
-				if ((currentTime < startTime ? ULONG_MAX - startTime + currentTime : currentTime - startTime) > maxWaitingTime)
-				{
-					// Ignore the Hook message if it exceeded the limit
+			case Correlation::Matched:
+				recordFound = decisionBuffer.take(hookKey, GetTickCount(), &record);
+				break;
+			case Correlation::Abandoned:
+				return TRUE;	// <- will block
+			case Correlation::TimedOut:
+				// A hook message handled while waiting may have taken this one's raw event
+				recordFound = decisionBuffer.take(hookKey, GetTickCount(), &record);
+				if (recordFound)
+					break;
+				// Ignore the Hook message if it exceeded the limit; its decision is discarded if it comes later,
+				// so that it's not taken by the next hook message of the same key
+				decisionBuffer.abandon(hookKey, GetTickCount());
 #if DEBUG
-					WCHAR text[128];
-					swprintf_s(text, 128, L"Hook timed out: %X (%d)\n", virtualKeyCode, keyPressed);
-					OutputDebugString(text);
-#endif
-					return 0;
-				}
-
-				// Take a nap until checking again.
-				Sleep(10);			// Take this out if it causes problems.
-			}
-
-			// The Raw Input message has arrived; decide whether to block the input
-			// We're still in that case that the raw message took long to arrive.
-			UINT bufferSize;
-
-			// See if we'll need more space
-			GetRawInputData((HRAWINPUT)rawMessage.lParam, RID_INPUT, NULL, &bufferSize, sizeof(RAWINPUTHEADER));
-			if (bufferSize > rawKeyboardBufferSize)
 			{
-				// Need more space!
-				rawKeyboardBufferSize = bufferSize;
-				delete[] rawKeyboardBuffer;
-				rawKeyboardBuffer = new BYTE[rawKeyboardBufferSize];
-#if DEBUG
-				OutputDebugString(L"Needed more space for the delayed raw input message.");
+				WCHAR text[128];
+				swprintf_s(text, 128, L"Hook timed out after %u ms: %X (%d)\n", correlator.getTimeout(), virtualKeyCode, keyPressed);
+				OutputDebugString(text);
+			}
 #endif
+				return 0;
 			}
-			// Load data into the buffer
-			GetRawInputData((HRAWINPUT)rawMessage.lParam, RID_INPUT, rawKeyboardBuffer, &rawKeyboardBufferSize, sizeof(RAWINPUTHEADER));
-
-			RAWINPUT* raw = (RAWINPUT*)rawKeyboardBuffer;		// <- casting into correct type for convenience
-
+		}
 
+		if (recordFound)		// match!
+		{
+			// Actually, this doesn't guarantee a match;
+			// Keys in two different keyboards corresponding to the same virtual key may be pressed in rapid succession
+			// We have to assume that people don't do that normally.
+			// Decisions for other keys are left in the buffer; their hook messages may still come.
 
-																// A lot of code here is similar to that in the WM_INPUT case.
 #if DEBUG
-			WCHAR text[128];		// <- unnecessary allocation, but this is just for debug
-			swprintf_s(text, 128, L"(delayed) Raw Input: virtual key %X scancode %s%s%X (%s)\n",
-				raw->data.keyboard.VKey,		// virtual keycode
-				raw->data.keyboard.Flags & RI_KEY_E0 ? L"e0 " : L"",
-				raw->data.keyboard.Flags & RI_KEY_E1 ? L"e1 " : L"",
-				raw->data.keyboard.MakeCode,
-				raw->data.keyboard.Flags & RI_KEY_BREAK ? L"up" : L"down");		// keydown or keyup (make/break)
-			OutputDebugString(text);
-			memcpy_s(debugText, DEBUG_TEXT_SIZE, text, 128);	// will redraw later
+			if (record.decision) OutputDebugString(L"Hook: Must block this key.\n");
+			else if (record.decision == FALSE) OutputDebugString(L"Hook: Must let this key through.\n");
 #endif
 
-																// Prepare string buffer for the device name
-			GetRawInputDeviceInfo(raw->header.hDevice, RIDI_DEVICENAME, NULL, &bufferSize);
-			if (bufferSize > keyboardNameBufferSize)
-			{
-				// Need more space than we have!
-				keyboardNameBufferSize = bufferSize;
-				delete[] keyboardNameBuffer;
-				keyboardNameBuffer = new WCHAR[keyboardNameBufferSize];
-#if DEBUG
-				OutputDebugString(L"Needed more space for keyboard name in the delayed raw input message");
-#endif
+			// Now, if the decision was to block the hook, we must act on it at this point
+			// The action is only queued; the injector thread sends it after the hook gets its answer.
+			if (record.decision) {
+				injector->post(ResolvedAction{ record.mappedAction, !keyPressed,
+					previousStateFlagWasDown && keyPressed });
 			}
-			// Load the device name into the buffer
-			GetRawInputDeviceInfo(raw->header.hDevice, RIDI_DEVICENAME, keyboardNameBuffer, &keyboardNameBufferSize);
-
-			/*----Fix for fake shift----*/
-			// There is another copy of this on the Raw Input case, for when the message arrives in time.
-			// In there, we don't know which version of Shift (left or right) produced the raw message
-			// But if we're in here, we have that information. We check differently:
-			// 1. If this message is either shift:
-			// 2.		If the delayed raw input is a shift from a scancode that shouldn't produce it
-			// 3.				Then we change that message's scancode (and flip the keyup flag, which is wrong)
-			// 4. Continue normally.
-			if (virtualKeyCode == 0x10		// This is a shift
-				&& (extractedScancode == 0x2a || extractedScancode == 0x36))	// yep. shift.
-			{
-				if (raw->data.keyboard.VKey == VK_SHIFT				// delayed signal is a shift
-					&& raw->data.keyboard.MakeCode != SCANCODE_LEFT_SHIFT		// but not produced by left shift physical key
-					&& raw->data.keyboard.MakeCode != SCANCODE_RIGHT_SHIFT)		// nor right shift physical key
-				{
-					// keyup flag will be wrong; invert it.
-					if (raw->data.keyboard.Flags & RI_KEY_BREAK)
-						raw->data.keyboard.Flags &= 0xfffe;		// unset last bit
-					else raw->data.keyboard.Flags |= RI_KEY_BREAK;	// set last bit
-
-					raw->data.keyboard.MakeCode = extractedScancode;				// *You're the same as us*
-																					// That'll make this Hook continue, and recognize this delayed message as its match.
-				}
-			}
-			// (I wish we could fake RawInput messages. Doesn't seem like so).
-			/*---End of fix for Fake shift----*/
-
 
+			blockThisHook = record.decision;
 
-			// Evaluate and take action depending on whether the message is the one we were expecting:
-
-			// If the raw input message doesn't match the hook, push it into the buffer and continue waiting
-			if (virtualKeyCode != raw->data.keyboard.VKey
-				|| extractedScancode != raw->data.keyboard.MakeCode
-				|| keyPressed != (raw->data.keyboard.Flags & RI_KEY_BREAK ? 1 : 0)
-				|| (isExtended > 0) != ((raw->data.keyboard.Flags & RI_KEY_E0) == RI_KEY_E0))	// Plenty of checks here
-			{
-				// Turns out this raw input message wasn't the one we were looking for.
-				// Put it in the queue just like we did in the WM_INPUT case, and keep waiting.
-				Multikeys::PKeystrokeCommand possibleInput;
-				BOOL doBlock = remapper->evaluateKey(&(raw->data.keyboard), keyboardNameBuffer, &possibleInput);
-				decisionBuffer.push_back(DecisionRecord(raw->data.keyboard, possibleInput, doBlock));
-
-
-
-
-				/*--Checking for AltGr--*/
-				// Checking here because it never happens early
-				if (extractedScancode == SCANCODE_CONTROL		// Hook message generated by left control (scancode of LCtrl in translated set 2)
-					&& isExtended == FALSE			// left variant
-					&& virtualKeyCode == VK_CONTROL	// <- Control key (left variant, since isExtended is false)
-					&& keyPressed == 1)			// <- down
-				{
-					if (raw->data.keyboard.MakeCode == SCANCODE_ALT		// <- Raw Input is Alt key
-						&& raw->data.keyboard.Flags & RI_KEY_E0)	// Right variant
-					{
-						// then we won't wait for the LCtrl Raw Input message because it'll never happen.
-						AltGrBlockNextLCtrl = TRUE;
-
-						return TRUE;	// <- will block
-					}
-				}
-				// if a LCtrl keydown was blocked because it was part of an AltGr,
-				// we should block the very next LCtrl up. Except if another LCtrl down was sent along the way.
-				if (extractedScancode == SCANCODE_CONTROL	// scancode of Ctrl
-					&& isExtended == FALSE		//		<- left variant of
-					&& virtualKeyCode == VK_CONTROL	//	<- Control
-					&& keyPressed == 0)				//	<- up
-				{
-					if (AltGrBlockNextLCtrl)	// after a fake LCtrl down from an AltGr
-					{
-						AltGrBlockNextLCtrl = FALSE;
-						if (extractedScancode == SCANCODE_CONTROL && isExtended == FALSE && keyPressed == 0)
-							return TRUE;
-					}
-				}
-				// A Ctrl press while AltGr is down will cause AltGr to lose effect.
-				// That's okay because that happens normally. Do not be alarmed.
-				// Let's hope all keyboards we find use the translated scancode set 2.
-				// Or we'll have to implement support for different scancode sets.
-				/*--Finished checking for AltGr--*/
-			}
-			else
-			{
-				// This is truly the message we were looking for.
-				recordFound = TRUE;		// This will get us out of the loop.
-										// (the other way to exit the loop is by timing out)
-										// But we still didn't evaluate the raw message (it just arrived!)
-				Multikeys::PKeystrokeCommand possibleOutput;
-				blockThisHook = remapper->evaluateKey(&(raw->data.keyboard), keyboardNameBuffer, &possibleOutput);
-				// Immediately act on the input if there is one, since this decision won't be stored in the buffer
-				if (blockThisHook) {
-
-					if (!possibleOutput->execute(!keyPressed, previousStateFlagWasDown && keyPressed)) {
-#if DEBUG
-						OutputDebugString(L"WndProc: Command failed!!\n");
-#endif
-					}
-				}
-			}
-
-		}
+		} // end if match
 
 #if DEBUG
 		if (blockThisHook)
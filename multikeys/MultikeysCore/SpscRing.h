@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+
+// Fixed-capacity queue for passing values from exactly one producer thread to exactly one
+// consumer thread, without locks. T must be cheap to copy; Capacity must be a power of two.
+// Head and tail are kept in separate cache lines so the two threads don't slow each other down.
+template<typename T, size_t Capacity>
+class SpscRing
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+
+	T slots[Capacity];
+
+	// Position of the next value to be read; only written by the consumer.
+	alignas(64) std::atomic<size_t> head;
+	// Position of the next value to be written; only written by the producer.
+	alignas(64) std::atomic<size_t> tail;
+
+public:
+
+	SpscRing() : head(0), tail(0) { }
+
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+	// Producer only. Places a copy of value at the end of the queue.
+	// Returns false, without doing anything, if the queue is full.
+	bool push(const T& value)
+	{
+		size_t currentTail = tail.load(std::memory_order_relaxed);
+		if (currentTail - head.load(std::memory_order_acquire) == Capacity)
+			return false;
+		slots[currentTail & (Capacity - 1)] = value;
+		tail.store(currentTail + 1, std::memory_order_release);		// <- publishes the value
+		return true;
+	}
+
+	// Consumer only. Removes the value at the front of the queue and places it in out.
+	// Returns false, without doing anything, if the queue is empty.
+	bool pop(T& out)
+	{
+		size_t currentHead = head.load(std::memory_order_relaxed);
+		if (currentHead == tail.load(std::memory_order_acquire))
+			return false;
+		out = slots[currentHead & (Capacity - 1)];
+		head.store(currentHead + 1, std::memory_order_release);		// <- frees the slot
+		return true;
+	}
+
+	// Either thread. True if there was nothing in the queue at the moment of the call.
+	bool empty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+};
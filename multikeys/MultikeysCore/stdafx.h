@@ -23,7 +23,6 @@
 
 
 // Additional headers
-#include <deque>			// double-ended queues for holding decision records
 #include <string>			// std::string and std::wstring
 #include <vector>			// contiguous, iterable containers for keyboard structures
 #include <map>				// maps for dead keys
@@ -0,0 +1,162 @@
+#include "stdafx.h"
+
+#include "../MultikeysCore/DecisionBuffer.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace MultikeysTests
+{
+
+	// Decision for a key press of the given virtual key; tag is kept in the mapped action,
+	// so that decisions with the same key can be told apart.
+	static DecisionRecord MakeRecord(const USHORT vKey, const unsigned int tag, const BOOL decision = TRUE)
+	{
+		RAWKEYBOARD keyboard = {};
+		keyboard.VKey = vKey;
+		keyboard.MakeCode = vKey + 1;
+		keyboard.Flags = RI_KEY_MAKE;
+		Multikeys::KeystrokeAction action = {};
+		action.generation = tag;
+		return DecisionRecord(keyboard, action, decision);
+	}
+
+	static unsigned int KeyOf(const USHORT vKey)
+	{
+		return MakeDecisionKey(vKey, vKey + 1, false, false);
+	}
+
+
+	TEST_CLASS(DecisionBufferTests)
+	{
+	public:
+
+		TEST_METHOD(TakesDecisionWithMatchingKey)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			buffer.push(MakeRecord(0x41, 1, TRUE), 0);
+			buffer.push(MakeRecord(0x42, 2, FALSE), 0);
+
+			Assert::IsTrue(buffer.take(KeyOf(0x42), 0, &record));
+			Assert::AreEqual(2u, record.mappedAction.generation);
+			Assert::IsFalse(record.decision == TRUE);
+			Assert::IsTrue(buffer.take(KeyOf(0x41), 0, &record));
+			Assert::AreEqual(1u, record.mappedAction.generation);
+			Assert::IsTrue(record.decision == TRUE);
+
+			Assert::IsFalse(buffer.take(KeyOf(0x41), 0, &record));
+			Assert::IsFalse(buffer.take(KeyOf(0x43), 0, &record));
+		}
+
+		TEST_METHOD(TakesDecisionsWithSameKeyInOrder)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			for (unsigned int i = 0; i < 3; i++)
+				buffer.push(MakeRecord(0x41, i), 0);
+			for (unsigned int i = 0; i < 3; i++)
+			{
+				Assert::IsTrue(buffer.take(KeyOf(0x41), 0, &record));
+				Assert::AreEqual(i, record.mappedAction.generation);
+			}
+			Assert::IsFalse(buffer.take(KeyOf(0x41), 0, &record));
+		}
+
+		TEST_METHOD(OverwritesOldestDecisionWhenFull)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			for (USHORT i = 0; i <= DECISION_BUFFER_CAPACITY; i++)
+				buffer.push(MakeRecord(0x10 + i, i), 0);
+
+			Assert::IsFalse(buffer.take(KeyOf(0x10), 0, &record));
+			// Every other decision is still linked into its bucket
+			for (USHORT i = 1; i <= DECISION_BUFFER_CAPACITY; i++)
+			{
+				Assert::IsTrue(buffer.take(KeyOf(0x10 + i), 0, &record));
+				Assert::AreEqual((unsigned int)i, record.mappedAction.generation);
+			}
+		}
+
+		TEST_METHOD(OverwritesOldestDecisionWithSameKey)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			for (unsigned int i = 0; i < DECISION_BUFFER_CAPACITY + 2; i++)
+				buffer.push(MakeRecord(0x41, i), 0);
+
+			for (unsigned int i = 2; i < DECISION_BUFFER_CAPACITY + 2; i++)
+			{
+				Assert::IsTrue(buffer.take(KeyOf(0x41), 0, &record));
+				Assert::AreEqual(i, record.mappedAction.generation);
+			}
+			Assert::IsFalse(buffer.take(KeyOf(0x41), 0, &record));
+		}
+
+		TEST_METHOD(DiscardsExpiredDecisions)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			buffer.push(MakeRecord(0x41, 1), 0);
+			Assert::IsTrue(buffer.take(KeyOf(0x41), DECISION_MAX_AGE, &record));
+
+			buffer.push(MakeRecord(0x41, 2), 0);
+			Assert::IsFalse(buffer.take(KeyOf(0x41), DECISION_MAX_AGE + 1, &record));
+			// It was discarded, not just skipped
+			Assert::IsFalse(buffer.take(KeyOf(0x41), 0, &record));
+		}
+
+		TEST_METHOD(SkipsExpiredDecisionBeforeNewerOne)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			buffer.push(MakeRecord(0x41, 1), 0);
+			buffer.push(MakeRecord(0x41, 2), 900);
+			Assert::IsTrue(buffer.take(KeyOf(0x41), 1500, &record));
+			Assert::AreEqual(2u, record.mappedAction.generation);
+			Assert::IsFalse(buffer.take(KeyOf(0x41), 1500, &record));
+		}
+
+		TEST_METHOD(MeasuresAgeAcrossTickCountRollOver)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			buffer.push(MakeRecord(0x41, 1), 0xfffffff0);
+			Assert::IsTrue(buffer.take(KeyOf(0x41), 0x10, &record));
+		}
+
+		TEST_METHOD(DiscardsLateDecisionOfAbandonedHookMessage)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			buffer.abandon(KeyOf(0x41), 100);
+			buffer.push(MakeRecord(0x41, 1), 150);
+			Assert::IsFalse(buffer.take(KeyOf(0x41), 150, &record));
+
+			// Only one decision is discarded for each abandoned hook message
+			buffer.push(MakeRecord(0x41, 2), 160);
+			Assert::IsTrue(buffer.take(KeyOf(0x41), 160, &record));
+			Assert::AreEqual(2u, record.mappedAction.generation);
+		}
+
+		TEST_METHOD(KeepsDecisionThatArrivesAfterAbandonedOnesExpire)
+		{
+			DecisionBuffer buffer;
+			DecisionRecord record;
+
+			buffer.abandon(KeyOf(0x41), 0);
+			buffer.push(MakeRecord(0x41, 1), DECISION_ABANDONED_AGE + 1);
+			Assert::IsTrue(buffer.take(KeyOf(0x41), DECISION_ABANDONED_AGE + 1, &record));
+		}
+
+	};
+
+}
@@ -0,0 +1,219 @@
+#include "stdafx.h"
+
+#include "../MultikeysCore/HookCorrelator.h"
+
+#include <deque>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace MultikeysTests
+{
+
+	// Clock that only moves when the event source below waits.
+	class FakeClock : public ICorrelationClock
+	{
+	public:
+		unsigned int time;
+
+		FakeClock(const unsigned int start = 0) : time(start) { }
+
+		unsigned int now() override { return time; }
+	};
+
+
+	// Raw events that arrive at set times. Waiting moves the clock to the next arrival, or to the
+	// end of the wait if nothing arrives before then.
+	class FakeEventSource : public IRawEventSource
+	{
+	private:
+
+		struct Event
+		{
+			unsigned int arrival;
+			unsigned int key;
+			RawEventStatus status;
+		};
+
+		FakeClock* clock;
+		std::deque<Event> pending;
+
+		// Milliseconds until the next event arrives; zero or less if it already has.
+		int _untilNext() const { return (int)(pending.front().arrival - clock->time); }
+
+	public:
+
+		// Keys of every raw event taken, in order
+		std::vector<unsigned int> taken;
+		// Amount of times the correlator waited
+		unsigned int waitCount;
+
+		FakeEventSource(FakeClock* const clock) : clock(clock), waitCount(0) { }
+
+		// Adds a raw event that arrives delay milliseconds from now.
+		void arriveIn(const unsigned int delay, const unsigned int key,
+			const RawEventStatus status = RawEventStatus::Taken)
+		{
+			pending.push_back(Event{ clock->time + delay, key, status });
+		}
+
+		bool waitForEvent(const unsigned int timeout) override
+		{
+			waitCount++;
+			if (!pending.empty() && _untilNext() <= (int)timeout)
+			{
+				if (_untilNext() > 0)
+					clock->time = pending.front().arrival;
+				return true;
+			}
+			clock->time += timeout;
+			return false;
+		}
+
+		RawEventStatus takeEvent(const unsigned int hookKey, unsigned int& key) override
+		{
+			if (pending.empty() || _untilNext() > 0)
+				return RawEventStatus::None;
+			Event e = pending.front();
+			pending.pop_front();
+			key = e.key;
+			taken.push_back(e.key);
+			return e.status;
+		}
+	};
+
+
+	TEST_CLASS(HookCorrelatorTests)
+	{
+	public:
+
+		TEST_METHOD(MatchesRawEventAsSoonAsItArrives)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			source.arriveIn(5, 1);
+			Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+			Assert::AreEqual(5u, clock.time);
+			Assert::AreEqual(1u, source.waitCount);
+			Assert::AreEqual(1u, correlator.getMatchCount());
+		}
+
+		TEST_METHOD(TakesOtherRawEventsBeforeTheMatch)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			source.arriveIn(2, 7);
+			source.arriveIn(3, 8);
+			source.arriveIn(4, 1);
+			source.arriveIn(6, 9);
+			Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+			Assert::AreEqual((size_t)3, source.taken.size());
+			Assert::AreEqual(7u, source.taken[0]);
+			Assert::AreEqual(8u, source.taken[1]);
+			Assert::AreEqual(1u, source.taken[2]);
+			Assert::AreEqual(4u, clock.time);
+		}
+
+		TEST_METHOD(TimesOutWhenRawEventNeverArrives)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			Assert::AreEqual(CORRELATION_INITIAL_TIMEOUT, correlator.getTimeout());
+			Assert::IsTrue(correlator.await(1) == Correlation::TimedOut);
+			Assert::AreEqual(CORRELATION_INITIAL_TIMEOUT, clock.time);
+			Assert::AreEqual(1u, correlator.getTimeoutCount());
+			Assert::AreEqual(0u, correlator.getMatchCount());
+		}
+
+		TEST_METHOD(AbandonsWhenSourceSaysSo)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			source.arriveIn(1, 9, RawEventStatus::Abandon);
+			Assert::IsTrue(correlator.await(1) == Correlation::Abandoned);
+			Assert::AreEqual(0u, correlator.getMatchCount());
+			Assert::AreEqual(0u, correlator.getTimeoutCount());
+			Assert::AreEqual(CORRELATION_INITIAL_TIMEOUT, correlator.getTimeout());
+		}
+
+		TEST_METHOD(ShortDelaysLowerTheTimeoutToTheFloor)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			for (int i = 0; i < 50; i++)
+			{
+				source.arriveIn(0, 1);
+				Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+			}
+			Assert::AreEqual(CORRELATION_MIN_TIMEOUT, correlator.getTimeout());
+
+			// A raw event that arrives a whole scheduler tick late still matches
+			source.arriveIn(16, 1);
+			Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+		}
+
+		TEST_METHOD(LongerDelaysRaiseTheTimeout)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			for (int i = 0; i < 50; i++)
+			{
+				source.arriveIn(30, 1);
+				Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+			}
+			Assert::IsTrue(correlator.getTimeout() > 30);
+			Assert::IsTrue(correlator.getTimeout() < 40);
+		}
+
+		TEST_METHOD(TimeoutsDoubleTheTimeoutUntilTheNextMatch)
+		{
+			FakeClock clock;
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			source.arriveIn(0, 1);
+			correlator.await(1);
+			Assert::AreEqual(CORRELATION_MIN_TIMEOUT, correlator.getTimeout());
+
+			Assert::IsTrue(correlator.await(2) == Correlation::TimedOut);
+			Assert::AreEqual(CORRELATION_MIN_TIMEOUT * 2, correlator.getTimeout());
+			Assert::IsTrue(correlator.await(2) == Correlation::TimedOut);
+			Assert::AreEqual(CORRELATION_MIN_TIMEOUT * 4, correlator.getTimeout());
+			Assert::IsTrue(correlator.await(2) == Correlation::TimedOut);
+			Assert::AreEqual(CORRELATION_MAX_TIMEOUT, correlator.getTimeout());
+			Assert::IsTrue(correlator.await(2) == Correlation::TimedOut);
+			Assert::AreEqual(CORRELATION_MAX_TIMEOUT, correlator.getTimeout());
+			Assert::AreEqual(4u, correlator.getTimeoutCount());
+
+			source.arriveIn(0, 1);
+			Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+			Assert::AreEqual(CORRELATION_MIN_TIMEOUT, correlator.getTimeout());
+		}
+
+		TEST_METHOD(MeasuresDelaysAcrossClockRollOver)
+		{
+			FakeClock clock(0xfffffffa);
+			FakeEventSource source(&clock);
+			HookCorrelator correlator(&clock, &source);
+
+			source.arriveIn(10, 1);
+			Assert::IsTrue(correlator.await(1) == Correlation::Matched);
+			Assert::AreEqual(4u, clock.time);
+			// Same as a delay of 10 ms measured without rolling over
+			Assert::AreEqual(30u, correlator.getTimeout());
+		}
+
+	};
+
+}
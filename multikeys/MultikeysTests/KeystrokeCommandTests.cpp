@@ -0,0 +1,196 @@
+#include "stdafx.h"
+
+#include "../Remapper/KeystrokeCommands.h"
+#include "../Remapper/OutputSink.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace Multikeys;
+
+namespace MultikeysTests
+{
+
+	const size_t TEST_ARENA_RESERVE = 1024 * 1024;
+
+	// Steps of a macro that presses and releases a virtual key.
+	static std::vector<unsigned short> Tap(const BYTE vKey)
+	{
+		return std::vector<unsigned short>{ vKey, (unsigned short)(PROGRAM_STEP_RELEASE | vKey) };
+	}
+
+	static void AssertUnicode(const INPUT& keystroke, const WCHAR codeValue)
+	{
+		Assert::AreEqual((unsigned int)INPUT_KEYBOARD, (unsigned int)keystroke.type);
+		Assert::AreEqual((unsigned int)KEYEVENTF_UNICODE, (unsigned int)keystroke.ki.dwFlags);
+		Assert::AreEqual((unsigned int)codeValue, (unsigned int)keystroke.ki.wScan);
+		Assert::AreEqual(0u, (unsigned int)keystroke.ki.wVk);
+	}
+
+	static void AssertVirtualKey(const INPUT& keystroke, const BYTE vKey, const bool keyup)
+	{
+		DWORD flags = KEYEVENTF_EXTENDEDKEY | (keyup ? KEYEVENTF_KEYUP : 0);
+		Assert::AreEqual((unsigned int)INPUT_KEYBOARD, (unsigned int)keystroke.type);
+		Assert::AreEqual((unsigned int)flags, (unsigned int)keystroke.ki.dwFlags);
+		Assert::AreEqual((unsigned int)vKey, (unsigned int)keystroke.ki.wVk);
+	}
+
+
+	TEST_CLASS(KeystrokeCommandTests)
+	{
+	private:
+
+		Arena arena;
+		RecordingSink sink;
+		MacroCursor cursor;
+
+		UnicodeCommand* letterE;
+		UnicodeCommand* letterEAcute;
+		UnicodeCommand* letterX;
+		DeadKeyCommand* acute;
+
+	public:
+
+		KeystrokeCommandTests()
+			: arena(TEST_ARENA_RESERVE), cursor()
+		{
+			// Offset 0 belongs to the layout's root, never to a command
+			arena.make<unsigned long long>();
+
+			letterE = arena.make<UnicodeCommand>(arena, std::vector<unsigned int>{ 0x65 }, true);
+			letterEAcute = arena.make<UnicodeCommand>(arena, std::vector<unsigned int>{ 0xe9 }, true);
+			letterX = arena.make<UnicodeCommand>(arena, std::vector<unsigned int>{ 0x78 }, true);
+			acute = arena.make<DeadKeyCommand>(arena, std::vector<unsigned int>{ 0xb4 },
+				std::vector<UnicodeCommand*>{ letterE }, std::vector<UnicodeCommand*>{ letterEAcute });
+		}
+
+		TEST_METHOD(DeadKeyFollowedByReplacementSendsOnlyTheReplacement)
+		{
+			KeystrokeAction action = acute->resolve(arena, MakeCommandReference(arena, letterE));
+			Assert::IsTrue(action.deadKey.isNull());
+
+			Assert::IsTrue(ExecuteAction(arena, sink, action, false, false, &cursor));
+			sink.flush();
+			Assert::AreEqual((size_t)1, sink.keystrokes.size());
+			AssertUnicode(sink.keystrokes[0], 0xe9);
+			Assert::AreEqual(0u, cursor.command);
+
+			// Releasing the key sends nothing
+			Assert::IsTrue(ExecuteAction(arena, sink, action, true, false, &cursor));
+			sink.flush();
+			Assert::AreEqual((size_t)1, sink.keystrokes.size());
+			Assert::AreEqual((size_t)2, sink.batchSizes.size());
+			Assert::AreEqual((size_t)0, sink.batchSizes[1]);
+		}
+
+		TEST_METHOD(DeadKeyFollowedByOtherKeySendsBoth)
+		{
+			KeystrokeAction action = acute->resolve(arena, MakeCommandReference(arena, letterX));
+			Assert::IsFalse(action.deadKey.isNull());
+
+			Assert::IsTrue(ExecuteAction(arena, sink, action, false, false, &cursor));
+			sink.flush();
+			Assert::AreEqual((size_t)2, sink.keystrokes.size());
+			AssertUnicode(sink.keystrokes[0], 0xb4);
+			AssertUnicode(sink.keystrokes[1], 0x78);
+			// Both in a single batch
+			Assert::AreEqual((size_t)1, sink.batchSizes.size());
+		}
+
+		TEST_METHOD(DeadKeyFollowedByMacroSendsBoth)
+		{
+			std::vector<unsigned short> steps = Tap(0x41);
+			MacroCommand* macro = arena.make<MacroCommand>(arena, steps.data(), steps.size(), false);
+			KeystrokeAction action = acute->resolve(arena, MakeCommandReference(arena, macro));
+
+			Assert::IsTrue(ExecuteAction(arena, sink, action, false, false, &cursor));
+			sink.flush();
+			Assert::AreEqual((size_t)3, sink.keystrokes.size());
+			AssertUnicode(sink.keystrokes[0], 0xb4);
+			AssertVirtualKey(sink.keystrokes[1], 0x41, false);
+			AssertVirtualKey(sink.keystrokes[2], 0x41, true);
+		}
+
+		TEST_METHOD(MacroStopsAtEachDelayAndResumes)
+		{
+			const unsigned short steps[] = {
+				0x41, PROGRAM_STEP_DELAY | 20, PROGRAM_STEP_RELEASE | 0x41,
+				0x42, PROGRAM_STEP_RELEASE | 0x42, PROGRAM_STEP_DELAY | 5,
+				PROGRAM_STEP_TEXT | 1, 0x21
+			};
+			MacroCommand* macro = arena.make<MacroCommand>(arena, steps, sizeof(steps) / sizeof(steps[0]), false);
+			KeystrokeAction action = { KeystrokeCommand(), MakeCommandReference(arena, macro) };
+
+			Assert::IsTrue(ExecuteAction(arena, sink, action, false, false, &cursor));
+			sink.flush();
+			Assert::AreEqual(arena.offsetOf(macro), cursor.command);
+			Assert::AreEqual(20u, cursor.delay);
+
+			macro->resume(arena, sink, cursor);
+			sink.flush();
+			Assert::AreEqual(arena.offsetOf(macro), cursor.command);
+			Assert::AreEqual(5u, cursor.delay);
+
+			macro->resume(arena, sink, cursor);
+			sink.flush();
+			Assert::AreEqual(0u, cursor.command);
+
+			// One batch for each part between delays
+			Assert::AreEqual((size_t)3, sink.batchSizes.size());
+			Assert::AreEqual((size_t)1, sink.batchSizes[0]);
+			Assert::AreEqual((size_t)3, sink.batchSizes[1]);
+			Assert::AreEqual((size_t)1, sink.batchSizes[2]);
+			AssertVirtualKey(sink.keystrokes[0], 0x41, false);
+			AssertVirtualKey(sink.keystrokes[1], 0x41, true);
+			AssertVirtualKey(sink.keystrokes[2], 0x42, false);
+			AssertVirtualKey(sink.keystrokes[3], 0x42, true);
+			AssertUnicode(sink.keystrokes[4], 0x21);
+		}
+
+		TEST_METHOD(RepeatedBlockWithDelayStopsEveryTime)
+		{
+			const unsigned short steps[] = {
+				PROGRAM_STEP_REPEAT | 3, 0x42, PROGRAM_STEP_RELEASE | 0x42, PROGRAM_STEP_DELAY | 5, PROGRAM_STEP_END
+			};
+			MacroCommand* macro = arena.make<MacroCommand>(arena, steps, sizeof(steps) / sizeof(steps[0]), false);
+
+			Assert::IsTrue(ExecuteCommand(arena, sink, MakeCommandReference(arena, macro), false, false, &cursor));
+			sink.flush();
+			int resumes = 0;
+			while (cursor.command != 0)
+			{
+				macro->resume(arena, sink, cursor);
+				sink.flush();
+				resumes++;
+			}
+
+			Assert::AreEqual(3, resumes);
+			Assert::AreEqual((size_t)6, sink.keystrokes.size());
+			// The last part only ends the block
+			Assert::AreEqual((size_t)0, sink.batchSizes[3]);
+		}
+
+		TEST_METHOD(AbandonedMacroReleasesHeldKeys)
+		{
+			const unsigned short steps[] = {
+				0x10, 0x41, PROGRAM_STEP_DELAY | 100, PROGRAM_STEP_RELEASE | 0x41, PROGRAM_STEP_RELEASE | 0x10
+			};
+			MacroCommand* macro = arena.make<MacroCommand>(arena, steps, sizeof(steps) / sizeof(steps[0]), false);
+
+			Assert::IsTrue(ExecuteCommand(arena, sink, MakeCommandReference(arena, macro), false, false, &cursor));
+			sink.flush();
+			Assert::AreEqual(100u, cursor.delay);
+
+			// What happens to a waiting macro when the remapper stops
+			ProgramCommand::releaseHeldKeys(sink, cursor);
+			sink.flush();
+			Assert::AreEqual((size_t)4, sink.keystrokes.size());
+			AssertVirtualKey(sink.keystrokes[2], 0x10, true);
+			AssertVirtualKey(sink.keystrokes[3], 0x41, true);
+
+			ProgramCommand::releaseHeldKeys(sink, cursor);
+			sink.flush();
+			Assert::AreEqual((size_t)4, sink.keystrokes.size());
+		}
+
+	};
+
+}
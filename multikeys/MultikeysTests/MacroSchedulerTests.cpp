@@ -0,0 +1,141 @@
+#include "stdafx.h"
+
+#include "../Remapper/MacroScheduler.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace Multikeys;
+
+namespace MultikeysTests
+{
+
+	// Macro due at the given time; tag is kept in its generation, so that macros can be told apart.
+	static DelayedMacro MakeMacro(const unsigned long long due, const unsigned int tag)
+	{
+		DelayedMacro macro = {};
+		macro.generation = tag;
+		macro.due = due;
+		return macro;
+	}
+
+
+	TEST_CLASS(MacroSchedulerTests)
+	{
+	public:
+
+		TEST_METHOD(FiresMacrosWhenDueInOrder)
+		{
+			MacroScheduler scheduler;
+			DelayedMacro macro;
+
+			Assert::IsTrue(scheduler.schedule(MakeMacro(5, 1), 0));
+			Assert::IsTrue(scheduler.schedule(MakeMacro(3, 2), 0));
+			Assert::IsTrue(scheduler.schedule(MakeMacro(5, 3), 0));
+
+			Assert::IsFalse(scheduler.take(2, &macro));
+			Assert::IsTrue(scheduler.take(3, &macro));
+			Assert::AreEqual(2u, macro.generation);
+			Assert::IsFalse(scheduler.take(4, &macro));
+			Assert::IsTrue(scheduler.take(5, &macro));
+			Assert::AreEqual(1u, macro.generation);
+			Assert::IsTrue(scheduler.take(5, &macro));
+			Assert::AreEqual(3u, macro.generation);
+			Assert::IsFalse(scheduler.take(5, &macro));
+			Assert::AreEqual((size_t)0, scheduler.size());
+		}
+
+		TEST_METHOD(CascadesThroughAllLevels)
+		{
+			MacroScheduler scheduler;
+			DelayedMacro macro;
+
+			// One macro for each level, and one beyond the span of the whole wheel
+			const unsigned long long dues[] = { 10, 1000, 100000, 1000000 };
+			for (unsigned int i = 0; i < 4; i++)
+				Assert::IsTrue(scheduler.schedule(MakeMacro(dues[i], i), 0));
+
+			for (unsigned int i = 0; i < 4; i++)
+			{
+				Assert::IsFalse(scheduler.take(dues[i] - 1, &macro));
+				Assert::IsTrue(scheduler.take(dues[i], &macro));
+				Assert::AreEqual(i, macro.generation);
+				Assert::AreEqual(dues[i], macro.due);
+			}
+			Assert::AreEqual((size_t)0, scheduler.size());
+
+			const MacroSchedulerCounters& counters = scheduler.getCounters();
+			Assert::AreEqual(4ull, counters.scheduled);
+			Assert::AreEqual(4ull, counters.fired);
+			Assert::AreEqual(0ull, counters.totalLateness);
+			// Once for the second macro, twice for the third, and more for the last
+			Assert::IsTrue(counters.cascades >= 6);
+		}
+
+		TEST_METHOD(CountsLatenessOfMacrosTakenLate)
+		{
+			MacroScheduler scheduler;
+			DelayedMacro macro;
+
+			scheduler.schedule(MakeMacro(10, 1), 0);
+			scheduler.schedule(MakeMacro(12, 2), 0);
+			Assert::IsTrue(scheduler.take(15, &macro));
+			Assert::IsTrue(scheduler.take(15, &macro));
+			Assert::AreEqual(8ull, scheduler.getCounters().totalLateness);
+			Assert::AreEqual(5ull, scheduler.getCounters().maxLateness);
+		}
+
+		TEST_METHOD(MacroAlreadyDueIsReadyAtOnce)
+		{
+			MacroScheduler scheduler;
+			DelayedMacro macro;
+
+			scheduler.schedule(MakeMacro(50, 1), 100);
+			Assert::IsTrue(scheduler.take(100, &macro));
+			Assert::AreEqual(1u, macro.generation);
+		}
+
+		TEST_METHOD(TimeUntilNextWakesForDueMacrosAndCascades)
+		{
+			MacroScheduler scheduler;
+			DelayedMacro macro;
+
+			Assert::AreEqual((unsigned int)INFINITE, (unsigned int)scheduler.timeUntilNext(0));
+
+			scheduler.schedule(MakeMacro(10, 1), 0);
+			Assert::IsFalse(scheduler.take(0, &macro));
+			Assert::AreEqual(10u, (unsigned int)scheduler.timeUntilNext(0));
+			Assert::IsTrue(scheduler.take(10, &macro));
+
+			// Nothing in the finest level; wakes up when it wraps around, to cascade
+			scheduler.schedule(MakeMacro(1000, 2), 0);
+			Assert::IsFalse(scheduler.take(0, &macro));
+			Assert::AreEqual(MACRO_WHEEL_SLOTS, (unsigned int)scheduler.timeUntilNext(0));
+		}
+
+		TEST_METHOD(RejectsMacrosWhenPoolIsFull)
+		{
+			MacroScheduler scheduler;
+			DelayedMacro macro;
+
+			for (unsigned int i = 0; i < MAX_DELAYED_MACROS; i++)
+				Assert::IsTrue(scheduler.schedule(MakeMacro(10 + i % 100, i), 0));
+			Assert::IsFalse(scheduler.schedule(MakeMacro(10, 0), 0));
+			Assert::AreEqual(MAX_DELAYED_MACROS, scheduler.size());
+
+			// Taking one frees its entry
+			Assert::IsTrue(scheduler.take(10, &macro));
+			Assert::IsTrue(scheduler.schedule(MakeMacro(10, 0), 10));
+			Assert::IsFalse(scheduler.schedule(MakeMacro(10, 0), 10));
+
+			// Emptying the wheel takes everything, due or not
+			size_t taken = 0;
+			while (scheduler.takeAny(&macro))
+				taken++;
+			Assert::AreEqual(MAX_DELAYED_MACROS, taken);
+			Assert::AreEqual((size_t)0, scheduler.size());
+			Assert::AreEqual(1ull, scheduler.getCounters().fired);
+			Assert::IsTrue(scheduler.schedule(MakeMacro(200, 1), 10));
+		}
+
+	};
+
+}
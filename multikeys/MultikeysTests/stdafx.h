@@ -0,0 +1,20 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
+
+
+
+// Additional headers
+#include <Windows.h>			// for the Windows API
+#include <string>				// std::string and std::wstring
+#include <vector>				// contiguous, iterable containers
+
+// Headers for CppUnitTest
+#include "CppUnitTest.h"
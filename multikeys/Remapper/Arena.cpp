@@ -0,0 +1,72 @@
+#include "stdafx.h"
+#include "Arena.h"
+
+// Implementation of methods defined in Arena.h
+
+namespace Multikeys
+{
+	// Pages are committed in steps of this size, to avoid calling VirtualAlloc for every small object.
+	const size_t ARENA_COMMIT_STEP = 64 * 1024;
+
+	Arena::Arena(const size_t reserveSize)
+		: reserved(reserveSize), committed(0), used(0), mappedView(nullptr), parent(nullptr)
+	{
+		base = (BYTE*)VirtualAlloc(NULL, reserveSize, MEM_RESERVE, PAGE_READWRITE);
+		if (base == nullptr)
+			throw std::bad_alloc();
+	}
+
+	Arena::Arena(const void* const mappedView, const size_t offset, const size_t size)
+		: base((BYTE*)mappedView + offset), reserved(size), committed(size), used(size),
+		mappedView(mappedView), parent(nullptr)
+	{
+		// Since the arena is already full, allocating always throws std::bad_alloc.
+	}
+
+	Arena::Arena(const Arena& parent, const unsigned int offset, const size_t size)
+		: base(parent.base + offset), reserved(size), committed(size), used(size),
+		mappedView(nullptr), parent(&parent)
+	{
+		// Same as above; this arena is full from the start.
+	}
+
+	void* Arena::allocate(const size_t size, const size_t alignment)
+	{
+		size_t start = (used + alignment - 1) & ~(alignment - 1);
+		if (start + size > reserved || start + size < start)
+			throw std::bad_alloc();
+
+		if (start + size > committed)
+		{
+			// Commit enough pages to hold this allocation, rounded up to the commit step.
+			size_t newCommitted = (start + size + ARENA_COMMIT_STEP - 1) & ~(ARENA_COMMIT_STEP - 1);
+			if (newCommitted > reserved)
+				newCommitted = reserved;
+			if (VirtualAlloc(base + committed, newCommitted - committed, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+				throw std::bad_alloc();
+			committed = newCommitted;
+		}
+
+		used = start + size;
+		// Committed pages are zeroed by the system, and reset() zeroes whatever it releases.
+		return base + start;
+	}
+
+	void Arena::reset()
+	{
+		// Only memory this arena allocated may be reused.
+		if (mappedView != nullptr || parent != nullptr)
+			return;
+		ZeroMemory(base, used);
+		used = 0;
+	}
+
+	Arena::~Arena()
+	{
+		if (mappedView != nullptr)
+			UnmapViewOfFile(mappedView);
+		else if (parent == nullptr)
+			VirtualFree(base, 0, MEM_RELEASE);
+		// Parts of other arenas belong to their parent.
+	}
+}
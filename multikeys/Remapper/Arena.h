@@ -0,0 +1,117 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <new>			// std::bad_alloc and placement new
+#include <cstddef>		// std::max_align_t
+#include <utility>		// std::forward
+
+namespace Multikeys
+{
+
+	// Amount of address space reserved by default for one loaded configuration.
+	// Memory is only committed as it's used, so this is an upper limit, not a cost.
+	const size_t DEFAULT_ARENA_RESERVE = 64 * 1024 * 1024;
+
+	// Amount of address space reserved for compiling a single keyboard. Several keyboards may be
+	// compiled at once, each in an arena of its own, so this is smaller than the default.
+	const size_t KEYBOARD_ARENA_RESERVE = 16 * 1024 * 1024;
+
+
+	// This class is a bump allocator that holds everything belonging to one loaded
+	// configuration (commands, their keystroke buffers and the layer tables).
+	// It reserves a contiguous range of address space once and commits pages as they
+	// are needed, so objects never move and are packed next to each other.
+	// Nothing allocated here is freed individually: destroying the arena releases
+	// everything at once, without calling any destructor. Only place objects here
+	// whose destructors don't need to run (that is, objects that don't own memory
+	// outside of this arena).
+	// An arena may also be made over a read-only view of a file that contains a copy of
+	// another arena's memory (see LayoutImage.h), or over a part of another arena; nothing
+	// can be allocated in those.
+	class Arena
+	{
+	private:
+
+		// Start of the reserved range
+		BYTE * base;
+		// Size of the reserved range
+		const size_t reserved;
+		// Bytes at the start of the range that are already committed
+		size_t committed;
+		// Bytes at the start of the range that are already allocated
+		size_t used;
+		// Mapped view that contains this arena, or null if the arena was allocated in memory
+		const void * mappedView;
+		// Arena that contains this one, or null if this arena's memory is its own
+		const Arena * parent;
+
+	public:
+
+		// reserveSize - greatest amount of bytes this arena will ever hold.
+		Arena(const size_t reserveSize = DEFAULT_ARENA_RESERVE);
+
+		// Makes a full, read-only arena out of a mapped view of a file.
+		// mappedView - view returned by MapViewOfFile; it's unmapped when this arena is destroyed.
+		// offset - position of the arena's contents inside the view; should be a multiple of 64.
+		// size - amount of bytes in the arena.
+		Arena(const void* const mappedView, const size_t offset, const size_t size);
+
+		// Makes a full, read-only arena out of size bytes of parent, starting at offset.
+		// Positions in the new arena are relative to offset. parent must outlive the new arena.
+		Arena(const Arena& parent, const unsigned int offset, const size_t size);
+
+		// Not copyable; the memory belongs to a single arena.
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		// Returns a pointer to size bytes of zeroed memory, aligned to alignment
+		// (which must be a power of two). Throws std::bad_alloc if the arena is full,
+		// just like operator new.
+		void* allocate(const size_t size, const size_t alignment = alignof(std::max_align_t));
+
+		// Constructs an object of type T inside this arena.
+		template<typename T, typename... Args>
+		T* make(Args&&... args)
+		{
+			return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		}
+
+		// Allocates a zeroed array of count elements of type T, which must be a type that
+		// doesn't need to be constructed (such as INPUT or a pointer).
+		template<typename T>
+		T* makeArray(const size_t count)
+		{
+			return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+		}
+
+		// Position of an object allocated in this arena, relative to the start of the arena.
+		// Positions remain valid for as long as the arena exists, and are smaller than pointers.
+		inline unsigned int offsetOf(const void* const object) const
+		{
+			return (unsigned int)((const BYTE*)object - base);
+		}
+
+		// Object of type T at a position obtained from offsetOf.
+		template<typename T>
+		inline T* at(const unsigned int offset) const
+		{
+			return reinterpret_cast<T*>(base + offset);
+		}
+
+		// Releases everything allocated so far at once, so that the memory may be used again;
+		// every object in the arena is gone. The memory stays committed.
+		void reset();
+
+		// Amount of bytes allocated so far.
+		inline size_t size() const { return used; }
+
+		// Start of the arena's memory; the first size() bytes are the entire contents.
+		inline const void* data() const { return base; }
+
+		// Releases all memory at once (or unmaps it, if the arena was made from a view).
+		~Arena();
+
+	};
+
+}
@@ -0,0 +1,41 @@
+#include "stdafx.h"
+#include "CommandTable.h"
+#include "DeviceState.h"
+
+// Implementation of methods defined in CommandTable.h
+
+namespace Multikeys
+{
+	CommandTable::CommandTable(Arena& arena, const size_t layerCount)
+		: commands(1, KeystrokeCommand()),
+		cells(arena.makeArray<unsigned short>(layerCount * SCANCODE_TABLE_SIZE)),
+		layerCount(layerCount)
+	{ }
+
+	bool CommandTable::setCommand(const size_t layer, const Scancode sc, const KeystrokeCommand command)
+	{
+		if (layer >= layerCount)
+			return false;
+		// Positions are stored in 16 bits; position 0 is taken by the null command, and the
+		// last position is reserved for LATCHED_EMPTY_COMMAND.
+		if (commands.size() >= LATCHED_EMPTY_COMMAND)
+			return false;
+
+		cells[layer * SCANCODE_TABLE_SIZE + sc.index()] = (unsigned short)commands.size();
+		commands.push_back(command);
+		return true;
+	}
+
+	void CommandTable::compile(Arena& arena, OUT KeyboardImage *const image) const
+	{
+		KeystrokeCommand * compiledCommands = arena.makeArray<KeystrokeCommand>(commands.size());
+		memcpy(compiledCommands, commands.data(), commands.size() * sizeof(KeystrokeCommand));
+		image->commands = arena.offsetOf(compiledCommands);
+		image->commandCount = (unsigned int)commands.size();
+		image->cells = arena.offsetOf(cells);
+		image->layerCount = (unsigned int)layerCount;
+	}
+
+	// Commands and cells belong to the arena, which is released all at once.
+	CommandTable::~CommandTable() { }
+}
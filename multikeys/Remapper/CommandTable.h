@@ -0,0 +1,60 @@
+#pragma once
+
+#include "stdafx.h"
+#include "Scancode.h"
+#include "KeystrokeCommands.h"
+#include "Arena.h"
+#include "LayoutImage.h"
+
+namespace Multikeys
+{
+
+	// This class holds the remaps of every layer of a keyboard in a single contiguous table.
+	// Each row of the table is a layer, and each column is a scancode (see Scancode::index).
+	// Cells contain the position of a command in this object's list of commands, so that
+	// looking up a remap is a matter of indexing, without any hashing involved.
+	// Tables are only used while a layout is compiled; keyboards read the compiled copy
+	// (see compile()).
+	class CommandTable
+	{
+	private:
+
+		// Every command referenced by this table.
+		// The first element is always a null command, and is what empty cells point to.
+		std::vector<KeystrokeCommand> commands;
+
+		// layerCount rows of SCANCODE_TABLE_SIZE positions into the list of commands.
+		// This array is allocated in the configuration's arena.
+		unsigned short * cells;
+
+		const size_t layerCount;
+
+	public:
+
+		// arena - arena in which the cells are allocated; it must outlive this table.
+		// layerCount - amount of layers (rows) in the table. Every cell starts out empty.
+		CommandTable(Arena& arena, const size_t layerCount);
+
+		// Places a command in the cell identified by layer and scancode. The command must
+		// belong to the same arena as this table; this table does not delete it.
+		// Returns false if the layer is out of range or if no more commands fit in this table.
+		bool setCommand(const size_t layer, const Scancode sc, const KeystrokeCommand command);
+
+		// Receives a layer and a scancode and returns the command mapped to them.
+		// If there is no such command, a null command is returned.
+		inline KeystrokeCommand getCommand(const size_t layer, const Scancode sc) const
+		{
+			return commands[cells[layer * SCANCODE_TABLE_SIZE + sc.index()]];
+		}
+
+		// Places the list of commands in the arena (the cells are already there), and fills
+		// in the members of image that describe this table.
+		// arena - the same arena given to the constructor.
+		void compile(Arena& arena, OUT KeyboardImage *const image) const;
+
+		// Destructor
+		~CommandTable();
+
+	};
+
+}
@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "CompiledLayout.h"
+
+// Implementation of methods defined in CompiledLayout.h
+
+namespace Multikeys
+{
+	CompiledLayout::CompiledLayout(Arena* const arena, const unsigned int generation)
+		: refCount(1), generation(generation), arena(arena), fallback(nullptr)
+	{
+		const LayoutRoot* root = arena->at<const LayoutRoot>(0);
+		sections = arena->at<const KeyboardSection>(root->keyboards);
+		keyboardArenas.reserve(root->keyboardCount);
+		keyboards.reserve(root->keyboardCount);
+		for (unsigned int i = 0; i < root->keyboardCount; i++)
+		{
+			keyboardArenas.push_back(new Arena(*arena, sections[i].offset, sections[i].size));
+			keyboards.push_back(new Keyboard(keyboardArenas[i], i));
+		}
+
+		memset(touchedScancodes, 0, sizeof(touchedScancodes));
+		for (auto it = this->keyboards.begin(); it != this->keyboards.end(); it++)
+		{
+			const unsigned int* touched = (*it)->getTouchedScancodes();
+			for (size_t i = 0; i < SCANCODE_BITMAP_WORDS; i++)
+				touchedScancodes[i] |= touched[i];
+
+			// An empty string is used to represent "remap any non-remapped keyboard".
+			if ((*it)->deviceName.empty())
+			{
+				if (fallback == nullptr)
+					fallback = *it;
+			}
+			else
+			{
+				// emplace does nothing if the name is already there
+				keyboardByName.emplace((*it)->deviceName, *it);
+			}
+		}
+	}
+
+	void CompiledLayout::addRef() const
+	{
+		refCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void CompiledLayout::release() const
+	{
+		// The last thread to release this must see everything the others did with it
+		if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	bool CompiledLayout::findCompiledKeyboard(const unsigned long long sourceHash,
+		OUT CompiledKeyboard *const out_keyboard) const
+	{
+		// A hash of 0 means that the keyboard's source is not known
+		if (sourceHash == 0)
+			return false;
+		for (size_t i = 0; i < keyboards.size(); i++)
+		{
+			if (sections[i].sourceHash == sourceHash)
+			{
+				*out_keyboard = CompiledKeyboard{ arena->at<const BYTE>(sections[i].offset),
+					sections[i].size, sourceHash };
+				return true;
+			}
+		}
+		return false;
+	}
+
+	const Keyboard* CompiledLayout::findKeyboard(const wchar_t* const deviceName) const
+	{
+		auto found = keyboardByName.find(deviceName);
+		return (found == keyboardByName.end() ? fallback : found->second);
+	}
+
+	CompiledLayout::~CompiledLayout()
+	{
+		// Keyboards are views, and must be destroyed before the arena they look at.
+		for (auto it = keyboards.begin(); it != keyboards.end(); it++)
+			delete (*it);
+		for (auto it = keyboardArenas.begin(); it != keyboardArenas.end(); it++)
+			delete (*it);
+		// Then every command is released at once
+		delete arena;
+	}
+}
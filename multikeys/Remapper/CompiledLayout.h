@@ -0,0 +1,99 @@
+#pragma once
+
+#include "stdafx.h"
+#include "Keyboard.h"
+#include "Arena.h"
+#include "LayoutImage.h"
+
+#include <atomic>
+
+namespace Multikeys
+{
+
+	// Everything built from one successful load of the settings: every keyboard, and the arena
+	// that holds their commands. The arena is either freshly compiled or a mapped layout image.
+	// A compiled layout is never modified after it's constructed, so it may be shared by any
+	// number of users (such as the remapper evaluating live input, and another evaluating
+	// replayed or previewed input), each with its own DeviceStates.
+	// Sharing is done by reference count; the layout is destroyed when the last reference
+	// is released.
+	class CompiledLayout
+	{
+	private:
+
+		// Amount of references to this object; starts at one.
+		mutable std::atomic<unsigned long> refCount;
+
+		// Identifies this layout among every layout loaded by the same remapper.
+		const unsigned int generation;
+
+		// Holds everything of every keyboard, starting with a LayoutRoot.
+		Arena* arena;
+
+		// Sections of the arena, one per keyboard.
+		const KeyboardSection* sections;
+
+		// Every keyboard's section as an arena of its own (commands refer to positions in
+		// these), and a view over every keyboard, in the order they were loaded.
+		std::vector<Arena*> keyboardArenas;
+		std::vector<Keyboard*> keyboards;
+
+		// Keyboards by their full device name. Keyboards with an empty name are not here.
+		std::unordered_map<std::wstring, const Keyboard*> keyboardByName;
+
+		// Keyboard that receives input from every device that has no keyboard of its own;
+		// this is the keyboard with an empty name, or null if there's none.
+		const Keyboard* fallback;
+
+		// Union of the touched scancodes of every keyboard (see Keyboard::getTouchedScancodes).
+		unsigned int touchedScancodes[SCANCODE_BITMAP_WORDS];
+
+		// Only release() destroys this object.
+		~CompiledLayout();
+
+	public:
+
+		// arena - compiled layout, with a LayoutRoot at offset 0; ownership is transferred to this object.
+		// generation - distinct from every other layout loaded by the same remapper.
+		// If two keyboards have the same name, the first one is used.
+		// The new object has one reference, which belongs to the caller.
+		CompiledLayout(Arena* const arena, const unsigned int generation);
+
+		CompiledLayout(const CompiledLayout&) = delete;
+		CompiledLayout& operator=(const CompiledLayout&) = delete;
+
+		// Adds a reference to this object. Any thread may call this.
+		void addRef() const;
+
+		// Removes a reference to this object, and destroys it if that was the last one.
+		// Any thread may call this; the object must not be used afterwards.
+		void release() const;
+
+		// Arena that holds the commands of a keyboard of this layout; actions returned by that
+		// keyboard refer to commands in it. Returns null if there's no such keyboard.
+		inline const Arena* getKeyboardArena(const unsigned int index) const
+		{
+			return (index < keyboardArenas.size() ? keyboardArenas[index] : nullptr);
+		}
+
+		// Finds a keyboard that was compiled from settings with the given content hash, so that
+		// it can be placed in another layout without compiling it again (see AssembleLayout).
+		// Returns false if there's none.
+		bool findCompiledKeyboard(const unsigned long long sourceHash, OUT CompiledKeyboard *const out_keyboard) const;
+
+		// False if no keyboard of this layout remaps the key, nor uses it as a modifier.
+		inline bool touchesKey(const Scancode scancode) const
+		{
+			return TestScancodeBit(touchedScancodes, scancode.index());
+		}
+
+		// Actions made from this layout carry this value (see KeystrokeAction).
+		inline unsigned int getGeneration() const { return generation; }
+
+		// Returns the keyboard for the device with the given name (which may be the fallback),
+		// or null if no keyboard should evaluate that device's input.
+		const Keyboard* findKeyboard(const wchar_t* const deviceName) const;
+
+	};
+
+}
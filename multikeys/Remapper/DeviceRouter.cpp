@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "DeviceRouter.h"
+
+// Implementation of methods defined in DeviceRouter.h
+
+namespace Multikeys
+{
+	DeviceRouter::DeviceRouter()
+		: layout(nullptr), nameBuffer(128), capturingCount(0)
+	{ }
+
+	void DeviceRouter::update(RoutedDevice* const routed)
+	{
+		bool capturing = (routed->keyboard != nullptr && CapturesUnmappedKeys(routed->state));
+		if (capturing == routed->capturing)
+			return;
+		routed->capturing = capturing;
+		if (capturing)
+			capturingCount++;
+		else
+			capturingCount--;
+	}
+
+	void DeviceRouter::assign(const CompiledLayout* const layout)
+	{
+		this->layout = layout;
+		if (layout == nullptr)
+		{
+			deviceByHandle.clear();
+			capturingCount = 0;
+			return;
+		}
+
+		for (auto it = deviceByHandle.begin(); it != deviceByHandle.end(); it++)
+		{
+			RoutedDevice& routed = it->second;
+			const Keyboard* previous = routed.keyboard;
+			routed.keyboard = layout->findKeyboard(routed.deviceName.c_str());
+			if (routed.keyboard != nullptr)
+			{
+				if (previous == nullptr)
+				{
+					routed.keyboard->resetState(&routed.state);
+				}
+				else
+				{
+					DeviceState previousState = routed.state;
+					routed.keyboard->carryState(*previous, previousState, &routed.state);
+				}
+			}
+			update(&routed);
+		}
+	}
+
+	RoutedDevice* DeviceRouter::route(HANDLE const device)
+	{
+		auto cached = deviceByHandle.find(device);
+		if (cached != deviceByHandle.end())
+			return (cached->second.keyboard == nullptr ? nullptr : &(cached->second));
+
+		// First time this device is seen; get its name.
+		// Input without a device (such as simulated keystrokes) is never remapped.
+		if (device == NULL || layout == nullptr)
+			return nullptr;
+
+		UINT bufferSize = 0;
+		GetRawInputDeviceInfo(device, RIDI_DEVICENAME, NULL, &bufferSize);
+		if (bufferSize > nameBuffer.size())
+			nameBuffer.resize(bufferSize);
+		bufferSize = (UINT)nameBuffer.size();
+		if (GetRawInputDeviceInfo(device, RIDI_DEVICENAME, nameBuffer.data(), &bufferSize) == (UINT)-1)
+			return nullptr;		// Don't remember failures; the next keystroke will try again.
+
+		// Pointers to elements of an unordered_map remain valid when it grows
+		RoutedDevice& routed = deviceByHandle[device];
+		routed.deviceName = nameBuffer.data();
+		routed.capturing = false;
+		routed.keyboard = layout->findKeyboard(nameBuffer.data());
+		if (routed.keyboard == nullptr)
+			return nullptr;
+		routed.keyboard->resetState(&routed.state);
+		update(&routed);
+		return &routed;
+	}
+
+	void DeviceRouter::forget(HANDLE const device)
+	{
+		auto cached = deviceByHandle.find(device);
+		if (cached == deviceByHandle.end())
+			return;
+		if (cached->second.capturing)
+			capturingCount--;
+		deviceByHandle.erase(cached);
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "stdafx.h"
+#include "CompiledLayout.h"
+#include "DeviceState.h"
+
+namespace Multikeys
+{
+
+	// A device that was routed to a keyboard, along with that device's state.
+	struct RoutedDevice
+	{
+		// Keyboard that evaluates this device's input; null if there's none.
+		const Keyboard* keyboard;
+
+		// Name of the device, as given by the Raw Input API; kept for routing it again when
+		// another layout is assigned.
+		std::wstring deviceName;
+
+		// State of this device, as seen by keyboard.
+		DeviceState state;
+
+		// Whether state captures keys that the keyboard doesn't remap, as of the last update
+		// (see CapturesUnmappedKeys).
+		bool capturing;
+	};
+
+
+	// This class finds which keyboard of a compiled layout should evaluate the input of a given
+	// device, and keeps the state of every device it has seen.
+	// Raw Input device handles are remembered after their name is resolved once, so that
+	// routing a keystroke doesn't depend on the amount of keyboards.
+	// Each user of a compiled layout has its own router, so that their states don't mix.
+	class DeviceRouter
+	{
+	private:
+
+		// Layout whose keyboards are routed to; not owned by this object.
+		const CompiledLayout* layout;
+
+		// Cache of devices that were already routed, along with their states.
+		// Devices that are not routed to any keyboard are remembered with a null keyboard.
+		std::unordered_map<HANDLE, RoutedDevice> deviceByHandle;
+
+		// Work buffer for retrieving device names from the Raw Input API.
+		std::vector<WCHAR> nameBuffer;
+
+		// Amount of cached devices whose capturing flag is set.
+		unsigned int capturingCount;
+
+	public:
+
+		DeviceRouter();
+
+		// Replaces the layout to route to. Every cached device is routed again by name, and keeps
+		// as much of its state as the new keyboard allows (see Keyboard::carryState); the keyboards
+		// of the previous layout must still exist during this call.
+		// This object does not take a reference to the layout; it may be null.
+		void assign(const CompiledLayout* const layout);
+
+		// Returns the routed device for the given Raw Input handle, or null if no keyboard
+		// should evaluate that device's input. The device's name is only looked up the first
+		// time a handle is seen, and its state then starts out with nothing pressed.
+		// The returned pointer remains valid until the device is forgotten or a layout is assigned.
+		RoutedDevice* route(HANDLE const device);
+
+		// Call this after a device's state changes (such as after evaluating a key with it),
+		// so that the router knows whether any device is capturing keys.
+		void update(RoutedDevice* const routed);
+
+		// False if no device's state captures keys that its keyboard doesn't remap; keys that
+		// no keyboard remaps may then be passed through without routing them.
+		inline bool anyCapturing() const { return capturingCount != 0; }
+
+		// Forgets a cached device handle. Call this when a device is removed, since Windows
+		// may give its handle to another device later.
+		void forget(HANDLE const device);
+
+	};
+
+}
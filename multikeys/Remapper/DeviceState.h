@@ -0,0 +1,62 @@
+#pragma once
+
+#include "stdafx.h"
+#include "RemapperAPI.h"
+#include "Scancode.h"
+
+// DeviceState is a data type. No cpp implementation file exists.
+
+namespace Multikeys
+{
+
+	// Value of DeviceState::activeLayer when the current combination of modifiers
+	// corresponds to no layer.
+	const unsigned int NO_LAYER = 0xffffffff;
+
+	// Value of DeviceState::latched for a key that was pressed while no layer was active,
+	// and so resolved to EMPTY_COMMAND (which is not in any keyboard's command table).
+	// Command tables never hand out this position (see CommandTable::setCommand).
+	const unsigned short LATCHED_EMPTY_COMMAND = 0xffff;
+
+	// Everything that changes while a device is being used: which of its keyboard's modifiers
+	// are pressed, which keys are held down, and which dead key is waiting for the next character.
+	// Keyboards themselves never change after they're loaded; they read and update one of these
+	// instead, so that each device (and each user of a loaded layout) can have its own.
+	// This is plain data, and may be copied freely; it's only meaningful to the keyboard that
+	// initialized it (see Keyboard::resetState).
+	struct DeviceState
+	{
+		// One bit for each of the keyboard's modifiers, set if the modifier is currently pressed.
+		// (see ModifierStateMap)
+		unsigned int modifierMask;
+
+		// Row of the keyboard's command table activated by modifierMask; NO_LAYER if none.
+		unsigned int activeLayer;
+
+		// Dead key waiting for the next character; a null command when no dead key is active.
+		KeystrokeCommand pendingDeadKey;
+
+		// One bit per scancode index (see Scancode::index), set while that key is held down.
+		// Modifiers are not here; they're in modifierMask.
+		unsigned int pressed[SCANCODE_BITMAP_WORDS];
+
+		// Command that each key held down resolved to when it was pressed, as a position in the
+		// keyboard's commands (or LATCHED_EMPTY_COMMAND). Releases and repetitions of that key use
+		// this command, even if the active layer changed since. Only meaningful where pressed is set.
+		unsigned short latched[SCANCODE_TABLE_SIZE];
+
+		// Amount of keys held down that the keyboard doesn't touch; they were pressed while the
+		// state captured every key (see CapturesUnmappedKeys), and their release must be evaluated.
+		unsigned int capturedKeys;
+	};
+
+	// True if, in this state, keys that the keyboard doesn't remap may still be blocked:
+	// either a dead key is waiting for the next key press, or the modifiers that are pressed
+	// correspond to no layer (which blocks every key), or such a key was pressed in one of
+	// those states and is still held down.
+	inline bool CapturesUnmappedKeys(const DeviceState& state)
+	{
+		return state.activeLayer == NO_LAYER || !state.pendingDeadKey.isNull() || state.capturedKeys != 0;
+	}
+
+}
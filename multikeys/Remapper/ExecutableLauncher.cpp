@@ -0,0 +1,86 @@
+#include "stdafx.h"
+#include "ExecutableLauncher.h"
+
+#include <objbase.h>		// ShellExecute may need COM in the calling thread
+
+// Implementation of methods defined in ExecutableLauncher.h
+
+namespace Multikeys
+{
+	ExecutableLauncher::ExecutableLauncher()
+		: stopping(false), callback(nullptr), callbackContext(nullptr)
+	{
+		// The thread is started last, after every member it uses is initialized
+		worker = std::thread(&ExecutableLauncher::_run, this);
+	}
+
+	bool ExecutableLauncher::enqueue(const wchar_t* const filename, const wchar_t* const arguments)
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+
+		// Coalesce with an identical request that's still waiting (such as when the key
+		// was pressed many times in a row while the first launch was still under way)
+		for (auto it = queue.begin(); it != queue.end(); it++)
+		{
+			if (it->filename.compare(filename) == 0 && it->arguments.compare(arguments) == 0)
+				return true;
+		}
+
+		if (queue.size() >= LAUNCHER_QUEUE_CAPACITY)
+			return false;
+
+		queue.push_back(Request{ filename, arguments });
+		queueChanged.notify_one();
+		return true;
+	}
+
+	void ExecutableLauncher::setCallback(LaunchCallback const callback, void* const context)
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		this->callback = callback;
+		this->callbackContext = context;
+	}
+
+	void ExecutableLauncher::_run()
+	{
+		CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+
+		std::unique_lock<std::mutex> lock(queueMutex);
+		while (true)
+		{
+			queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (stopping)
+				break;
+
+			Request request = std::move(queue.front());
+			queue.pop_front();
+			LaunchCallback thisCallback = callback;
+			void* thisContext = callbackContext;
+
+			// Don't hold the lock while opening the file, so that enqueueing never waits for it
+			lock.unlock();
+			HINSTANCE retVal =
+				ShellExecute(NULL, L"open", request.filename.c_str(), request.arguments.c_str(), NULL, SW_SHOWNORMAL);
+			// Values above 32 mean success; anything else is an error code.
+			DWORD error = ((INT_PTR)retVal > 32 ? 0 : (DWORD)(INT_PTR)retVal);
+			if (thisCallback != nullptr)
+				thisCallback(request.filename.c_str(), request.arguments.c_str(), error, thisContext);
+			lock.lock();
+		}
+		lock.unlock();
+
+		CoUninitialize();
+	}
+
+	ExecutableLauncher::~ExecutableLauncher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopping = true;
+			queue.clear();
+		}
+		queueChanged.notify_one();
+		if (worker.joinable())
+			worker.join();
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "stdafx.h"
+#include "RemapperAPI.h"
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace Multikeys
+{
+
+	// Maximum amount of files waiting to be opened; requests beyond this are refused.
+	const size_t LAUNCHER_QUEUE_CAPACITY = 16;
+
+
+	// This class opens files (usually executables) in a thread of its own.
+	// Opening a file may take a long time, and ShellExecute would hold up the injector's output
+	// of every later keystroke; so the thread that executes commands only places a request in a queue.
+	// If the same file, with the same arguments, is requested again while the previous request
+	// is still waiting in the queue, both requests are coalesced into one.
+	class ExecutableLauncher
+	{
+	private:
+
+		struct Request
+		{
+			std::wstring filename;
+			std::wstring arguments;
+		};
+
+		// Requests waiting to be carried out, oldest first.
+		std::deque<Request> queue;
+
+		// Guards the queue, the callback and the stop flag.
+		std::mutex queueMutex;
+		// Signaled when a request is placed in the queue, or when the worker should stop.
+		std::condition_variable queueChanged;
+		bool stopping;
+
+		// Called by the worker after each request, with the result; may be null.
+		// The callback is called without holding the lock.
+		LaunchCallback callback;
+		void* callbackContext;
+
+		// Thread that opens the files.
+		std::thread worker;
+
+		// Body of the worker thread.
+		void _run();
+
+	public:
+
+		// Starts the worker thread.
+		ExecutableLauncher();
+
+		ExecutableLauncher(const ExecutableLauncher&) = delete;
+		ExecutableLauncher& operator=(const ExecutableLauncher&) = delete;
+
+		// Requests that a file be opened with the given arguments, and returns immediately.
+		// Returns false if the request was refused because the queue is full. Returns true if
+		// the request was queued or coalesced with an identical request already in the queue.
+		bool enqueue(const wchar_t* const filename, const wchar_t* const arguments);
+
+		// Sets the function that receives the result of each request (see LaunchCallback).
+		// The callback is called from the worker thread. Pass null to stop receiving results.
+		void setCallback(LaunchCallback const callback, void* const context);
+
+		// Stops the worker thread. Requests still in the queue are discarded, but a file
+		// that is already being opened is waited for.
+		~ExecutableLauncher();
+
+	};
+
+}
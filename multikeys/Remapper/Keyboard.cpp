@@ -6,53 +6,137 @@
 
 namespace Multikeys
 {
-	Keyboard::Keyboard(const std::wstring name,
-		const std::vector<Layer*>& layers, ModifierStateMap* modifiers)
-		: layers(layers), modifierStateMap(modifiers), deviceName(name)
+	Keyboard::Keyboard(const Arena* const arena, const unsigned int index)
+		: arena(arena), index(index), image(arena->at<const KeyboardImage>(0)),
+		modifierByScancode(arena->at<const unsigned char>(image->modifierByScancode)),
+		layerByState(arena->at<const unsigned int>(image->layerByState)),
+		commands(arena->at<const KeystrokeCommand>(image->commands)),
+		cells(arena->at<const unsigned short>(image->cells)),
+		touchedScancodes(arena->at<const unsigned int>(image->touchedScancodes)),
+		deviceName(arena->at<const wchar_t>(image->name), image->nameLength)
+	{ }
+
+
+	void Keyboard::Compile(Arena& arena, const std::wstring& name, const ModifierStateMap& modifiers,
+		const std::vector<Layer*>& layers, const CommandTable& commandTable, OUT KeyboardImage *const image)
 	{
-		noAction = new EmptyCommand();
-		activeDeadKey = nullptr;
+		wchar_t * compiledName = arena.makeArray<wchar_t>(name.size() + 1);		// <- zeroed, so null-terminated
+		memcpy(compiledName, name.data(), name.size() * sizeof(wchar_t));
+		image->name = arena.offsetOf(compiledName);
+		image->nameLength = (unsigned int)name.size();
 
-		// Initialize the current layer to whichever layer activates with no modifier
+		modifiers.compile(arena, image);
+		commandTable.compile(arena, image);
+
+		// Resolve every combination of modifiers into a layer beforehand
 		// Note: iterator dereferences into a pointer
-		this->activeLayer = nullptr;
-		for (auto it = this->layers.begin(); it != this->layers.end(); it++)
+		size_t stateCount = (size_t)1 << modifiers.getModifierCount();
+		unsigned int * compiledLayerByState = arena.makeArray<unsigned int>(stateCount);
+		for (size_t i = 0; i < stateCount; i++)
+			compiledLayerByState[i] = NO_LAYER;
+		for (auto it = layers.begin(); it != layers.end(); it++)
 		{
-			if (this->modifierStateMap->checkState(*it))
-			{
-				this->activeLayer = *it;
-				break;
-			}
+			if (compiledLayerByState[(*it)->modifierMask] == NO_LAYER)
+				compiledLayerByState[(*it)->modifierMask] = (unsigned int)(*it)->index;
 		}
+		image->layerByState = arena.offsetOf(compiledLayerByState);
+
+		// Mark every key that evaluateKey may do anything with, so that the others can skip it
+		unsigned int * touched = arena.makeArray<unsigned int>(SCANCODE_BITMAP_WORDS);		// <- zeroed
+		const unsigned char * compiledModifiers = arena.at<const unsigned char>(image->modifierByScancode);
+		const KeystrokeCommand * compiledCommands = arena.at<const KeystrokeCommand>(image->commands);
+		const unsigned short * compiledCells = arena.at<const unsigned short>(image->cells);
+		for (size_t sc = 0; sc < SCANCODE_TABLE_SIZE; sc++)
+		{
+			bool touches = compiledModifiers[sc] != 0;
+			for (size_t layer = 0; layer < image->layerCount && !touches; layer++)
+				touches = !compiledCommands[compiledCells[layer * SCANCODE_TABLE_SIZE + sc]].isNull();
+			if (touches)
+				touched[sc >> 5] |= 1u << (sc & 31);
+		}
+		image->touchedScancodes = arena.offsetOf(touched);
 	}
 
 
-	bool Keyboard::_updateKeyboardState(Scancode sc, bool flag_keyup)
+	bool Keyboard::_updateKeyboardState(DeviceState& state, Scancode sc, bool flag_keyup) const
 	{
-		// Update the state map
-		// If sc is not a modifier, this method will return false:
-		if (!modifierStateMap->updateState(sc, !flag_keyup))
+		// If sc is not a modifier, there's nothing to update
+		unsigned int entry = modifierByScancode[sc.index()];
+		if (entry == 0)
 			return false;
+		unsigned int bit = 1u << (entry - 1);
 
-		// Then, if a modifier changed state, update the currently active layer
-		// Note: iterator dereferences into a pointer
-		this->activeLayer = nullptr;
-		for (auto it = this->layers.begin(); it != this->layers.end(); it++)
+		if (flag_keyup)
+			state.modifierMask &= ~bit;
+		else
+			state.modifierMask |= bit;
+
+		// Then, since a modifier changed state, update the currently active layer
+		state.activeLayer = layerByState[state.modifierMask];
+		return true;
+	}
+
+
+	KeystrokeCommand Keyboard::_commandAt(const unsigned short position) const
+	{
+		return (position == LATCHED_EMPTY_COMMAND ? EMPTY_COMMAND : commands[position]);
+	}
+
+
+	void Keyboard::resetState(OUT DeviceState* const state) const
+	{
+		// Whichever layer activates with no modifier
+		state->modifierMask = 0;
+		state->activeLayer = layerByState[0];
+		state->pendingDeadKey = KeystrokeCommand();
+		// Latched commands are only read where pressed is set
+		memset(state->pressed, 0, sizeof(state->pressed));
+		state->capturedKeys = 0;
+	}
+
+
+	void Keyboard::carryState(const Keyboard& previous, const DeviceState& previousState,
+		OUT DeviceState* const state) const
+	{
+		resetState(state);
+
+		// Modifiers are compared by name, since their bits may have changed
+		for (unsigned int i = 0; i < previous.getModifierCount(); i++)
 		{
-			if (this->modifierStateMap->checkState(*it))
+			if ((previousState.modifierMask & (1u << i)) == 0)
+				continue;
+			for (unsigned int j = 0; j < getModifierCount(); j++)
 			{
-				this->activeLayer = *it;
-				break;
+				if (wcscmp(previous.getModifierName(i), getModifierName(j)) == 0)
+				{
+					state->modifierMask |= (1u << j);
+					break;
+				}
 			}
 		}
-		return true;
+		state->activeLayer = layerByState[state->modifierMask];
 	}
 
 
 	bool Keyboard::evaluateKey(
-		Scancode scancode, BYTE vKey, bool flag_keyup,
-		OUT PKeystrokeCommand*const out_action)
+		DeviceState& state, Scancode scancode, BYTE vKey, bool flag_keyup,
+		OUT PKeystrokeAction const out_action) const
 	{
+		const unsigned short index = scancode.index();
+		const bool touched = TestScancodeBit(touchedScancodes, index);
+		const bool held = TestScancodeBit(state.pressed, index);
+
+		// 0. Keys that nothing in this keyboard remaps are passed through at once, as long as
+		// the state doesn't capture them (by a dead key, or by modifiers that correspond to no layer),
+		// and they weren't pressed while it did.
+		if (!touched && !held
+			&& state.activeLayer != NO_LAYER
+			&& (flag_keyup || state.pendingDeadKey.isNull()))		// <- releases never resolve dead keys
+		{
+			*out_action = KeystrokeAction{ KeystrokeCommand(), KeystrokeCommand() };
+			return false;
+		}
+
 		// 1. Correct vKey code (left and right variants)
 		// This step is currently skipped because the corrected vkeycodes
 		// are not used anywhere else.
@@ -78,92 +162,75 @@ namespace Multikeys
 		}
 
 		// 2. Check if received key is a modifier.
-		if (_updateKeyboardState(scancode, flag_keyup))
+		if (_updateKeyboardState(state, scancode, flag_keyup))
 		{
 			// If so, return no action but still block the input.
 			// No scancode registered as modifier is allowed to also
 			// be mapped into something else.
-			*out_action = noAction;
+			*out_action = KeystrokeAction{ KeystrokeCommand(), EMPTY_COMMAND };
 			return true;	// Since no action should be taken, input should also be blocked.
 		}
 
-		// 3. Ask the currently active layer for the action corresponding to this.
-		// If there is no currently active layer (probably because of an invalid
+		// 3. A key that is held down (being released or repeated) keeps the command it was
+		// pressed with. Otherwise, ask the currently active layer for the action corresponding
+		// to this; if there is no currently active layer (probably because of an invalid
 		// combination of modifiers), then the resulting action should be no action.
-		BaseKeystrokeCommand* command;
-		if (activeLayer == nullptr)
+		unsigned short position;
+		if (held)
+			position = state.latched[index];
+		else if (state.activeLayer == NO_LAYER)
+			position = LATCHED_EMPTY_COMMAND;
+		else
+			position = cells[state.activeLayer * SCANCODE_TABLE_SIZE + index];
+		KeystrokeCommand command = _commandAt(position);
+
+		// Remember the key until it's released
+		unsigned int bit = 1u << (index & 31);
+		if (flag_keyup && held)
 		{
-			command = noAction;
+			state.pressed[index >> 5] &= ~bit;
+			if (!touched)
+				state.capturedKeys--;
 		}
-		else
+		else if (!flag_keyup && !held)
 		{
-			command = activeLayer->getCommand(scancode);
+			state.pressed[index >> 5] |= bit;
+			state.latched[index] = position;
+			if (!touched)
+				state.capturedKeys++;
 		}
 
 
 		// 4. In case of a keyup, we should not check for dead keys. That is, return immediately.
 		if (flag_keyup)
 		{
-			*out_action = command;	// <- even if it's null.
-			return command;			// true if command is not null
+			*out_action = KeystrokeAction{ KeystrokeCommand(), command };	// <- even if it's null.
+			return !command.isNull();
 		}
 
-		// 5. If there is an active dead key, the obtained command goes to it,
-		// then the dead key (containing the new command) is returned.
-		if (activeDeadKey)
+		// 5. If there is an active dead key, it decides what the obtained command
+		// becomes (even if the command is null or not Unicode), and is then cleared.
+		if (!state.pendingDeadKey.isNull())
 		{
-			if (command)		// Even if the command is not Unicode.
-				activeDeadKey->setNextCommand(command);
-			else
-				activeDeadKey->setNextCommand(vKey);
-
-			*out_action = activeDeadKey;
-			activeDeadKey = nullptr;
+			const DeadKeyCommand* deadKey = arena->at<DeadKeyCommand>(state.pendingDeadKey.offset);
+			*out_action = deadKey->resolve(*arena, command);
+			state.pendingDeadKey = KeystrokeCommand();
 			return true;
 		}
-		// 6. If obtained command is a dead key, it gets stored in this keyboard
-		// Try to cast it into a dead key; that will check if the object is a DeadKeyCommand,
-		// and will also result in the already cast pointer.
-		DeadKeyCommand* deadKeyCommand = dynamic_cast<DeadKeyCommand*>(command);
-		if (deadKeyCommand)
+		// 6. If obtained command is a dead key, it gets stored in the device's state
+		if (command.type == KeystrokeOutputType::DeadKeyCommand)
 		{
-			activeDeadKey = deadKeyCommand;
-			*out_action = noAction;
+			state.pendingDeadKey = command;
+			*out_action = KeystrokeAction{ KeystrokeCommand(), EMPTY_COMMAND };
 			return true;
 		}
 
 		// 7. Return the actual command
-		*out_action = command;	// even if it's null
-		return command;			// returns true if non-null
+		*out_action = KeystrokeAction{ KeystrokeCommand(), command };	// even if it's null
+		return !command.isNull();
 
 	}
 
 
-	void Keyboard::resetModifierState()
-	{
-		// Lets the modifier state take care of this
-		this->modifierStateMap->resetAllModifiers();
-		// But also update the current layer
-		for (auto it = this->layers.begin(); it != this->layers.end(); it++)
-		{
-			if (this->modifierStateMap->checkState(*it))
-			{
-				this->activeLayer = *it;
-				break;
-			}
-			this->activeLayer = nullptr;
-		}
-		return;
-	}
-
-	Keyboard::~Keyboard()
-	{
-		// Destroy all layers
-		for (auto it = this->layers.begin(); it != this->layers.end(); it++)
-		{
-			delete (*it);
-		}
-		// Destroy the modifier state map
-		delete this->modifierStateMap;
-	}
+	Keyboard::~Keyboard() { }
 }
\ No newline at end of file
@@ -3,65 +3,125 @@
 #include "stdafx.h"
 #include "Layer.h"
 #include "Modifier.h"
+#include "CommandTable.h"
+#include "DeviceState.h"
+#include "LayoutImage.h"
 
 namespace Multikeys
 {
+	// A keyboard's layout, as loaded from the settings. Objects of this class are not modified
+	// after they're constructed; the state of each device that uses a keyboard is kept in a
+	// DeviceState, so one keyboard may evaluate keys for any number of devices, from any thread.
+	// A keyboard is only a view over its section of a compiled layout's arena (which may be
+	// a mapped image file); it owns nothing, and looks everything up in place.
 	class Keyboard
 	{
 	private:
 
-		// Set of modifiers registered in this keyboard. This object will listen to
-		// these specific keys as modifiers and keep track of their state internally.
-		ModifierStateMap * modifierStateMap;
+		// This keyboard's section, which holds everything belonging to it, starting with
+		// its KeyboardImage. Not owned by this keyboard.
+		const Arena * arena;
 
-		// Initialize in constructor - keep an empty command in memory, since it's
-		// frequently returned.
-		BaseKeystrokeCommand* noAction;
+		// Position of this keyboard in its layout.
+		const unsigned int index;
 
-		// All layers belonging to this keyboard's layout
-		const std::vector<Layer*> layers;
-		// Const containers return const references.
+		// Everything as compiled; the tables below are found through it.
+		const KeyboardImage * image;
 
-		// Currently active layer; null if the current combination of modifiers corresponds
-		// to no layer.
-		Layer* activeLayer;
+		// Reverse index from scancode (see Scancode::index) to the bit of the modifier it triggers,
+		// plus one; 0 for scancodes that aren't modifiers. Built by ModifierStateMap.
+		const unsigned char * modifierByScancode;
 
-		// Pointer to a dead key waiting for the next character; null when no dead key is active.
-		DeadKeyCommand * activeDeadKey;
+		// Row of the command table activated by each combination of modifiers, indexed by
+		// state mask (see ModifierStateMap); NO_LAYER for combinations that correspond to no layer.
+		// If two layers have the same combination, the first one wins.
+		const unsigned int * layerByState;
+
+		// Remaps of every layer, indexed by layer and by scancode; each cell is a position in
+		// commands (see CommandTable).
+		const KeystrokeCommand * commands;
+		const unsigned short * cells;
+
+		// One bit per scancode index, set for modifiers and for keys that any layer remaps.
+		const unsigned int * touchedScancodes;
+
+		// Command at a position in commands, or EMPTY_COMMAND for LATCHED_EMPTY_COMMAND.
+		KeystrokeCommand _commandAt(const unsigned short position) const;
 
 		// Call this function to check for modifiers.
-		// If the key described by the parameters is a modifier, the internal state of
-		// this object is updated (as well as the active layer), and true is returned.
-		// If the key is not a modifier, no changes to internal state are made, and
-		// false is returned.
-		bool _updateKeyboardState(Scancode sc, bool flag_keyup);
+		// If the key described by the parameters is a modifier, state is updated
+		// (as well as its active layer), and true is returned.
+		// If the key is not a modifier, state is not changed, and false is returned.
+		bool _updateKeyboardState(DeviceState& state, Scancode sc, bool flag_keyup) const;
 
 	public:
 
 		// Public name of this device; wide string in conformity with the Raw Input API.
 		const std::wstring deviceName;
 
+		// arena - the keyboard's section of a compiled layout, as written by Compile; must outlive
+		//			this Keyboard object. Its tables must already be known to be inside the section
+		//			(see MapLayoutImage).
+		// index - position of the keyboard in its layout.
+		Keyboard(const Arena* const arena, const unsigned int index);
+
+		// Writes everything that describes a keyboard to the arena, and fills in image.
+		// The arena should hold nothing but this keyboard, and image should be its first object.
 		// name - Name to serve as unique identifier for this keyboard.
-		// layers - Pointers to layers; may delete after calling this.
-		// modifers - structure of ModiferStateMap already initialized with Modifiers
-		//			ownership of pointer is transferred to this Keyboard object.
-		Keyboard(const std::wstring name, const std::vector<Layer*>& layers, ModifierStateMap* modifiers);
+		// modifiers - modifiers registered in this keyboard.
+		// layers - all layers belonging to this keyboard's layout, in order.
+		// commandTable - remaps of all layers, one row per layer, allocated in arena.
+		// The caller may delete the layers, modifiers and table afterwards.
+		static void Compile(Arena& arena, const std::wstring& name, const ModifierStateMap& modifiers,
+			const std::vector<Layer*>& layers, const CommandTable& commandTable, OUT KeyboardImage *const image);
+
+		// Position of this keyboard in its layout (see CompiledLayout::getKeyboardArena).
+		inline unsigned int getIndex() const { return index; }
+
+		// Bitmap of the scancodes that are modifiers or that any layer remaps (see SCANCODE_BITMAP_WORDS).
+		// Other keys are passed through, unless the device's state captures them (see CapturesUnmappedKeys).
+		inline const unsigned int* getTouchedScancodes() const { return touchedScancodes; }
+
+		// Amount of modifiers of this keyboard; bits of state masks are below (1 << getModifierCount()).
+		inline unsigned int getModifierCount() const { return image->modifierCount; }
+
+		// Name of the modifier whose bit in state masks is (1 << index).
+		inline const wchar_t* getModifierName(const unsigned int index) const
+		{
+			return arena->at<const wchar_t>(arena->at<const unsigned int>(image->modifierNames)[index]);
+		}
+
+		// Places in state the state of a device that has nothing pressed and no active dead key.
+		// Every state must be initialized by this method before being used by evaluateKey.
+		void resetState(OUT DeviceState* const state) const;
+
+		// Places in state the state of a device that was using another keyboard (usually one
+		// from the settings this keyboard's settings replaced), as far as this keyboard allows:
+		// modifiers with the same name stay pressed, and any active dead key is dropped. Other keys
+		// held down are forgotten, since their commands belong to the previous keyboard; their
+		// releases are resolved by the active layer.
+		// previous - keyboard the device was using, which must still exist.
+		// previousState - state of the device in previous; may not be the same object as state.
+		void carryState(const Keyboard& previous, const DeviceState& previousState,
+			OUT DeviceState* const state) const;
 
 		// Receives information about a keypress, and returns true if the keystroke should
-		// be blocked.
+		// be blocked. The result depends only on this keyboard and on state.
+		// A key resolves to a command when it's pressed; its repetitions and its release resolve
+		// to the same command, whatever modifiers were pressed or released in the meantime.
+		// state - state of the device that sent the keypress, initialized by resetState;
+		//			it's updated to reflect this keypress.
 		// scancode - struct containing the scancode of the keypress to be evaluated
 		// vKey - virtual key code for the keypress to be evaluated, contained in a char.
 		// flag_keyup - true if this keystroke information is for a key release
-		// out_action - pointer to an IKeystrokeCommand*; if this function returns TRUE,
-		//			that pointer will point to the remapped command to be executed.
+		// out_action - pointer to a KeystrokeAction; if this function returns TRUE,
+		//			it will contain the remapped action to be executed. The action is
+		//			complete by itself, and may be executed at any later time.
 		bool evaluateKey(
-			Scancode scancode, BYTE vKey, bool flag_keyup,
-			OUT PKeystrokeCommand*const out_action);
-
-		// Set the internal state of all modifiers to unpressed.
-		void resetModifierState();
+			DeviceState& state, Scancode scancode, BYTE vKey, bool flag_keyup,
+			OUT PKeystrokeAction const out_action) const;
 
-		// Destructor
+		// Nothing to release; everything belongs to the arena.
 		~Keyboard();
 
 	};
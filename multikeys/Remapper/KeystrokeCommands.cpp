@@ -6,372 +6,489 @@
 namespace Multikeys
 {
 
-	/*
-	IKeystrokeCommand
-	*/
-
-	// destructors need an implementation, even if they are pure virtual.
-	IKeystrokeCommand::~IKeystrokeCommand() { }
-
 	/*
 	BaseKeystrokeCommand
 	*/
-	
-	BaseKeystrokeCommand::BaseKeystrokeCommand()
+
+	// Builds the prototypes once, when the library is loaded.
+	static INPUT MakePrototype(const DWORD flags)
 	{
-		// Initialize prototypes
-		//
-		// Prototypes exist to remove the derived classes' responsability to initialize their own INPUT
-		// structure every time. This means every derived class contains these prototypes, even if they
-		// don't need them; however, if everything goes correctly, the initialization of this class
-		// should never occur at runtime.
-
-		// When keyeventf_unicode is set, virtual key must be 0,
-		// and the UTF-16 code value is put into wScan
-		// Surrogate pairs require two consecutive inputs
-		unicodePrototype.type = INPUT_KEYBOARD;
-		unicodePrototype.ki.dwExtraInfo = 0;
-		unicodePrototype.ki.dwFlags = KEYEVENTF_UNICODE;
-		unicodePrototype.ki.time = 0;
-		unicodePrototype.ki.wVk = 0;
-
-
-		// Virtual keys are sent with the scancode e0 00 because our hook
-		// will filter these out (to avoid responding to injected keys)
-		VirtualKeyPrototypeDown.type = INPUT_KEYBOARD;
-		VirtualKeyPrototypeDown.ki.dwExtraInfo = 0;
-		VirtualKeyPrototypeDown.ki.dwFlags = KEYEVENTF_EXTENDEDKEY;
-		VirtualKeyPrototypeDown.ki.time = 0;
-		VirtualKeyPrototypeDown.ki.wScan = 0;
-
-		VirtualKeyPrototypeUp = VirtualKeyPrototypeDown;
-		VirtualKeyPrototypeUp.ki.dwFlags |= KEYEVENTF_KEYUP;
+		INPUT prototype;
+		ZeroMemory(&prototype, sizeof(INPUT));
+		prototype.type = INPUT_KEYBOARD;
+		prototype.ki.dwFlags = flags;
+		return prototype;
 	}
 
-	// pure virtual destructor still needs implementation.
-	BaseKeystrokeCommand::~BaseKeystrokeCommand() { }
+	// When keyeventf_unicode is set, virtual key must be 0,
+	// and the UTF-16 code value is put into wScan
+	// Surrogate pairs require two consecutive inputs
+	const INPUT BaseKeystrokeCommand::unicodePrototype = MakePrototype(KEYEVENTF_UNICODE);
 
+	// Virtual keys are sent with the scancode e0 00 because our hook
+	// will filter these out (to avoid responding to injected keys)
+	const INPUT BaseKeystrokeCommand::VirtualKeyPrototypeDown = MakePrototype(KEYEVENTF_EXTENDEDKEY);
+	const INPUT BaseKeystrokeCommand::VirtualKeyPrototypeUp = MakePrototype(KEYEVENTF_EXTENDEDKEY | KEYEVENTF_KEYUP);
 
 
-	/*
-	MacroCommand
-	*/
 
-	MacroCommand::MacroCommand(std::vector<unsigned short> * const keypresses, bool triggerOnRepeat)
+	// True if count objects of type T, starting at offset, are inside a section of sectionSize
+	// bytes, and properly aligned.
+	template<typename T>
+	static bool InSection(const size_t sectionSize, const unsigned int offset, const unsigned long long count)
 	{
-		MacroCommand(keypresses->data(), keypresses->size(), triggerOnRepeat);
+		return offset % alignof(T) == 0 && offset <= sectionSize
+			&& count * sizeof(T) <= sectionSize - offset;
 	}
 
-	MacroCommand::MacroCommand(const unsigned short *const keypressSequence, const size_t _inputCount, const bool _triggerOnRepeat)
-		: BaseKeystrokeCommand(), inputCount(_inputCount), triggerOnRepeat(_triggerOnRepeat)
-	{
-		if (keypressSequence == nullptr)
-			return;
 
-		keystrokes = new INPUT[_inputCount];
 
-		bool keyup = 0;
-		USHORT virtualKeyCode = 0;
-		for (unsigned int i = 0; i < _inputCount; i++)
+	/*
+	Programs
+	*/
+
+	void AppendTextSteps(const UINT * const codepoints, const size_t count, std::vector<unsigned short> *const program)
+	{
+		size_t header = 0;		// <- position of the text step being filled
+		for (size_t i = 0; i < count; i++)
 		{
-			keyup = (keypressSequence[i] >> 15) & 1;
-			virtualKeyCode = keypressSequence[i] & 0xff;
-			keystrokes[i] = INPUT(VirtualKeyPrototypeDown);
-			keystrokes[i].ki.wVk = virtualKeyCode;
-			if (keyup) keystrokes[i].ki.dwFlags |= KEYEVENTF_KEYUP;
-		}
+			// one UTF-16 code value per codepoint, or two for a surrogate pair
+			unsigned int units = (codepoints[i] > 0xffff ? 2 : 1);
+			if (i == 0 || (program->at(header) & PROGRAM_STEP_ARGUMENT) + units > PROGRAM_STEP_ARGUMENT)
+			{
+				header = program->size();
+				program->push_back(PROGRAM_STEP_TEXT);
+			}
+			(*program)[header] += (unsigned short)units;
 
+			if (units == 1)
+				program->push_back((unsigned short)codepoints[i]);
+			else
+			{
+				program->push_back((unsigned short)(0xd800 + ((codepoints[i] - 0x10000) >> 10)));
+				program->push_back((unsigned short)(0xdc00 + (codepoints[i] & 0x3ff)));
+			}
+		}
 	}
 
-	KeystrokeOutputType MacroCommand::getType() const
+	ProgramCommand::ProgramCommand(Arena& arena, const unsigned short *const steps, const size_t count, const bool triggerOnRepeat)
+		: program(0), programLength((unsigned int)count), triggerOnRepeat(triggerOnRepeat)
 	{
-		return KeystrokeOutputType::MacroCommand;
+		if (steps == nullptr)
+			programLength = 0;
+
+		// Only the steps themselves are kept; keystrokes are built when executing.
+		unsigned short * copy = arena.makeArray<unsigned short>(programLength);
+		if (programLength > 0)
+			memcpy(copy, steps, programLength * sizeof(unsigned short));
+		program = arena.offsetOf(copy);
 	}
 
-	bool MacroCommand::execute(bool keyup, bool repeated) const
+	bool ProgramCommand::execute(const Arena& arena, IOutputSink& sink, bool keyup, bool repeated,
+		OUT MacroCursor *const cursor) const
 	{
-		if (keyup)
+		cursor->command = 0;
+		if (keyup)	// Programs do not run on release
 			return TRUE;
 		else if (!repeated || (repeated && triggerOnRepeat))
-			return (SendInput(inputCount, keystrokes, sizeof(INPUT)) == inputCount ? TRUE : FALSE);
-		else return TRUE;
+		{
+			ZeroMemory(cursor, sizeof(MacroCursor));
+			cursor->command = arena.offsetOf(this);
+			resume(arena, sink, *cursor);
+		}
+		return TRUE;
 	}
 
-	MacroCommand::~MacroCommand()
+	bool ProgramCommand::isIntact(const BYTE* const section, const size_t sectionSize) const
 	{
-		delete[] keystrokes;
+		return InSection<unsigned short>(sectionSize, program, programLength);
 	}
 
-
-
-	/*
-	UnicodeCommand
-	*/
-
-	UnicodeCommand::UnicodeCommand(const std::vector<unsigned int>& codepoints, const bool triggerOnRepeat)
+	void ProgramCommand::resume(const Arena& arena, IOutputSink& sink, MacroCursor& cursor) const
 	{
-		inputCount = codepoints.size();
-		for (size_t i = 0; i < codepoints.size(); i++)
+		const unsigned short * steps = arena.at<unsigned short>(this->program);
+		unsigned int step = cursor.step;
+		while (step < programLength)
 		{
-			if (codepoints[i] > 0xffff)
-				inputCount++;		// <- correct the amount of inputs
-		}
-		keystrokes = new INPUT[inputCount];
+			unsigned short opcode = steps[step] & PROGRAM_STEP_OPCODE;
+			unsigned short argument = steps[step] & PROGRAM_STEP_ARGUMENT;
 
-		// Keep track of index inside the INPUT array:
-		size_t currentIndex = 0;
-		// Loop must use the amount of codepoints in vector, not the corrected amount of inputs:
-		for (size_t i = 0; i < codepoints.size(); i++)
-		{
-			if (codepoints[i] <= 0xffff)
+			if (opcode == PROGRAM_STEP_PRESS || opcode == PROGRAM_STEP_RELEASE)
 			{
-				// one UTF-16 code value, one simulated keypress
-				keystrokes[currentIndex] = INPUT(unicodePrototype);
-				keystrokes[currentIndex].ki.wScan = codepoints[i];
-				currentIndex++;
-				continue;
+				// Consecutive keypresses are appended together
+				unsigned int run = step + 1;
+				while (run < programLength && ((steps[run] & PROGRAM_STEP_OPCODE) == PROGRAM_STEP_PRESS
+					|| (steps[run] & PROGRAM_STEP_OPCODE) == PROGRAM_STEP_RELEASE))
+					run++;
+				INPUT * keystrokes = sink.appendKeystrokes(run - step);
+				for (unsigned int i = step; i < run; i++)
+				{
+					// High bit is set for a keyup; the low byte is the virtual key code
+					BYTE vkey = steps[i] & 0xff;
+					if (steps[i] & PROGRAM_STEP_RELEASE)
+					{
+						keystrokes[i - step] = VirtualKeyPrototypeUp;
+						cursor.held[vkey >> 5] &= ~(1u << (vkey & 31));
+					}
+					else
+					{
+						keystrokes[i - step] = VirtualKeyPrototypeDown;
+						cursor.held[vkey >> 5] |= 1u << (vkey & 31);
+					}
+					keystrokes[i - step].ki.wVk = vkey;
+				}
+				step = run;
 			}
-			else
+			else if (opcode == PROGRAM_STEP_TEXT)
 			{
-				// one UTF-16 surrogate pair, two simulated keypresses
-				uint16_t highSurrogate = 0xd800 + ((codepoints[i] - 0x10000) >> 10);
-				uint16_t lowSurrogate = 0xdc00 + (codepoints[i] & 0x3ff);
-				keystrokes[currentIndex] = INPUT(unicodePrototype);
-				keystrokes[currentIndex + 1] = INPUT(unicodePrototype);
-				keystrokes[currentIndex].ki.wScan = highSurrogate;
-				keystrokes[currentIndex + 1].ki.wScan = lowSurrogate;
-				currentIndex += 2;
-				continue;
+				// The code values follow the step; one simulated keypress each
+				if (step + 1 + argument > programLength)
+					break;		// <- never compiled like this
+				INPUT * keystrokes = sink.appendKeystrokes(argument);
+				for (unsigned int i = 0; i < argument; i++)
+				{
+					keystrokes[i] = unicodePrototype;
+					keystrokes[i].ki.wScan = steps[step + 1 + i];
+				}
+				step += 1 + argument;
+			}
+			else if (opcode == PROGRAM_STEP_DELAY)
+			{
+				cursor.step = step + 1;
+				cursor.delay = argument;
+				return;		// <- the caller decides when to continue
+			}
+			else if (opcode == PROGRAM_STEP_REPEAT)
+			{
+				// The block runs once now, and argument - 1 more times when its end is reached
+				cursor.repeatStart = step + 1;
+				cursor.repeatsLeft = (argument > 0 ? argument - 1u : 0u);
+				step++;
+			}
+			else if (opcode == PROGRAM_STEP_END)
+			{
+				if (cursor.repeatsLeft > 0)
+				{
+					cursor.repeatsLeft--;
+					step = cursor.repeatStart;
+				}
+				else
+					step++;
+			}
+			else if (opcode == PROGRAM_STEP_RESTORE)
+			{
+				releaseHeldKeys(sink, cursor);
+				step++;
 			}
+			else
+				break;		// <- unknown step; nothing after it can be trusted
 		}
+		cursor.command = 0;
 	}
 
-	UnicodeCommand::UnicodeCommand(const UINT * const codepoints, const UINT _inputCount, const bool _triggerOnRepeat)
-		: BaseKeystrokeCommand(), inputCount(_inputCount), triggerOnRepeat(_triggerOnRepeat)
-	{
-		if (codepoints == nullptr) return;
 
-		for (unsigned int i = 0; i < _inputCount; i++)
-		{
-			if (codepoints[i] > 0xffff)
-				inputCount++;			// <- actual amount of inputs
-		}
-		keystrokes = new INPUT[inputCount];
 
-		unsigned int currentIndex = 0;
-		for (unsigned int i = 0; i < _inputCount; i++)
+	void ProgramCommand::releaseHeldKeys(IOutputSink& sink, MacroCursor& cursor)
+	{
+		for (unsigned int word = 0; word < 8; word++)
 		{
-			if (codepoints[i] <= 0xffff)
+			for (unsigned int bit = 0; bit < 32; bit++)
 			{
-				// one UTF-16 code value, one simulated keypress
-				keystrokes[currentIndex] = INPUT(unicodePrototype);
-				keystrokes[currentIndex].ki.wScan = codepoints[i];
-				currentIndex++;
-				continue;		// next for
+				if ((cursor.held[word] & (1u << bit)) == 0)
+					continue;
+				INPUT * keystroke = sink.appendKeystrokes(1);
+				*keystroke = VirtualKeyPrototypeUp;
+				keystroke->ki.wVk = (WORD)(word * 32 + bit);
 			}
-			else
-			{
-				// UTF-16 surrogate pair, two simulated keypresses
-				uint16_t highSurrogate = 0xd800 + ((codepoints[i] - 0x10000) >> 10);
-				uint16_t lowSurrogate = 0xdc00 + (codepoints[i] & 0x3ff);
-				keystrokes[currentIndex] = INPUT(unicodePrototype);
-				keystrokes[currentIndex + 1] = INPUT(unicodePrototype);
-				keystrokes[currentIndex].ki.wScan = highSurrogate;
-				keystrokes[currentIndex + 1].ki.wScan = lowSurrogate;
-				currentIndex += 2;
-				continue;
-			}
-		}	// end for
-
+			cursor.held[word] = 0;
+		}
 	}
 
-	KeystrokeOutputType UnicodeCommand::getType() const
-	{
-		return KeystrokeOutputType::UnicodeCommand;
-	}
 
-	bool UnicodeCommand::execute(bool keyup, bool repeated) const
+
+	/*
+	MacroCommand
+	*/
+
+	MacroCommand::MacroCommand(Arena& arena, std::vector<unsigned short> * const keypresses, bool triggerOnRepeat)
+		: MacroCommand(arena, keypresses->data(), keypresses->size(), triggerOnRepeat)
+	{ }
+
+	MacroCommand::MacroCommand(Arena& arena, const unsigned short *const keypressSequence, const size_t _inputCount, const bool _triggerOnRepeat)
+		: ProgramCommand(arena, keypressSequence, _inputCount, _triggerOnRepeat)
+	{ }
+
+
+
+	/*
+	UnicodeCommand
+	*/
+
+	// FNV-1a hash of a sequence of 16-bit values.
+	static unsigned int HashSteps(const unsigned short * const steps, const size_t count)
 	{
-		if (keyup)	// Unicode keystrokes do not activate on release
-			return TRUE;
-		else if (!repeated || (repeated && triggerOnRepeat))
-			return (SendInput(inputCount, keystrokes, sizeof(INPUT)) == inputCount ? TRUE : FALSE);
-		else return TRUE;
+		unsigned int hash = 2166136261u;
+		for (size_t i = 0; i < count; i++)
+		{
+			hash ^= steps[i];
+			hash *= 16777619u;
+		}
+		return hash;
 	}
 
-	inline bool UnicodeCommand::operator==(const UnicodeCommand& rhs) const
+	// Compiles codepoints into a program; only used for constructing UnicodeCommand.
+	static std::vector<unsigned short> CompileText(const UINT * const codepoints, const UINT count)
 	{
-		if (inputCount != rhs.inputCount) return false;
-		// One by one, compare the keystroke inputs by codepoint.
-		// We trust that the rest of each INPUT structure is the same
-		for (size_t i = 0; i < inputCount; i++)
-			if (this->keystrokes[i].ki.wScan != rhs.keystrokes[i].ki.wScan)
-				return false;
-		return true;
+		std::vector<unsigned short> program;
+		if (codepoints != nullptr)
+			AppendTextSteps(codepoints, count, &program);
+		return program;
 	}
 
-	UnicodeCommand::~UnicodeCommand()
+	UnicodeCommand::UnicodeCommand(Arena& arena, const std::vector<unsigned int>& codepoints, const bool triggerOnRepeat)
+		: UnicodeCommand(arena, codepoints.data(), (UINT)codepoints.size(), triggerOnRepeat)
+	{ }
+
+	UnicodeCommand::UnicodeCommand(Arena& arena, const UINT * const codepoints, const UINT _inputCount, const bool _triggerOnRepeat)
+		: UnicodeCommand(arena, CompileText(codepoints, _inputCount), _triggerOnRepeat)
+	{ }
+
+	UnicodeCommand::UnicodeCommand(Arena& arena, const std::vector<unsigned short>& program, const bool _triggerOnRepeat)
+		: ProgramCommand(arena, program.data(), program.size(), _triggerOnRepeat),
+		sequenceHash(HashSteps(program.data(), program.size()))
+	{ }
+
+	bool UnicodeCommand::sameSequence(const Arena& arena, const UnicodeCommand& other) const
 	{
-		delete[] keystrokes;
+		if (programLength != other.programLength) return false;
+		// Equal sequences always compile into equal programs
+		return memcmp(arena.at<unsigned short>(this->program), arena.at<unsigned short>(other.program),
+			programLength * sizeof(unsigned short)) == 0;
 	}
 
 
 
 
+
 	/*
 	ExecutableCommand
 	*/
-	ExecutableCommand::ExecutableCommand(std::wstring filename, std::wstring arguments)
-		: BaseKeystrokeCommand(), filename(filename), arguments(arguments)
+	// Copies a string into the arena, including its null terminator, and returns its offset.
+	static unsigned int copyString(Arena& arena, const std::wstring& str)
+	{
+		wchar_t * copy = arena.makeArray<wchar_t>(str.size() + 1);
+		memcpy(copy, str.c_str(), (str.size() + 1) * sizeof(wchar_t));
+		return arena.offsetOf(copy);
+	}
+
+	ExecutableCommand::ExecutableCommand(Arena& arena, const std::wstring& filename, const std::wstring& arguments)
+		: filename(copyString(arena, filename)), arguments(copyString(arena, arguments))
 	{}
 
-	KeystrokeOutputType ExecutableCommand::getType() const
+	// True if a null-terminated string starts at offset and ends inside the section.
+	static bool StringInSection(const BYTE* const section, const size_t sectionSize, const unsigned int offset)
+	{
+		if (!InSection<wchar_t>(sectionSize, offset, 1))
+			return false;
+		const wchar_t* string = (const wchar_t*)(section + offset);
+		size_t length = (sectionSize - offset) / sizeof(wchar_t);
+		for (size_t i = 0; i < length; i++)
+			if (string[i] == L'\0') return true;
+		return false;
+	}
+
+	bool ExecutableCommand::isIntact(const BYTE* const section, const size_t sectionSize) const
 	{
-		return KeystrokeOutputType::ScriptCommand;
+		return StringInSection(section, sectionSize, filename) && StringInSection(section, sectionSize, arguments);
 	}
 
-	bool ExecutableCommand::execute(bool keyup, bool repeated) const
+	bool ExecutableCommand::execute(const Arena& arena, IOutputSink& sink, bool keyup, bool repeated) const
 	{
 		if (repeated || keyup) return TRUE;
 
 		// start process at filename
-
-		HINSTANCE retVal =
-			ShellExecute(NULL, L"open", filename.c_str(), arguments.c_str(), NULL, SW_SHOWNORMAL);
-		if ((LONG)retVal <= 32)
-			return FALSE;
-		// TODO: handle errors
-
-
-		return TRUE;
+		return sink.openFile(arena.at<wchar_t>(filename), arena.at<wchar_t>(arguments));
 	}
 
-	ExecutableCommand::~ExecutableCommand() { }
-
 
 
 	/*
 	DeadKeyCommand
 	*/
 
-	void DeadKeyCommand::_setNextCommand(BaseKeystrokeCommand*const command, const USHORT vKey)
-	{
-		if (command == nullptr)
-		{
-			// means that the input is not supposed to be blocked
-			// Might implement: Do not send this dead key's character if next key is either
-			//		escape or tab.
-			_nextCommand = nullptr;
-			_nextCommandType = 1;
-		}
-		else
-		{
-			// first, make sure that the command is unicode (dead keys inherit from it):
-
-			// All those that are not unicode are just placed as next command
-			if (command->getType() != KeystrokeOutputType::UnicodeCommand
-				&& command->getType() != KeystrokeOutputType::DeadKeyCommand)
-			{
-				_nextCommand = command;
-				_nextCommandType = 3;
-				return;
-			}
-
-			// It's a unicode (or dead key):
-			// compare its input sequence with the replacement list
-			// The map of replacements contains pointers, so using find() would actually
-			//		search by pointer. That doesn't work.
-			for (auto iterator = replacements.begin(); iterator != replacements.end(); iterator++)
-			{
-				// try to find the correct one (dereference pointers before comparing)
-				// The actual UnicodeCommand objects are different, so comparing pointers won't work.
-				if (*(iterator->first) == *(dynamic_cast<UnicodeCommand*>(command)))
-				{
-					// replace it
-					_nextCommand = iterator->second;
-					_nextCommandType = 4;
-					return;
-				}
-			}
-			// didn't find a suitable replacement
-			_nextCommand = command;
-			_nextCommandType = 2;
-
-		}
-	}
-
 	DeadKeyCommand::
-		DeadKeyCommand(const std::vector<unsigned int>& independentCodepoints,
-		const std::unordered_map<UnicodeCommand*, UnicodeCommand*>& replacements)
-		: UnicodeCommand(independentCodepoints, true),
-		replacements(replacements) { }
+		DeadKeyCommand(Arena& arena, const std::vector<unsigned int>& independentCodepoints,
+		const std::vector<UnicodeCommand*>& replacements_from,
+		const std::vector<UnicodeCommand*>& replacements_to)
+		: DeadKeyCommand(arena, (UINT*)independentCodepoints.data(), (UINT)independentCodepoints.size(),
+			(UnicodeCommand**)replacements_from.data(), (UnicodeCommand**)replacements_to.data(),
+			(UINT)replacements_from.size())
+	{ }
 
 	DeadKeyCommand::
-		DeadKeyCommand(UINT*const independentCodepoints, UINT const independentCodepointsCount,
+		DeadKeyCommand(Arena& arena, UINT*const independentCodepoints, UINT const independentCodepointsCount,
 		UnicodeCommand**const replacements_from, UnicodeCommand**const replacements_to,
 		UINT const replacements_count)
-		: UnicodeCommand(independentCodepoints, independentCodepointsCount, true),
-		_nextCommand(nullptr), _nextCommandType(0)
+		: UnicodeCommand(arena, independentCodepoints, independentCodepointsCount, true)
 	{
+		// Smallest power of two that leaves at least half of the slots empty
+		unsigned int slotCount = 2;
+		while (slotCount < replacements_count * 2)
+			slotCount <<= 1;
+		ReplacementSlot * slots = arena.makeArray<ReplacementSlot>(slotCount);		// <- zeroed, so every slot is empty
+		replacementSlots = arena.offsetOf(slots);
+		replacementSlotMask = slotCount - 1;
+
 		for (unsigned int i = 0; i < replacements_count; i++) {
-			replacements[replacements_from[i]] = replacements_to[i];
+			// If a sequence appears more than once, the first replacement is kept
+			if (_findReplacement(arena, *replacements_from[i]) != nullptr)
+				continue;
+			unsigned int hash = replacements_from[i]->getSequenceHash();
+			unsigned int slot = hash & replacementSlotMask;
+			while (slots[slot].from != 0)
+				slot = (slot + 1) & replacementSlotMask;
+			slots[slot].hash = hash;
+			slots[slot].from = arena.offsetOf(replacements_from[i]);
+			slots[slot].to = arena.offsetOf(replacements_to[i]);
 		}
 	}
 
-	void DeadKeyCommand::setNextCommand(BaseKeystrokeCommand*const command)
-	{
-		_setNextCommand(command, 0);
-	}
-	void DeadKeyCommand::setNextCommand(const USHORT vKey)
+	const UnicodeCommand * DeadKeyCommand::_findReplacement(const Arena& arena, const UnicodeCommand& command) const
 	{
-		_setNextCommand(nullptr, vKey);
+		const ReplacementSlot * slots = arena.at<ReplacementSlot>(replacementSlots);
+		unsigned int hash = command.getSequenceHash();
+		// The table is never full, so this always reaches an empty slot.
+		for (unsigned int slot = hash & replacementSlotMask;
+			slots[slot].from != 0;
+			slot = (slot + 1) & replacementSlotMask)
+		{
+			// The actual UnicodeCommand objects are different, so their sequences must be compared.
+			if (slots[slot].hash == hash
+				&& arena.at<UnicodeCommand>(slots[slot].from)->sameSequence(arena, command))
+				return arena.at<UnicodeCommand>(slots[slot].to);
+		}
+		return nullptr;
 	}
 
-	KeystrokeOutputType DeadKeyCommand::getType() const
+	bool DeadKeyCommand::isIntact(const BYTE* const section, const size_t sectionSize) const
 	{
-		return KeystrokeOutputType::DeadKeyCommand;
+		unsigned long long slotCount = (unsigned long long)replacementSlotMask + 1;
+		if (!UnicodeCommand::isIntact(section, sectionSize)
+			|| (slotCount & replacementSlotMask) != 0		// <- a power of two
+			|| !InSection<ReplacementSlot>(sectionSize, replacementSlots, slotCount))
+			return false;
+
+		const ReplacementSlot* slots = (const ReplacementSlot*)(section + replacementSlots);
+		bool empty = false;
+		for (unsigned long long i = 0; i < slotCount; i++)
+		{
+			if (slots[i].from == 0)
+			{
+				empty = true;
+				continue;
+			}
+			if (!InSection<UnicodeCommand>(sectionSize, slots[i].from, 1)
+				|| !InSection<UnicodeCommand>(sectionSize, slots[i].to, 1)
+				|| !((const UnicodeCommand*)(section + slots[i].from))->isIntact(section, sectionSize)
+				|| !((const UnicodeCommand*)(section + slots[i].to))->isIntact(section, sectionSize))
+				return false;
+		}
+		return empty;
 	}
 
-	bool DeadKeyCommand::execute(bool keyup, bool repeated) const
+	KeystrokeAction DeadKeyCommand::resolve(const Arena& arena, const KeystrokeCommand next) const
 	{
-		if (keyup) return TRUE;	// because unicode keyups do nothing
+		// Unless a replacement is found, send this key, then the next
+		KeystrokeAction action = { MakeCommandReference(arena, this), next };
+
+		// Null means that the input is not blocked, and only this key's character is sent.
+		// Might implement: Do not send this dead key's character if next key is either
+		//		escape or tab.
+
+		// Only unicode commands (and dead keys, which inherit from it) can be replaced
+		const UnicodeCommand* unicodeCommand;
+		if (next.type == KeystrokeOutputType::UnicodeCommand)
+			unicodeCommand = arena.at<UnicodeCommand>(next.offset);
+		else if (next.type == KeystrokeOutputType::DeadKeyCommand)
+			unicodeCommand = arena.at<DeadKeyCommand>(next.offset);
+		else
+			return action;
 
-								// First, check for an edge case: If the next input is this one
-								// That means infinite recursion because there's only one instance
-								// of each given dead key (so every of its pointers will point there)
-		if (_nextCommand == (BaseKeystrokeCommand*)this)
+		// Look up its input sequence in the table of replacements
+		const UnicodeCommand * replacement = _findReplacement(arena, *unicodeCommand);
+		if (replacement)
 		{
-			// just send this key twice
-			SendInput(inputCount, keystrokes, sizeof(INPUT));
-			SendInput(inputCount, keystrokes, sizeof(INPUT));
-			// then clear the next pointer
-			_nextCommand = nullptr;
+			// replace it; this dead key's own character is not sent
+			action.deadKey = KeystrokeCommand();
+			action.command = MakeCommandReference(arena, replacement);
 		}
+		return action;
+	}
 
-		// there is a replacement:
-		if (_nextCommandType == 4)
-		{
-			return (_nextCommand->execute(keyup, repeated));
-		}
 
-		// Situation is normal; send this key, then the next
-		SendInput(inputCount, keystrokes, sizeof(INPUT));
-		if (_nextCommand != nullptr)
-			return (_nextCommand->execute(keyup, repeated));
-		else
+
+	/*
+	Dispatch
+	*/
+
+	bool ExecuteCommand(const Arena& arena, IOutputSink& sink, const KeystrokeCommand command, bool keyup, bool repeated,
+		OUT MacroCursor *const cursor)
+	{
+		cursor->command = 0;
+		switch (command.type)
+		{
+		// Unicode outputs, macros and dead keys all run their program the same way
+		case KeystrokeOutputType::UnicodeCommand:
+			return arena.at<UnicodeCommand>(command.offset)->execute(arena, sink, keyup, repeated, cursor);
+		case KeystrokeOutputType::MacroCommand:
+			return arena.at<MacroCommand>(command.offset)->execute(arena, sink, keyup, repeated, cursor);
+		case KeystrokeOutputType::ScriptCommand:
+			return arena.at<ExecutableCommand>(command.offset)->execute(arena, sink, keyup, repeated);
+		case KeystrokeOutputType::DeadKeyCommand:
+			// By itself, a dead key only sends its own character
+			return arena.at<DeadKeyCommand>(command.offset)->execute(arena, sink, keyup, repeated, cursor);
+		case KeystrokeOutputType::NoCommand:
+		case KeystrokeOutputType::EmptyCommand:
+		default:
 			return TRUE;
+		}
 	}
 
-	DeadKeyCommand::~DeadKeyCommand()
+
+
+	bool CheckCommand(const BYTE* const section, const size_t sectionSize, const KeystrokeCommand command)
 	{
-		// is it necessary? --> delete _nextCommand;
-		for (auto iterator = replacements.begin(); iterator != replacements.end(); iterator++)
+		switch (command.type)
 		{
-			delete iterator->first;
-			delete iterator->second;
+		case KeystrokeOutputType::NoCommand:
+		case KeystrokeOutputType::EmptyCommand:
+			return true;		// <- their offset is never used
+		case KeystrokeOutputType::UnicodeCommand:
+			return InSection<UnicodeCommand>(sectionSize, command.offset, 1)
+				&& ((const UnicodeCommand*)(section + command.offset))->isIntact(section, sectionSize);
+		case KeystrokeOutputType::MacroCommand:
+			return InSection<MacroCommand>(sectionSize, command.offset, 1)
+				&& ((const MacroCommand*)(section + command.offset))->isIntact(section, sectionSize);
+		case KeystrokeOutputType::ScriptCommand:
+			return InSection<ExecutableCommand>(sectionSize, command.offset, 1)
+				&& ((const ExecutableCommand*)(section + command.offset))->isIntact(section, sectionSize);
+		case KeystrokeOutputType::DeadKeyCommand:
+			return InSection<DeadKeyCommand>(sectionSize, command.offset, 1)
+				&& ((const DeadKeyCommand*)(section + command.offset))->isIntact(section, sectionSize);
+		default:
+			return false;		// <- unknown type
 		}
 	}
 
 
 
+	bool ExecuteAction(const Arena& arena, IOutputSink& sink, const KeystrokeAction& action, bool keyup, bool repeated,
+		OUT MacroCursor *const cursor)
+	{
+		bool result = ExecuteCommand(arena, sink, action.deadKey, keyup, repeated, cursor);
+		return ExecuteCommand(arena, sink, action.command, keyup, repeated, cursor) && result;
+	}
+
+
+
 }
\ No newline at end of file
@@ -2,94 +2,169 @@
 
 #include "stdafx.h"
 #include "RemapperAPI.h"
-
-// Move implementations into KeystrokeCommands.cpp later, when everything is already working.
+#include "Arena.h"
 
 namespace Multikeys
 {
 
-	// enum classes are strongly typed
-	enum class KeystrokeOutputType
-	{
-		UnicodeCommand,
-		MacroCommand,
-		ScriptCommand,
-		DeadKeyCommand,
-		EmptyCommand
-	};
-
 	/*
-	BaseKeystrokeCommand - Base class for all commands, for internal use. Inherits from
-	IKeystrokeCommand, which is visible outside this library.
+	BaseKeystrokeCommand - Base class for all commands, for internal use.
+	Commands are constructed inside the Arena of the configuration they belong to, along with
+	their payloads, and are never deleted individually; their destructors do not run
+	when the arena is released, so commands must not own any memory outside of it.
+	Commands refer to their payloads (and to other commands) by offset in the arena, never by
+	pointer, and only contain fixed-size members, so that an arena can be saved to a file and
+	mapped again at any address (see LayoutImage.h). This is why executing needs the arena.
+	Commands have no virtual methods. They are referred to by a KeystrokeCommand (declared in
+	RemapperAPI.h), which holds the type of the command and its position in the arena, and
+	they're executed by ExecuteCommand, which chooses what to call based on that type.
+	Executing a command only appends its output to an IOutputSink; sending it is up to the caller.
+	Each command class has a static member "type" with the value that identifies it.
 	*/
-	class BaseKeystrokeCommand : public IKeystrokeCommand
+	class BaseKeystrokeCommand
 	{
 	protected:
-		INPUT unicodePrototype;
-		INPUT VirtualKeyPrototypeDown;
-		INPUT VirtualKeyPrototypeUp;
+		// Prototypes exist to remove the derived classes' responsability to initialize every
+		// member of an INPUT structure every time. They're shared by every command.
+		static const INPUT unicodePrototype;
+		static const INPUT VirtualKeyPrototypeDown;
+		static const INPUT VirtualKeyPrototypeUp;
+
+		// Commands only store their payload (a program of steps, or a path), and build the INPUT
+		// structures when they're executed, directly in the output sink's pending keystrokes.
+	};
 
-		BaseKeystrokeCommand();
 
-	public:
 
-		virtual KeystrokeOutputType getType() const = 0;
 
-		virtual bool execute(bool keyup, bool repeated) const override = 0;
 
-		virtual ~BaseKeystrokeCommand() override = 0;
-	};
 
+	// Macros and Unicode outputs are compiled into the same kind of program: a sequence of 16-bit
+	// steps, run in order. The high four bits of a step are its opcode, and the others are its
+	// argument. A macro without delays or repeated blocks is simply a sequence of virtual keys.
+	const unsigned short PROGRAM_STEP_OPCODE = 0xf000;
+	const unsigned short PROGRAM_STEP_ARGUMENT = 0x0fff;
 
+	const unsigned short PROGRAM_STEP_PRESS = 0x0000;	// <- presses the virtual key in the low byte
+	const unsigned short PROGRAM_STEP_RELEASE = 0x8000;	// <- releases the virtual key in the low byte
+	const unsigned short PROGRAM_STEP_DELAY = 0x4000;	// <- waits the argument, in milliseconds
+	const unsigned short PROGRAM_STEP_REPEAT = 0x2000;	// <- runs the steps up to the next PROGRAM_STEP_END argument times
+	const unsigned short PROGRAM_STEP_END = 0x1000;		// <- ends a repeated block
+	const unsigned short PROGRAM_STEP_TEXT = 0x3000;	// <- sends the argument amount of UTF-16 code values that follow it
+	const unsigned short PROGRAM_STEP_RESTORE = 0x5000;	// <- releases every virtual key pressed and not yet released
 
+	// Appends the steps that send a sequence of Unicode codepoints to program.
+	// Codepoints above 0xffff take two code values (a surrogate pair), and long sequences take
+	// several text steps.
+	void AppendTextSteps(const UINT * const codepoints, const size_t count, std::vector<unsigned short> *const program);
 
+	// Where a program stopped to wait for a delay, so that it can continue later (see ProgramCommand::resume).
+	// Plain data; it refers to the command by offset, so it's only meaningful along with its arena.
+	struct MacroCursor
+	{
+		// Offset of the command in its arena; 0 when the program has nothing left to do.
+		unsigned int command;
+		// Next step to run
+		unsigned int step;
+		// First step of the repeated block being run, and how many more times it runs after
+		// this time; repeatsLeft is 0 outside of a block.
+		unsigned int repeatStart;
+		unsigned int repeatsLeft;
+		// Milliseconds to wait before running the next step
+		unsigned int delay;
+		// Virtual keys that the program pressed and didn't release yet, one bit each
+		unsigned int held[8];
+	};
 
 
-	class MacroCommand : public BaseKeystrokeCommand
+	// Base class of the commands that run a program; this is the only code that builds keystrokes
+	// for them. Its steps are kept in the arena right after they're compiled.
+	class ProgramCommand : public BaseKeystrokeCommand
 	{
 
-	private:
+	protected:
 
-		INPUT * keystrokes;
-		size_t inputCount;
+		// Offset of the steps in the arena, and their amount.
+		unsigned int program;
+		unsigned int programLength;
 		bool triggerOnRepeat;
 
+		// Arena& arena - arena in which a copy of the steps is allocated.
+		// steps - may be deleted after this constructor returns.
+		ProgramCommand(Arena& arena, const unsigned short *const steps, const size_t count, const bool triggerOnRepeat);
+
 	public:
 
+		// Runs the program from the start when the key is pressed (and when it repeats, if
+		// triggerOnRepeat), and does nothing when it's released.
+		// arena - arena that holds this command.
+		// cursor - if the program reaches a delay, receives where it stopped (see resume);
+		//			otherwise its command is set to 0.
+		bool execute(const Arena& arena, IOutputSink& sink, bool keyup, bool repeated,
+			OUT MacroCursor *const cursor) const;
+
+		// Runs the steps of this program from cursor on, until the end or until the next delay.
+		// Keystrokes are built directly in the sink's pending output, a run at a time.
+		// cursor - where a previous execution stopped; it's updated to where this one stops,
+		//			or its command is set to 0 if the program ended.
+		void resume(const Arena& arena, IOutputSink& sink, MacroCursor& cursor) const;
+
+		// Appends the release of every virtual key held by cursor's program, and forgets them.
+		// Used by PROGRAM_STEP_RESTORE, and when a program is abandoned while waiting.
+		static void releaseHeldKeys(IOutputSink& sink, MacroCursor& cursor);
+
+		// True if the steps of this command are inside a section of sectionSize bytes that starts
+		// at section (see CheckCommand).
+		bool isIntact(const BYTE* const section, const size_t sectionSize) const;
+
+	};
+
+
+	class MacroCommand : public ProgramCommand
+	{
+
+	public:
+
+		static const KeystrokeOutputType type = KeystrokeOutputType::MacroCommand;
+
 		// STL constructor
-		MacroCommand(std::vector<unsigned short> * const keypresses, bool triggerOnRepeat);
+		MacroCommand(Arena& arena, std::vector<unsigned short> * const keypresses, bool triggerOnRepeat);
 
-		// unsigned short * keypressSequence - array of 16-bit values, each containing the virtual key code to be
-		//		sent (1 byte value), and also the high bit (most significant) set in case of a keyup. Every keypress
-		//		in this array will be sent in order of execution.
+		// Arena& arena - arena in which a copy of the sequence is allocated.
+		// unsigned short * keypressSequence - program steps (see PROGRAM_STEP_OPCODE). Most contain the
+		//		virtual key code to be sent (1 byte value), and also the high bit (most significant) set
+		//		in case of a keyup; the others are delays, repeats and their ends.
 		// USHORT _inputCount - number of elements in keypressSequence
 		// bool _triggerOnRepeat - true if this command should be triggered multiple times if user
 		//		holds down the key
-		MacroCommand(const unsigned short *const keypressSequence, const size_t _inputCount, const bool _triggerOnRepeat);
-
-		KeystrokeOutputType getType() const override;
-
-		bool execute(bool keyup, bool repeated) const override;
-
-		~MacroCommand() override;
+		MacroCommand(Arena& arena, const unsigned short *const keypressSequence, const size_t _inputCount, const bool _triggerOnRepeat);
 
 	};
 
-	class UnicodeCommand : public BaseKeystrokeCommand
+	class UnicodeCommand : public ProgramCommand
 	{
 
 	protected:
 
-		INPUT * keystrokes;
-		size_t inputCount;
-		bool triggerOnRepeat;
+		// Hash of the program of this command, calculated once on construction so that dead keys
+		// can look up replacements without reading the whole sequence. Programs that send the same
+		// sequence are always the same.
+		unsigned int sequenceHash;
+
+	private:
+
+		// Constructors end up here, once the codepoints are compiled.
+		UnicodeCommand(Arena& arena, const std::vector<unsigned short>& program, const bool _triggerOnRepeat);
 
 	public:
 
+		static const KeystrokeOutputType type = KeystrokeOutputType::UnicodeCommand;
+
 		// Constructor
 		// The caller may let this container go out of scope.
-		UnicodeCommand(const std::vector<unsigned int>& codepoints, const bool triggerOnRepeat);
+		UnicodeCommand(Arena& arena, const std::vector<unsigned int>& codepoints, const bool triggerOnRepeat);
 
+		// Arena& arena - arena in which the program is allocated.
 		// UINT codepoints - array of UINTs, each containing a single Unicode code point
 		//		identifying the character to be sent. All characters in this array will
 		//		be sent in order on execution.
@@ -97,16 +172,15 @@ namespace Multikeys
 		// UINT _inputCount - number of elements in codepoints
 		// bool _triggerOnRepeat - true if this command should be triggered multiple times if user
 		//		holds down the key
-		UnicodeCommand(const UINT * const codepoints, const UINT _inputCount, const bool _triggerOnRepeat);
-
-		KeystrokeOutputType getType() const override;
-
-		bool execute(bool keyup, bool repeated) const override;
+		UnicodeCommand(Arena& arena, const UINT * const codepoints, const UINT _inputCount, const bool _triggerOnRepeat);
 
 		// Comparing unicode keystrokes is important for a dead key.
-		inline bool operator==(const UnicodeCommand& rhs) const;
+		// True if both commands send the same sequence; both must belong to arena.
+		bool sameSequence(const Arena& arena, const UnicodeCommand& other) const;
+
+		// Hash of the UTF-16 sequence sent by this command; equal commands have equal hashes.
+		inline unsigned int getSequenceHash() const { return sequenceHash; }
 
-		~UnicodeCommand() override;
 	};
 
 
@@ -115,65 +189,71 @@ namespace Multikeys
 
 	protected:
 
-		std::wstring filename;
-		std::wstring arguments;
+		// Offsets of null-terminated copies of the strings passed to the constructor, kept in the arena.
+		unsigned int filename;
+		unsigned int arguments;
 
 	public:
 
+		static const KeystrokeOutputType type = KeystrokeOutputType::ScriptCommand;
+
+		// Arena& arena - arena in which copies of the strings are placed.
 		// std::wstring filename - The UTF-16 string containing a full path to the executable to be
 		//		opened when this command is executed. This command does not close the executable.
 		// std::wstring arguments - arguments to be passed to executable; multiple arguments must be
 		//		separated by space
 		// In practice, the file does not need to be an .exe executable specifically.
-		ExecutableCommand(std::wstring filename, std::wstring arguments = std::wstring());
-
-		KeystrokeOutputType getType() const override;
+		ExecutableCommand(Arena& arena, const std::wstring& filename, const std::wstring& arguments = std::wstring());
 
-		bool execute(bool keyup, bool repeated) const override;
+		// True if both strings end inside a section of sectionSize bytes that starts at section.
+		bool isIntact(const BYTE* const section, const size_t sectionSize) const;
 
-		~ExecutableCommand() override;
+		// arena - arena that holds this command.
+		bool execute(const Arena& arena, IOutputSink& sink, bool keyup, bool repeated) const;
 
 	};
 
 	// Dead keys are pressed before the key it modifies
 	class DeadKeyCommand : public UnicodeCommand
 	{
-		// Inherits keystrokes, keystroke count and trigger on repeat from UnicodeCommand
-		// Those fields describe this dead key as a standalone
+		// Inherits its UTF-16 sequence, keystroke count and trigger on repeat from UnicodeCommand
+		// Those fields describe this dead key as a standalone, and executing a dead key by itself
+		// sends only that. A dead key doesn't remember the key pressed after it; instead, resolve()
+		// produces an action with everything that the combination should do.
 	private:
-		// 0 : no next command
-		// 1 : unblocked command
-		// 2 : remapped to unicode without valid substitute
-		// 3 : remapped to non-unicode
-		// 4 : remapped to unicode with a substitute
-		// (another dead key will behave like a unicode)
-		USHORT _nextCommandType;
-
-		// Pointer to hold the command after this one.
-		// NULL until input is received; remains null if the next input
-		//		is not remapped (i. e. not blocked)
-		mutable BaseKeystrokeCommand * _nextCommand;
-		// mutable because this class's execute() is a const method that needs to modify it.
-
-		// If this command is being remembered as active, then the next keystroke will cause
-		// this method to be called.
-		// command - The next command pressed on the same keyboard, null if the key pressed
-		//		does not correspond to a remap.
-		// vKey - Virtual key code of the keystroke that generated this. Only for checking
-		//		special keys (esc, tab), and only present (non-zero) if command is null.
-		void _setNextCommand(BaseKeystrokeCommand*const command, const USHORT vKey);
-
-	public:
 
+		// One slot of the table of replacements; commands are referred to by offset in the arena.
+		// Offset 0 always belongs to the layout's root (see LayoutImage.h), never to a command.
+		struct ReplacementSlot
+		{
+			unsigned int hash;			// <- sequence hash of from, to skip most comparisons
+			unsigned int from;			// <- 0 in empty slots
+			unsigned int to;
+		};
+
+		// Replacements from Unicode codepoint sequence to Unicode outputs.
+		// Open addressing hash table in the arena, keyed by the UTF-16 sequence of the "from"
+		// command and probed linearly. Its size is a power of two, with at least half
+		// the slots empty, so a lookup reads very few slots regardless of the amount of replacements.
+		unsigned int replacementSlots;		// <- offset of the table
+		unsigned int replacementSlotMask;	// <- size of the table minus one
+
+		// Returns the replacement for a sequence equal to that of command, or null if there's none.
+		// arena - arena that holds this dead key and command.
+		const UnicodeCommand * _findReplacement(const Arena& arena, const UnicodeCommand& command) const;
 
-		// Replacements from Unicode codepoint sequence to Unicode outputs
-		std::unordered_map<UnicodeCommand*, UnicodeCommand*> replacements;
+	public:
 
+		static const KeystrokeOutputType type = KeystrokeOutputType::DeadKeyCommand;
 
 		// STL constructor
-		DeadKeyCommand(const std::vector<unsigned int>& independentCodepoints,
-			const std::unordered_map<UnicodeCommand*, UnicodeCommand*>& replacements);
+		// The replacement commands must have been constructed in the same arena.
+		DeadKeyCommand(Arena& arena, const std::vector<unsigned int>& independentCodepoints,
+			const std::vector<UnicodeCommand*>& replacements_from,
+			const std::vector<UnicodeCommand*>& replacements_to);
 
+		// Arena& arena - arena in which this dead key's arrays are allocated. The replacement
+		//								commands must have been constructed in the same arena.
 		// UINT* independentCodepoints - the Unicode character for this dead key
 		//								Array may be deleted after passing
 		// UINT independentCodepointCount - the number of unicode characters for this dead key
@@ -183,45 +263,55 @@ namespace Multikeys
 		// UnicodeCommand** replacements_to - array of commands that the codepoints map to
 		//								Array may be deleted after passing, but not each pointer
 		// UINT replacements_count - number of items in the previous arrays
-		DeadKeyCommand(UINT*const independentCodepoints, UINT const independentCodepointsCount,
+		DeadKeyCommand(Arena& arena, UINT*const independentCodepoints, UINT const independentCodepointsCount,
 			UnicodeCommand**const replacements_from, UnicodeCommand**const replacements_to,
 			UINT const replacements_count);
 
 
 
-		// Call when next input is received. This object needs to know the next key, in order to decide
-		//		what action to take when execute() is called on it.
-		// IkeystrokeOutput* const command - pointer to the command to be executed right after this key;
-		//		might be replaced if a match exists.
-		void setNextCommand(BaseKeystrokeCommand*const command);
-
-		// Call when next input is received, before using this dead key
-		// const USHORT vKey - the virtual key input by the user
-		void setNextCommand(const USHORT vKey);
-
-
-		KeystrokeOutputType getType() const override;
+		// Call when the next key is pressed on the same keyboard, to decide what that key should do.
+		// This object is not modified.
+		// arena - arena that holds this command and the next one.
+		// next - the command mapped to the next key; null if that key is not remapped.
+		// Returns an action that replaces next by its combination with this dead key, if there is one;
+		//		otherwise, an action that sends this dead key's character, then executes next.
+		KeystrokeAction resolve(const Arena& arena, const KeystrokeCommand next) const;
 
+		// True if this dead key's sequence, its table of replacements and every command in it are
+		// inside a section of sectionSize bytes that starts at section, and if the table has an
+		// empty slot (lookups stop at one).
+		bool isIntact(const BYTE* const section, const size_t sectionSize) const;
 
-		bool execute(bool keyup, bool repeated = FALSE) const override;
+	};
 
-		~DeadKeyCommand() override;
 
-	};
 
+	// Builds the reference to a command constructed in the arena.
+	template<typename T>
+	inline KeystrokeCommand MakeCommandReference(const Arena& arena, const T* const command)
+	{
+		return KeystrokeCommand{ T::type, arena.offsetOf(command) };
+	}
 
+	// Reference to a command that performs no action when executed (good for modifier keys)
+	const KeystrokeCommand EMPTY_COMMAND = { KeystrokeOutputType::EmptyCommand, 0 };
 
+	// Executes the command referenced by command, which must belong to arena, according to its type.
+	// Output is appended to sink, which is not flushed.
+	// Null and empty commands do nothing and succeed.
+	// cursor - receives where a program stopped to wait for a delay; its command is 0 if nothing waits.
+	bool ExecuteCommand(const Arena& arena, IOutputSink& sink, const KeystrokeCommand command, bool keyup, bool repeated,
+		OUT MacroCursor *const cursor);
 
-	// Dummy output that performs no action when executed (good for modifier keys)
-	class EmptyCommand : public BaseKeystrokeCommand
-	{
-	public:
+	// Checks that a command read from a layout image (see LayoutImage.h) can be executed without
+	// reading outside its keyboard's section: its type must be known, and the command and
+	// everything it refers to must be inside the section. Doesn't look at any other command.
+	bool CheckCommand(const BYTE* const section, const size_t sectionSize, const KeystrokeCommand command);
 
-		EmptyCommand() : BaseKeystrokeCommand() {}
-		KeystrokeOutputType getType() const override { return KeystrokeOutputType::EmptyCommand; }
-		bool execute(bool keyup, bool repeated = FALSE) const override { return TRUE; }
-		~EmptyCommand() override {}
-	};
+	// Executes both parts of an action, in order; see ExecuteCommand.
+	// Only the second part may be a macro, so only it may leave something waiting in cursor.
+	bool ExecuteAction(const Arena& arena, IOutputSink& sink, const KeystrokeAction& action, bool keyup, bool repeated,
+		OUT MacroCursor *const cursor);
 
 
-}
\ No newline at end of file
+}
@@ -5,31 +5,13 @@
 
 namespace Multikeys
 {
-	Layer::Layer(const std::vector<std::wstring>& _modifierCombination,
-		const std::unordered_map<Scancode, BaseKeystrokeCommand*>& _layout)
-		:	modifierCombination(_modifierCombination),
-			layout(_layout)
+	Layer::Layer(const unsigned int _modifierMask, const size_t _index)
+		:	modifierMask(_modifierMask),
+			index(_index)
 	{ }
 
-	BaseKeystrokeCommand* Layer::getCommand(Scancode sc) const
-	{
-		// Because maps do not allow duplicate keys,
-		// unordered_map::count actually returns either 0 or 1
-		// and is used to tell whether a key exists in the map.
-		return (
-			layout.count(sc) == 0 ?		// <- true if not found
-			nullptr :
-			layout.at(sc)
-			);
-	}
-
 	Layer::~Layer()
 	{
-		// Delete every command.
-		// No command appears in more than one layer, or in more than one keyboard.
-		for (auto it = this->layout.begin(); it != this->layout.end(); it++)
-		{
-			delete it->second;
-		}
+		// Commands belong to the keyboard's command table, not to the layer.
 	}
 }
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "stdafx.h"
+#include "LayoutImage.h"
+#include "Scancode.h"
+#include "Modifier.h"
+#include "RemapperAPI.h"
+#include "DeviceState.h"
+#include "KeystrokeCommands.h"
+
+// Implementation of functions defined in LayoutImage.h
+
+namespace Multikeys
+{
+	static_assert(sizeof(LayoutImageHeader) == 64, "The arena must start at a multiple of 64 bytes");
+
+	// True if size bytes starting at offset are all inside an arena of arenaSize bytes.
+	static bool InArena(const size_t arenaSize, const unsigned int offset, const unsigned long long size)
+	{
+		return offset <= arenaSize && size <= arenaSize - offset;
+	}
+
+	// Checks that every table of a keyboard is inside its section, that the tables only refer to
+	// positions inside each other, and that every command (with whatever it refers to) is inside
+	// the section as well, so that a damaged image can't make a keyboard read outside of it.
+	static bool CheckKeyboard(const BYTE* const section, const size_t sectionSize)
+	{
+		if (sectionSize < sizeof(KeyboardImage))
+			return false;
+		const KeyboardImage& keyboard = *(const KeyboardImage*)section;
+		if (keyboard.modifierCount > MAX_MODIFIERS || keyboard.commandCount == 0 || keyboard.commandCount > LATCHED_EMPTY_COMMAND
+			|| !InArena(sectionSize, keyboard.name, ((unsigned long long)keyboard.nameLength + 1) * sizeof(wchar_t))
+			|| !InArena(sectionSize, keyboard.modifierNames, (unsigned long long)keyboard.modifierCount * sizeof(unsigned int))
+			|| !InArena(sectionSize, keyboard.modifierByScancode, SCANCODE_TABLE_SIZE)
+			|| !InArena(sectionSize, keyboard.layerByState, (1ull << keyboard.modifierCount) * sizeof(unsigned int))
+			|| !InArena(sectionSize, keyboard.commands, (unsigned long long)keyboard.commandCount * sizeof(KeystrokeCommand))
+			|| !InArena(sectionSize, keyboard.cells,
+				(unsigned long long)keyboard.layerCount * SCANCODE_TABLE_SIZE * sizeof(unsigned short))
+			|| !InArena(sectionSize, keyboard.touchedScancodes, SCANCODE_BITMAP_WORDS * sizeof(unsigned int)))
+			return false;
+
+		// Tables index each other, so their values must be in range as well
+		const BYTE* modifierByScancode = section + keyboard.modifierByScancode;
+		for (size_t j = 0; j < SCANCODE_TABLE_SIZE; j++)
+			if (modifierByScancode[j] > keyboard.modifierCount) return false;
+		const unsigned int* layerByState = (const unsigned int*)(section + keyboard.layerByState);
+		for (size_t j = 0; j < ((size_t)1 << keyboard.modifierCount); j++)
+			if (layerByState[j] != NO_LAYER && layerByState[j] >= keyboard.layerCount) return false;
+		const unsigned short* cells = (const unsigned short*)(section + keyboard.cells);
+		for (size_t j = 0; j < (size_t)keyboard.layerCount * SCANCODE_TABLE_SIZE; j++)
+			if (cells[j] >= keyboard.commandCount) return false;
+		const KeystrokeCommand* commands = (const KeystrokeCommand*)(section + keyboard.commands);
+		for (size_t j = 0; j < keyboard.commandCount; j++)
+			if (!CheckCommand(section, sectionSize, commands[j])) return false;
+		return true;
+	}
+
+	// Checks the root and every keyboard section of a compiled layout.
+	static bool CheckLayout(const BYTE* const arena, const size_t arenaSize)
+	{
+		if (arenaSize < sizeof(LayoutRoot))
+			return false;
+		const LayoutRoot* root = (const LayoutRoot*)arena;
+		if (!InArena(arenaSize, root->keyboards, (unsigned long long)root->keyboardCount * sizeof(KeyboardSection)))
+			return false;
+
+		const KeyboardSection* sections = (const KeyboardSection*)(arena + root->keyboards);
+		for (unsigned int i = 0; i < root->keyboardCount; i++)
+		{
+			if (!InArena(arenaSize, sections[i].offset, sections[i].size)
+				|| !CheckKeyboard(arena + sections[i].offset, sections[i].size))
+				return false;
+		}
+		return true;
+	}
+
+	Arena* AssembleLayout(const std::vector<CompiledKeyboard>& keyboards)
+	{
+		// Everything fits exactly; sections start at multiples of 64, like image files do
+		size_t reserveSize = sizeof(LayoutRoot) + keyboards.size() * sizeof(KeyboardSection) + 64;
+		for (auto it = keyboards.begin(); it != keyboards.end(); it++)
+			reserveSize += it->size + 64;
+
+		Arena* arena = new Arena(reserveSize);
+		try
+		{
+			LayoutRoot* root = arena->make<LayoutRoot>();
+			KeyboardSection* sections = arena->makeArray<KeyboardSection>(keyboards.size());
+			for (size_t i = 0; i < keyboards.size(); i++)
+			{
+				void* section = arena->allocate(keyboards[i].size, 64);
+				memcpy(section, keyboards[i].data, keyboards[i].size);
+				sections[i].offset = arena->offsetOf(section);
+				sections[i].size = keyboards[i].size;
+				sections[i].sourceHash = keyboards[i].sourceHash;
+			}
+			root->keyboards = arena->offsetOf(sections);
+			root->keyboardCount = (unsigned int)keyboards.size();
+		}
+		catch (const std::bad_alloc&)
+		{
+			delete arena;
+			throw;
+		}
+		return arena;
+	}
+
+	bool GetLayoutSource(const std::wstring& filename, OUT LayoutSource *const source)
+	{
+		HANDLE file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		bool success = GetFileSizeEx(file, &size) && GetFileTime(file, NULL, NULL, &source->lastWriteTime);
+		CloseHandle(file);
+		source->size = (unsigned long long)size.QuadPart;
+		source->hash = 0;
+		source->hasHash = false;
+		return success;
+	}
+
+	std::wstring GetLayoutImageFilename(const std::wstring& settingsFilename)
+	{
+		return settingsFilename + LAYOUT_IMAGE_EXTENSION;
+	}
+
+	// Maps a single image file; see MapLayoutImage.
+	static Arena* MapImageFile(const std::wstring& imageFilename, const LayoutSource& source)
+	{
+		HANDLE file = CreateFile(imageFilename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return nullptr;		// <- probably hasn't been compiled yet
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(LayoutImageHeader))
+		{
+			CloseHandle(file);
+			return nullptr;
+		}
+
+		// The view keeps the file mapped after both handles are closed
+		HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		CloseHandle(file);
+		if (mapping == NULL)
+			return nullptr;
+		const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (view == nullptr)
+			return nullptr;
+
+		const LayoutImageHeader* header = (const LayoutImageHeader*)view;
+		bool sameSource = header->sourceSize == source.size
+			&& ((header->sourceLastWriteTime.dwLowDateTime == source.lastWriteTime.dwLowDateTime
+				&& header->sourceLastWriteTime.dwHighDateTime == source.lastWriteTime.dwHighDateTime)
+				|| (source.hasHash && header->sourceHash == source.hash));
+		bool valid = sameSource && header->magic == LAYOUT_IMAGE_MAGIC
+			&& header->version == LAYOUT_IMAGE_VERSION
+			&& header->headerSize == sizeof(LayoutImageHeader)
+			&& (unsigned long long)header->arenaSize + header->headerSize == (unsigned long long)fileSize.QuadPart
+			&& CheckLayout((const BYTE*)view + header->headerSize, header->arenaSize);
+		if (!valid)
+		{
+			UnmapViewOfFile(view);
+			return nullptr;
+		}
+
+		// The arena unmaps the view when it's destroyed
+		try
+		{
+			return new Arena(view, header->headerSize, header->arenaSize);
+		}
+		catch (const std::bad_alloc&)
+		{
+			UnmapViewOfFile(view);
+			return nullptr;
+		}
+	}
+
+	Arena* MapLayoutImage(const std::wstring& imageFilename, const LayoutSource& source)
+	{
+		Arena* arena = MapImageFile(imageFilename, source);
+		if (arena == nullptr)
+			arena = MapImageFile(imageFilename + LAYOUT_IMAGE_ALTERNATE_EXTENSION, source);
+		return arena;
+	}
+
+	bool WriteLayoutImage(const std::wstring& imageFilename, const Arena& arena, const LayoutSource& source)
+	{
+		LayoutImageHeader header;
+		ZeroMemory(&header, sizeof(header));
+		header.magic = LAYOUT_IMAGE_MAGIC;
+		header.version = LAYOUT_IMAGE_VERSION;
+		header.headerSize = sizeof(LayoutImageHeader);
+		header.arenaSize = (unsigned int)arena.size();
+		header.sourceSize = source.size;
+		header.sourceLastWriteTime = source.lastWriteTime;
+		header.sourceHash = source.hash;
+
+		// Write everything to another file first, so that a partially written image is never used
+		std::wstring temporaryFilename = imageFilename + L".tmp";
+		HANDLE file = CreateFile(temporaryFilename.c_str(), GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		DWORD written = 0;
+		bool success = WriteFile(file, &header, sizeof(header), &written, NULL) && written == sizeof(header);
+		success = success && WriteFile(file, arena.data(), header.arenaSize, &written, NULL)
+			&& written == header.arenaSize;
+		CloseHandle(file);
+
+		if (!success)
+		{
+			DeleteFile(temporaryFilename.c_str());
+			return false;
+		}
+
+		// A file can't be replaced while it's mapped, which it is when this process started from it
+		std::wstring alternateFilename = imageFilename + LAYOUT_IMAGE_ALTERNATE_EXTENSION;
+		if (MoveFileEx(temporaryFilename.c_str(), imageFilename.c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			DeleteFile(alternateFilename.c_str());		// <- may be mapped as well; it's simply left behind
+			return true;
+		}
+		WCHAR message[128];
+		swprintf_s(message, 128, L"Could not replace the layout image (error %u); writing the alternate.\n", GetLastError());
+		OutputDebugString(message);
+		if (MoveFileEx(temporaryFilename.c_str(), alternateFilename.c_str(), MOVEFILE_REPLACE_EXISTING))
+			return true;
+		swprintf_s(message, 128, L"Could not replace the alternate layout image either (error %u).\n", GetLastError());
+		OutputDebugString(message);
+		DeleteFile(temporaryFilename.c_str());
+		return false;
+	}
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "stdafx.h"
+#include "Arena.h"
+
+// Format of compiled layouts, and saving and mapping layout image files.
+// A compiled layout is an arena whose first object is a LayoutRoot, followed by one section per
+// keyboard. Everything in it refers to everything else by offset, so the arena's memory can be
+// written to a file as it is, and that file can later be mapped (by any number of processes) and
+// used directly, without parsing anything or allocating any object.
+// Offsets inside a keyboard's section are relative to the start of that section, so a compiled
+// keyboard can be copied from one layout to another as it is (see AssembleLayout).
+
+namespace Multikeys
+{
+
+	// Identifies layout image files ("MKLI" in little-endian order).
+	const unsigned int LAYOUT_IMAGE_MAGIC = 0x494c4b4d;
+
+	// Increment whenever anything in the arena of a compiled layout changes format, including
+	// the layout of commands; older images are then ignored and compiled again.
+	const unsigned int LAYOUT_IMAGE_VERSION = 5;
+
+	// Appended to the name of a settings file to get the name of its image.
+	const wchar_t* const LAYOUT_IMAGE_EXTENSION = L".bin";
+
+	// Appended to the name of an image to get the name of the file that's written instead when the
+	// image can't be replaced, because it's still mapped (by this or another process).
+	const wchar_t* const LAYOUT_IMAGE_ALTERNATE_EXTENSION = L".alt";
+
+
+	// Everything a Keyboard needs; the first object of its section. Every member is an offset in
+	// the section or a count.
+	struct KeyboardImage
+	{
+		// Null-terminated device name (empty for the keyboard that remaps every other device)
+		unsigned int name;
+		unsigned int nameLength;
+
+		// unsigned int[modifierCount], each the offset of a modifier's null-terminated name;
+		// the position of a modifier is its bit in state masks.
+		unsigned int modifierNames;
+		unsigned int modifierCount;
+
+		// unsigned char[SCANCODE_TABLE_SIZE]; the bit of the modifier triggered by each scancode
+		// plus one, or 0 for scancodes that aren't modifiers.
+		unsigned int modifierByScancode;
+
+		// unsigned int[1 << modifierCount]; the layer activated by each state mask, or NO_LAYER.
+		unsigned int layerByState;
+
+		// KeystrokeCommand[commandCount]; every command referenced by the cells. The first one is null.
+		unsigned int commands;
+		unsigned int commandCount;
+
+		// unsigned short[layerCount * SCANCODE_TABLE_SIZE]; positions in commands, one row per layer.
+		unsigned int cells;
+		unsigned int layerCount;
+
+		// unsigned int[SCANCODE_BITMAP_WORDS]; the bit of each scancode is set if it's a modifier or
+		// if any layer maps it to a command. Keys whose bit is clear are never remapped.
+		unsigned int touchedScancodes;
+	};
+
+	// Where a keyboard's section is in the arena of a compiled layout.
+	struct KeyboardSection
+	{
+		// Start of the section (a multiple of 64), and its size in bytes
+		unsigned int offset;
+		unsigned int size;
+
+		// Content hash of the keyboard's element in the settings (see SchemaValidator::HashContent),
+		// or 0 if it's not known; keyboards with the same hash are compiled into the same section.
+		unsigned long long sourceHash;
+	};
+
+	// First object of the arena of a compiled layout, at offset 0.
+	// Since nothing else can be at offset 0 (and neither can anything be at offset 0 of a
+	// keyboard's section), an offset of 0 may be used to mean "nothing".
+	struct LayoutRoot
+	{
+		// KeyboardSection[keyboardCount], in the order they were loaded
+		unsigned int keyboards;
+		unsigned int keyboardCount;
+	};
+
+	// A compiled keyboard: the contents of its section, wherever they are.
+	struct CompiledKeyboard
+	{
+		const BYTE* data;
+		unsigned int size;
+		unsigned long long sourceHash;
+	};
+
+
+	// Describes the settings file an image was compiled from, to tell whether the image is stale.
+	struct LayoutSource
+	{
+		unsigned long long size;
+		FILETIME lastWriteTime;
+
+		// Content hash of the settings file (see SchemaValidator::HashContent); only valid if hasHash.
+		unsigned long long hash;
+		bool hasHash;
+	};
+
+	// Beginning of a layout image file; the arena follows, starting at headerSize.
+	struct LayoutImageHeader
+	{
+		unsigned int magic;				// <- LAYOUT_IMAGE_MAGIC
+		unsigned int version;			// <- LAYOUT_IMAGE_VERSION
+		unsigned int headerSize;		// <- sizeof(LayoutImageHeader)
+		unsigned int arenaSize;
+		unsigned long long sourceSize;
+		FILETIME sourceLastWriteTime;
+		unsigned long long sourceHash;
+		unsigned int reserved[6];		// <- pads the header to 64 bytes, so the arena stays aligned
+	};
+
+
+	// Makes a new arena with a LayoutRoot followed by a copy of every keyboard, in order.
+	// Throws std::bad_alloc if there's not enough memory.
+	Arena* AssembleLayout(const std::vector<CompiledKeyboard>& keyboards);
+
+	// Fills in the size and time of the last write of a settings file, without reading it.
+	// The hash is left out. Returns false if the file can't be opened.
+	bool GetLayoutSource(const std::wstring& filename, OUT LayoutSource *const source);
+
+	// Returns the name of the image file for a settings file.
+	std::wstring GetLayoutImageFilename(const std::wstring& settingsFilename);
+
+	// Maps the image at imageFilename (or its alternate, see LAYOUT_IMAGE_ALTERNATE_EXTENSION), if it
+	// was compiled from source and is in the current format. An image matches if the size and last
+	// write time of its settings file are the same as source's, or, when source has a hash, if the
+	// size and hash are the same.
+	// Returns a read-only arena containing the compiled layout, or null if there's no such image.
+	Arena* MapLayoutImage(const std::wstring& imageFilename, const LayoutSource& source);
+
+	// Writes the compiled layout in arena to an image file, replacing the previous one. If the previous
+	// one is still mapped, the alternate file is replaced instead; whichever matches is mapped later.
+	// source - settings file the layout was compiled from; must have a hash.
+	// Returns false if neither file could be written; the layout may still be used.
+	bool WriteLayoutImage(const std::wstring& imageFilename, const Arena& arena, const LayoutSource& source);
+
+}
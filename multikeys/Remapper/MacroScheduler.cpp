@@ -0,0 +1,196 @@
+#include "stdafx.h"
+#include "MacroScheduler.h"
+
+// Implementation of methods defined in MacroScheduler.h
+
+namespace Multikeys
+{
+	static_assert(MAX_DELAYED_MACROS < 0xffff, "Entries are referred to by 16-bit positions");
+
+	MacroScheduler::MacroScheduler()
+		: entries(new Entry[MAX_DELAYED_MACROS]), freeList(0),
+		readyFirst(NO_ENTRY), readyLast(NO_ENTRY), currentTick(0), count(0)
+	{
+		for (size_t i = 0; i < MAX_DELAYED_MACROS; i++)
+			entries[i].next = (i + 1 < MAX_DELAYED_MACROS ? (unsigned short)(i + 1) : NO_ENTRY);
+		for (unsigned int level = 0; level < MACRO_WHEEL_LEVELS; level++)
+		{
+			for (unsigned int slot = 0; slot < MACRO_WHEEL_SLOTS; slot++)
+			{
+				first[level][slot] = NO_ENTRY;
+				last[level][slot] = NO_ENTRY;
+			}
+		}
+		ZeroMemory(&counters, sizeof(counters));
+	}
+
+	void MacroScheduler::_append(unsigned short& listFirst, unsigned short& listLast, const unsigned short entry)
+	{
+		entries[entry].next = NO_ENTRY;
+		if (listLast == NO_ENTRY)
+			listFirst = entry;
+		else
+			entries[listLast].next = entry;
+		listLast = entry;
+	}
+
+	void MacroScheduler::_place(const unsigned short entry)
+	{
+		unsigned long long due = entries[entry].macro.due;
+
+		// Already late; it doesn't need to wait for any slot
+		if (due < currentTick)
+		{
+			_append(readyFirst, readyLast, entry);
+			return;
+		}
+
+		// The finest level whose whole span reaches the due time; entries beyond the span of the
+		// last level go to its farthest slot, and are placed again when that slot is cascaded.
+		unsigned long long delta = due - currentTick;
+		for (unsigned int level = 0; level < MACRO_WHEEL_LEVELS; level++)
+		{
+			unsigned int shift = MACRO_WHEEL_BITS * level;
+			unsigned long long span = 1ull << (shift + MACRO_WHEEL_BITS);
+			if (delta < span || level == MACRO_WHEEL_LEVELS - 1)
+			{
+				unsigned long long time = (delta < span ? due : currentTick + span - 1);
+				unsigned int slot = (unsigned int)(time >> shift) & (MACRO_WHEEL_SLOTS - 1);
+				_append(first[level][slot], last[level][slot], entry);
+				return;
+			}
+		}
+	}
+
+	void MacroScheduler::_tick()
+	{
+		// When a level wraps around, the next slot of the level above it is spread over the
+		// levels below; coarsest first, so that its entries can be cascaded again right away.
+		for (unsigned int level = MACRO_WHEEL_LEVELS - 1; level > 0; level--)
+		{
+			unsigned int shift = MACRO_WHEEL_BITS * level;
+			if ((currentTick & ((1ull << shift) - 1)) != 0)
+				continue;
+			unsigned int slot = (unsigned int)(currentTick >> shift) & (MACRO_WHEEL_SLOTS - 1);
+			unsigned short entry = first[level][slot];
+			first[level][slot] = NO_ENTRY;
+			last[level][slot] = NO_ENTRY;
+			while (entry != NO_ENTRY)
+			{
+				unsigned short next = entries[entry].next;
+				_place(entry);
+				counters.cascades++;
+				entry = next;
+			}
+		}
+
+		// Everything in this millisecond's slot is due now
+		unsigned int slot = (unsigned int)currentTick & (MACRO_WHEEL_SLOTS - 1);
+		if (first[0][slot] != NO_ENTRY)
+		{
+			if (readyLast == NO_ENTRY)
+				readyFirst = first[0][slot];
+			else
+				entries[readyLast].next = first[0][slot];
+			readyLast = last[0][slot];
+			first[0][slot] = NO_ENTRY;
+			last[0][slot] = NO_ENTRY;
+		}
+		currentTick++;
+	}
+
+	bool MacroScheduler::schedule(const DelayedMacro& macro, const unsigned long long now)
+	{
+		if (freeList == NO_ENTRY)
+			return false;
+
+		// An empty wheel doesn't need to go through the time in which nothing was waiting
+		if (count == 0)
+			currentTick = now;
+
+		unsigned short entry = freeList;
+		freeList = entries[entry].next;
+		entries[entry].macro = macro;
+		count++;
+		counters.scheduled++;
+		_place(entry);
+		return true;
+	}
+
+	bool MacroScheduler::take(const unsigned long long now, OUT DelayedMacro *const out_macro)
+	{
+		while (readyFirst == NO_ENTRY && count > 0 && currentTick <= now)
+			_tick();
+		if (readyFirst == NO_ENTRY)
+			return false;
+
+		unsigned short entry = readyFirst;
+		readyFirst = entries[entry].next;
+		if (readyFirst == NO_ENTRY)
+			readyLast = NO_ENTRY;
+		*out_macro = entries[entry].macro;
+		entries[entry].next = freeList;
+		freeList = entry;
+		count--;
+
+		counters.fired++;
+		if (now > out_macro->due)
+		{
+			unsigned long long lateness = now - out_macro->due;
+			counters.totalLateness += lateness;
+			if (lateness > counters.maxLateness)
+				counters.maxLateness = lateness;
+		}
+		return true;
+	}
+
+	bool MacroScheduler::takeAny(OUT DelayedMacro *const out_macro)
+	{
+		// The ready list first, then whichever slot has something
+		unsigned short* listFirst = &readyFirst;
+		unsigned short* listLast = &readyLast;
+		for (unsigned int level = 0; level < MACRO_WHEEL_LEVELS && *listFirst == NO_ENTRY; level++)
+		{
+			for (unsigned int slot = 0; slot < MACRO_WHEEL_SLOTS && *listFirst == NO_ENTRY; slot++)
+			{
+				listFirst = &first[level][slot];
+				listLast = &last[level][slot];
+			}
+		}
+		if (*listFirst == NO_ENTRY)
+			return false;
+
+		unsigned short entry = *listFirst;
+		*listFirst = entries[entry].next;
+		if (*listFirst == NO_ENTRY)
+			*listLast = NO_ENTRY;
+		*out_macro = entries[entry].macro;
+		entries[entry].next = freeList;
+		freeList = entry;
+		count--;
+		return true;
+	}
+
+	DWORD MacroScheduler::timeUntilNext(const unsigned long long now) const
+	{
+		if (count == 0)
+			return INFINITE;
+		if (readyFirst != NO_ENTRY || currentTick <= now)
+			return 0;
+
+		// Either the next millisecond with something in the finest level, or the next time
+		// that level wraps around (and entries of the coarser levels come closer)
+		unsigned long long wrap = (currentTick | (MACRO_WHEEL_SLOTS - 1)) + 1;
+		for (unsigned long long time = currentTick; time < wrap; time++)
+		{
+			if (first[0][time & (MACRO_WHEEL_SLOTS - 1)] != NO_ENTRY)
+				return (DWORD)(time - now);
+		}
+		return (DWORD)(wrap - now);
+	}
+
+	MacroScheduler::~MacroScheduler()
+	{
+		delete[] entries;
+	}
+}
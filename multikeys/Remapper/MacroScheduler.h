@@ -0,0 +1,117 @@
+#pragma once
+
+#include "stdafx.h"
+#include "RemapperAPI.h"
+#include "KeystrokeCommands.h"
+
+namespace Multikeys
+{
+
+	// Most macros that may be waiting for a delay at once; more than this are run without waiting.
+	const size_t MAX_DELAYED_MACROS = 1024;
+
+	// Each level of the wheel has (1 << MACRO_WHEEL_BITS) slots, and each slot of a level covers as
+	// many milliseconds as the whole level below it. Three levels cover about 4.6 minutes; anything
+	// later waits in the last level until it's close enough.
+	const unsigned int MACRO_WHEEL_BITS = 6;
+	const unsigned int MACRO_WHEEL_SLOTS = 1u << MACRO_WHEEL_BITS;
+	const unsigned int MACRO_WHEEL_LEVELS = 3;
+
+
+	// A macro waiting for a delay, along with what's needed to find it again.
+	struct DelayedMacro
+	{
+		MacroCursor cursor;
+
+		// Layout and keyboard the macro belongs to (see KeystrokeAction)
+		unsigned int generation;
+		unsigned int keyboard;
+
+		// When the next step should run, in milliseconds
+		unsigned long long due;
+	};
+
+
+	// Hierarchical timer wheel that holds every macro waiting for a delay, so that the thread that
+	// executes actions can run their next steps when they're due, and no thread ever sleeps for a
+	// macro. Scheduling and firing take constant time; entries are moved to a finer level
+	// (cascaded) once, every time a coarser slot comes due.
+	// All memory is allocated on construction. Only the executing thread uses this.
+	class MacroScheduler
+	{
+	private:
+
+		// Marks the end of a list.
+		static const unsigned short NO_ENTRY = 0xffff;
+
+		struct Entry
+		{
+			DelayedMacro macro;
+			unsigned short next;
+		};
+
+		// Every entry, either in a slot, in the ready list or in the free list.
+		Entry* entries;
+		unsigned short freeList;
+
+		// First and last entry of each slot, by level; entries are kept in the order they were placed.
+		unsigned short first[MACRO_WHEEL_LEVELS][MACRO_WHEEL_SLOTS];
+		unsigned short last[MACRO_WHEEL_LEVELS][MACRO_WHEEL_SLOTS];
+
+		// Entries that came due and weren't taken yet, in order.
+		unsigned short readyFirst;
+		unsigned short readyLast;
+
+		// Every millisecond before this one was already handled.
+		unsigned long long currentTick;
+
+		// Entries in the wheel or in the ready list.
+		size_t count;
+
+		MacroSchedulerCounters counters;
+
+		// Appends an entry to a list.
+		void _append(unsigned short& listFirst, unsigned short& listLast, const unsigned short entry);
+
+		// Places an entry in the slot that covers its due time.
+		void _place(const unsigned short entry);
+
+		// Handles the millisecond currentTick, and moves on to the next one.
+		void _tick();
+
+	public:
+
+		MacroScheduler();
+
+		MacroScheduler(const MacroScheduler&) = delete;
+		MacroScheduler& operator=(const MacroScheduler&) = delete;
+
+		// Schedules a macro for macro.due. Returns false, without doing anything, if too many
+		// macros are already waiting.
+		// now - current time, in milliseconds.
+		bool schedule(const DelayedMacro& macro, const unsigned long long now);
+
+		// Takes the next macro that is due at now, in the order they came due.
+		// Returns false if there's none.
+		bool take(const unsigned long long now, OUT DelayedMacro *const out_macro);
+
+		// Takes any macro that is waiting, due or not, for emptying the wheel (such as when
+		// stopping). Returns false if there's none. Not counted as fired.
+		bool takeAny(OUT DelayedMacro *const out_macro);
+
+		// Milliseconds from now until the wheel needs to be looked at again (either because
+		// something is due, or because entries must be cascaded); INFINITE if nothing is waiting.
+		DWORD timeUntilNext(const unsigned long long now) const;
+
+		// Amount of macros waiting.
+		inline size_t size() const { return count; }
+
+		// For measuring how accurate delays are and how much the wheel costs.
+		// Only the counters of the wheel itself are filled in; the others are left at 0.
+		inline const MacroSchedulerCounters& getCounters() const { return counters; }
+
+		~MacroScheduler();
+
+	};
+
+}
@@ -73,87 +73,60 @@ namespace Multikeys
 	ModifierStateMap
 	*/
 
-	ModifierStateMap::ModifierStateMap(const ModifierStateMap& original)
-	{
-		// copy constructor also sets all modifiers to false
-		this->modifiers =
-			original.modifiers;
-		for (auto it = this->modifiers.begin(); it != this->modifiers.end(); it++)
-		{
-			it->second = false;
-		}
-	}
-
 	ModifierStateMap::ModifierStateMap(const std::vector<PModifier>& modifiers)
+		: modifiers(modifiers)
 	{
-		for (size_t i = 0; i < modifiers.size(); i++)
-		{
-			this->modifiers.insert(std::pair<PModifier, bool>(modifiers[i], false));
-		}
-	}
-
-	bool ModifierStateMap::updateState(Scancode sc, bool keyDown)
-	{
-		for (auto it = this->modifiers.begin(); it != this->modifiers.end(); it++)
+		// Ask every modifier about every possible scancode, so that the keystroke path
+		// never needs to. If two modifiers claim the same scancode, the first one keeps it.
+		modifierByScancode.fill(0);
+		for (unsigned short index = 0; index < SCANCODE_TABLE_SIZE; index++)
 		{
-			if (it->first->matches(sc))
+			Scancode sc = Scancode::fromIndex(index);
+			for (size_t i = 0; i < this->modifiers.size(); i++)
 			{
-				it->second = keyDown;
-				return true;
+				if (this->modifiers[i]->matches(sc))
+				{
+					modifierByScancode[index] = (unsigned char)(i + 1);
+					break;
+				}
 			}
 		}
-		return false;
 	}
 
-	bool ModifierStateMap::checkState(Layer* const layer) const
+	unsigned int ModifierStateMap::getModifierMask(const std::vector<std::wstring>& names) const
 	{
-		// 0. Layer's modNames contains precisely the modifiers that trigger it.
-		// 1. Every name present in modNames must be already set to true in this->modifiers
-		// 2. Every name not present in modNames must be false in this->modifiers
-		// Satified those conditions, this method must return true
-		// Not satified those conditions, this method must return false.
-		size_t i = 0;
-		bool found = false;
-
-		// Loop through all modifiers in this map
-		for (auto it = this->modifiers.begin(); it != this->modifiers.end(); it++)
+		unsigned int mask = 0;
+		// Look for each modifier by name
+		for (size_t i = 0; i < this->modifiers.size(); i++)
 		{
-			// Determine whether or not this modifier is present in the Layer's modifiers
-			// Look for it by name
-			for (i = 0, found = false; i < layer->modifierCombination.size(); i++)
+			for (size_t j = 0; j < names.size(); j++)
 			{
-				if (layer->modifierCombination[i] == it->first->name)	// comparing wstrings
+				if (names[j] == this->modifiers[i]->name)	// comparing wstrings
 				{
-					found = true;
-					break;	// get out of this inner loop
+					mask |= (1u << i);
+					break;
 				}
 			}
-			// Presence in the Layer's modifers must be equal to the modifier's current state
-			// That is, if the modifier exists in the Layer, then it must be currently pressed
-			// if the modifier was not found in the Layer, then it must be currently unpressed.
-			if (found != it->second)
-			{
-				return false;
-			}
 		}
-		// Looped and never returned false, then succeeded.
-		return true;
+		return mask;
 	}
 
-	void ModifierStateMap::resetAllModifiers()
+	void ModifierStateMap::compile(Arena& arena, OUT KeyboardImage *const image) const
 	{
-		for (auto it = this->modifiers.begin(); it != this->modifiers.end(); it++)
-			it->second = false;
-	}
+		unsigned int * names = arena.makeArray<unsigned int>(modifiers.size());
+		for (size_t i = 0; i < modifiers.size(); i++)
+		{
+			const std::wstring& name = modifiers[i]->name;
+			wchar_t * copy = arena.makeArray<wchar_t>(name.size() + 1);		// <- zeroed, so null-terminated
+			memcpy(copy, name.data(), name.size() * sizeof(wchar_t));
+			names[i] = arena.offsetOf(copy);
+		}
+		image->modifierNames = arena.offsetOf(names);
+		image->modifierCount = (unsigned int)modifiers.size();
 
-	// This is currently not in use, I believe.
-	inline bool ModifierStateMap::operator==(const ModifierStateMap& rhs) const
-	{
-		return rhs.modifiers.size() == this->modifiers.size()
-			&& (		// This is comparing pointers
-				std::equal(this->modifiers.begin(), this->modifiers.end(),
-					rhs.modifiers.begin())
-				);
+		unsigned char * index = arena.makeArray<unsigned char>(SCANCODE_TABLE_SIZE);
+		memcpy(index, modifierByScancode.data(), SCANCODE_TABLE_SIZE);
+		image->modifierByScancode = arena.offsetOf(index);
 	}
 
 	ModifierStateMap::~ModifierStateMap()
@@ -161,7 +134,7 @@ namespace Multikeys
 		// free all PModifiers
 		for (auto it = modifiers.begin(); it != modifiers.end(); it++)
 		{
-			delete it->first;
+			delete (*it);
 		}
 	}
 
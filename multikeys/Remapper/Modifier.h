@@ -2,7 +2,8 @@
 
 #include "stdafx.h"
 #include "Scancode.h"
-#include "Layer.h"
+#include "Arena.h"
+#include "LayoutImage.h"
 
 namespace Multikeys
 {
@@ -20,6 +21,7 @@ namespace Multikeys
 		std::wstring name;
 
 		// Check if a given scancode triggers this modifier
+		// Only called when a ModifierStateMap is built; keystrokes use its reverse index.
 		virtual bool matches(Scancode sc) const = 0;
 
 		// Ensure that derived constructors are called
@@ -59,40 +61,54 @@ namespace Multikeys
 	};
 
 
-	// This class is used for two purposes:
-	//		In a Keyboard to represent the internal state of its modifiers (mutable)
-	//		In a Layer to represent the required modifiers to trigger it (const)
+	// Greatest amount of distinct modifiers (by name) a keyboard may have.
+	// Each modifier is one bit of a state mask, and keyboards keep one entry
+	// per possible mask, so this should stay small.
+	const size_t MAX_MODIFIERS = 16;
+
+
+	// This class describes how the state of a keyboard's modifiers is represented.
+	// Each modifier is assigned a bit, according to its position in the vector
+	// passed to the constructor; the combination of pressed modifiers is then
+	// represented by a bit mask. The mask itself is kept in a DeviceState, not here.
+	// Maps are only used while a layout is compiled; keyboards read the compiled copy
+	// (see compile()).
 	class ModifierStateMap
 	{
 	private:
 
-		// ordered map allows for easy iteration
-		// The boolean value of each modifier is true if the key is currently pressed.
-		std::map<PModifier, bool> modifiers;
+		// Modifiers known by this object; the position of each one is its bit.
+		std::vector<PModifier> modifiers;
 
-		
+		// Reverse index from scancode (see Scancode::index) to modifier, built once in the
+		// constructor. Each element is the modifier's bit plus one, or 0 if that scancode
+		// is not a modifier.
+		std::array<unsigned char, SCANCODE_TABLE_SIZE> modifierByScancode;
 
 	public:
 
-		// Copy constructor
-		ModifierStateMap(const ModifierStateMap& original);
+		// Copying would make two objects responsible for deleting the same modifiers.
+		ModifierStateMap(const ModifierStateMap& original) = delete;
 
-		// STL constructor; sets all modifiers to unpressed
+		// STL constructor
+		// Ownership of every modifier is transferred to this object.
+		// The caller must not pass more than MAX_MODIFIERS modifiers.
 		ModifierStateMap(const std::vector<PModifier>& modifiers);
 		
 
-		// Receives a scancode, and a flag for keypress up or down.
-		// If sc is a modifier contained in this object, its state is updated and true is returned
-		// otherwise, false is returned.
-		bool updateState(Scancode sc, bool keyDown);
-
-		// Returns true if layer is triggered by the current combination of modifiers in this object.
-		bool checkState(Layer* const layer) const;
 
-		void resetAllModifiers();
+		// Returns the amount of modifiers in this object; state masks are
+		// always smaller than (1 << getModifierCount()).
+		inline size_t getModifierCount() const { return modifiers.size(); }
 
+		// Receives a list of modifier names, and returns the state mask in which exactly
+		// those modifiers are pressed. Names that are not in this object are ignored.
+		// Meant to be used at load time, since it compares strings.
+		unsigned int getModifierMask(const std::vector<std::wstring>& names) const;
 
-		inline bool operator==(const ModifierStateMap& rhs) const;
+		// Places the names of the modifiers and the reverse index from scancode in the arena,
+		// and fills in the members of image that describe them.
+		void compile(Arena& arena, OUT KeyboardImage *const image) const;
 
 		~ModifierStateMap();
 	};
@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "OutputSink.h"
+
+// Implementation of methods defined in OutputSink.h
+
+namespace Multikeys
+{
+
+	// Pure virtual destructors need an implementation.
+	IOutputSink::~IOutputSink() { }
+
+
+
+	/*
+	SendInputSink
+	*/
+
+	SendInputSink::SendInputSink(ExecutableLauncher* const launcher)
+		: launcher(launcher)
+	{ }
+
+	INPUT* SendInputSink::appendKeystrokes(const size_t count)
+	{
+		size_t position = pending.size();
+		pending.resize(position + count);
+		return pending.data() + position;
+	}
+
+	bool SendInputSink::openFile(const wchar_t* const filename, const wchar_t* const arguments)
+	{
+		// Keep the order in which things happened
+		bool flushed = flush();
+
+		// Only a request is made here; the result goes to the launcher's callback.
+		if (!launcher->enqueue(filename, arguments))
+			return FALSE;
+
+		return flushed;
+	}
+
+	bool SendInputSink::flush()
+	{
+		if (pending.empty())
+			return TRUE;
+
+		UINT sent = SendInput((UINT)pending.size(), pending.data(), sizeof(INPUT));
+		bool allSent = (sent == pending.size());
+		pending.clear();		// <- does not release memory
+		return allSent;
+	}
+
+
+
+	/*
+	RecordingSink
+	*/
+
+	INPUT* RecordingSink::appendKeystrokes(const size_t count)
+	{
+		size_t position = pending.size();
+		pending.resize(position + count);
+		return pending.data() + position;
+	}
+
+	bool RecordingSink::openFile(const wchar_t* const filename, const wchar_t* const arguments)
+	{
+		flush();
+		openedFiles.push_back(OpenedFile{ keystrokes.size(), filename, arguments });
+		return TRUE;
+	}
+
+	bool RecordingSink::flush()
+	{
+		keystrokes.insert(keystrokes.end(), pending.begin(), pending.end());
+		batchSizes.push_back(pending.size());
+		pending.clear();
+		return TRUE;
+	}
+
+	void RecordingSink::clear()
+	{
+		pending.clear();
+		keystrokes.clear();
+		batchSizes.clear();
+		openedFiles.clear();
+	}
+
+}
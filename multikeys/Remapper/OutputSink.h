@@ -0,0 +1,74 @@
+#pragma once
+
+#include "stdafx.h"
+#include "RemapperAPI.h"
+#include "ExecutableLauncher.h"
+
+namespace Multikeys
+{
+
+	// Output sink that sends keystrokes to the system with a single SendInput call
+	// per flush, and hands files to an ExecutableLauncher, so that they're opened
+	// without making the caller wait.
+	class SendInputSink : public IOutputSink
+	{
+	private:
+
+		// Keystrokes appended since the last flush. Its capacity is kept between flushes.
+		std::vector<INPUT> pending;
+
+		// Opens files in another thread; not owned by this sink.
+		ExecutableLauncher* const launcher;
+
+	public:
+
+		// launcher - where requests to open files go; must outlive this sink.
+		SendInputSink(ExecutableLauncher* const launcher);
+
+		INPUT* appendKeystrokes(const size_t count) override;
+
+		bool openFile(const wchar_t* const filename, const wchar_t* const arguments) override;
+
+		bool flush() override;
+
+	};
+
+
+	// Output sink that doesn't send anything to the system, and instead remembers all output
+	// in memory, in order. Useful for checking exactly what commands produce.
+	class RecordingSink : public IOutputSink
+	{
+	private:
+
+		// Keystrokes appended since the last flush.
+		std::vector<INPUT> pending;
+
+	public:
+
+		// Every keystroke flushed so far, in order.
+		std::vector<INPUT> keystrokes;
+
+		// Amount of keystrokes sent by each flush, in order; flushes with no keystrokes are included.
+		std::vector<size_t> batchSizes;
+
+		// Position in keystrokes at which each file was opened, along with the file's name and arguments.
+		struct OpenedFile
+		{
+			size_t position;
+			std::wstring filename;
+			std::wstring arguments;
+		};
+		std::vector<OpenedFile> openedFiles;
+
+		INPUT* appendKeystrokes(const size_t count) override;
+
+		bool openFile(const wchar_t* const filename, const wchar_t* const arguments) override;
+
+		bool flush() override;
+
+		// Forgets everything recorded so far, including pending keystrokes.
+		void clear();
+
+	};
+
+}
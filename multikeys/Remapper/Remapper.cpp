@@ -9,55 +9,252 @@ namespace Multikeys
 	// Pure virtual destructors need an implementation.
 	IRemapper::~IRemapper() { }
 
-	Remapper::Remapper() { }
+	// Milliseconds from an arbitrary point, for timing delayed macros; finer than GetTickCount.
+	static unsigned long long CurrentMilliseconds()
+	{
+		static LARGE_INTEGER frequency = { };
+		if (frequency.QuadPart == 0)
+			QueryPerformanceFrequency(&frequency);		// <- never changes while the system runs
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return (unsigned long long)(counter.QuadPart / (frequency.QuadPart / 1000));
+	}
+
+	Remapper::Remapper()
+		: pendingLayout(nullptr), layout(nullptr), pendingExecution(nullptr), lastGeneration(0),
+		lastLoaded(nullptr), validator(nullptr), watcher(nullptr), defaultSink(&launcher), sink(&defaultSink)
+	{
+		executedLayouts[0] = nullptr;
+		executedLayouts[1] = nullptr;
+		ZeroMemory(&macroCounters, sizeof(macroCounters));
+	}
+
+	bool Remapper::watchSettings(const std::wstring filename)
+	{
+		// The previous watcher is stopped first, so that only one file is ever watched
+		delete watcher;
+		watcher = new SettingsWatcher(this, filename);
+		if (!watcher->isWatching())
+		{
+			delete watcher;
+			watcher = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	void Remapper::_adoptPendingLayout()
+	{
+		const CompiledLayout* newLayout = pendingLayout.exchange(nullptr, std::memory_order_acquire);
+		if (newLayout == nullptr)
+			return;
+
+		// Devices move to the new keyboards while the previous ones still exist
+		this->router.assign(newLayout);
+		if (this->layout != nullptr)
+			this->layout->release();		// 'this' refers to this instance of Remapper.
+		this->layout = newLayout;
+
+		// The executing thread gets its own reference. If it didn't see the previous pending
+		// layout yet, it never will; actions made from that one are dropped.
+		newLayout->addRef();
+		const CompiledLayout* unseen = pendingExecution.exchange(newLayout, std::memory_order_acq_rel);
+		if (unseen != nullptr)
+			unseen->release();
+	}
 
 	bool Remapper::evaluateKey(
 		// Type RAWKEYBOARD is from the WinAPI
 		RAWKEYBOARD* const keypressed,
-		wchar_t* const deviceName,
-		OUT PKeystrokeCommand* const out_action)
-	{
-		// Check each keyboard until name matches,
-		// then call its method for checking a key
-		for (auto it = keyboards.begin();
-			it != keyboards.end();
-			it++)
+		HANDLE const device,
+		OUT PKeystrokeAction const out_action)
+	{
+		// Most keystrokes find nothing here, and only pay for a relaxed load
+		if (pendingLayout.load(std::memory_order_relaxed) != nullptr)
+			_adoptPendingLayout();
+
+		// Find the keyboard registered for this device
+		// (or the keyboard registered for any non-remapped device)
+		// then call its method for checking a key, with the state of this device
+		RoutedDevice* routed = router.route(device);
+
+		// If no keyboard matches, there's no remap and input shouldn't be blocked:
+		if (routed == nullptr)
+			return false;
+
+		Scancode scancode(
+			(keypressed->Flags & RI_KEY_E1) != 0,
+			(keypressed->Flags & RI_KEY_E0) != 0,
+			keypressed->MakeCode & 0xff);
+		bool block = routed->keyboard->evaluateKey(routed->state, scancode,
+			keypressed->VKey & 0xff,
+			(keypressed->Flags & RI_KEY_BREAK) == RI_KEY_BREAK,
+			out_action);
+		router.update(routed);
+		out_action->generation = layout->getGeneration();
+		out_action->keyboard = routed->keyboard->getIndex();
+		return block;
+	}
+
+	bool Remapper::isPassThrough(const RAWKEYBOARD* const keypressed)
+	{
+		if (pendingLayout.load(std::memory_order_relaxed) != nullptr)
+			_adoptPendingLayout();
+
+		// Without a layout, no device is routed to anything
+		if (layout == nullptr)
+			return true;
+
+		// A key that no keyboard touches only matters to devices whose state captures it
+		Scancode scancode(
+			(keypressed->Flags & RI_KEY_E1) != 0,
+			(keypressed->Flags & RI_KEY_E0) != 0,
+			keypressed->MakeCode & 0xff);
+		return !layout->touchesKey(scancode) && !router.anyCapturing();
+	}
+
+	const CompiledLayout* Remapper::_findExecutedLayout(const unsigned int generation)
+	{
+		// Actions are evaluated before they're executed, so a layout adopted by the evaluating
+		// thread is always here before any action made from it.
+		if (pendingExecution.load(std::memory_order_relaxed) != nullptr)
 		{
-			
-			// If keyboard name matches:
-			/*
-			* Update: Since an empty string is used to represent "remap any non-remapped keyboard",
-			* we check for that too. It's important that this keyboard with an empty string as name
-			* be the last in the list.
-			*/
-			if (wcscmp(deviceName, (*it)->deviceName.c_str()) == 0
-				|| wcscmp(L"", (*it)->deviceName.c_str()) == 0)
+			const CompiledLayout* newLayout = pendingExecution.exchange(nullptr, std::memory_order_acq_rel);
+			if (newLayout != nullptr)
 			{
-				this->workScancode.flgE0 = keypressed->Flags & RI_KEY_E0;
-				this->workScancode.flgE1 = keypressed->Flags & RI_KEY_E1;
-				this->workScancode.makeCode = keypressed->MakeCode & 0xff;
-				return (
-						(*it)->evaluateKey(this->workScancode,
-								keypressed->VKey & 0xff,
-								(keypressed->Flags & RI_KEY_BREAK) == RI_KEY_BREAK,
-								out_action)
-					);
+				if (executedLayouts[1] != nullptr)
+					executedLayouts[1]->release();
+				executedLayouts[1] = executedLayouts[0];
+				executedLayouts[0] = newLayout;
 			}
 		}
-		// If no keyboard matches, there's no remap and input shouldn't be blocked:
-		return false;
+
+		for (int i = 0; i < 2; i++)
+		{
+			if (executedLayouts[i] != nullptr && executedLayouts[i]->getGeneration() == generation)
+				return executedLayouts[i];
+		}
+		return nullptr;
+	}
+
+	bool Remapper::executeAction(const KeystrokeAction action, bool keyup, bool repeated)
+	{
+		// Commands only exist in the layout they were made from; if that layout was replaced
+		// twice since the action was evaluated, the action can't be executed anymore.
+		const CompiledLayout* actionLayout = _findExecutedLayout(action.generation);
+		if (actionLayout == nullptr)
+			return false;
+		const Arena* arena = actionLayout->getKeyboardArena(action.keyboard);
+		if (arena == nullptr)
+			return false;
+		// Everything the action produces before its first delay is sent together
+		MacroCursor cursor;
+		bool executed = ExecuteAction(*arena, *sink, action, keyup, repeated, &cursor);
+		if (cursor.command != 0)
+			_delayMacro(*arena, cursor, action.generation, action.keyboard, CurrentMilliseconds());
+		bool flushed = sink->flush();
+		return executed && flushed;
+	}
+
+	void Remapper::_delayMacro(const Arena& arena, MacroCursor cursor, const unsigned int generation,
+		const unsigned int keyboard, const unsigned long long start)
+	{
+		DelayedMacro delayed = { cursor, generation, keyboard, start + cursor.delay };
+		if (scheduler.schedule(delayed, CurrentMilliseconds()))
+			return;
+
+		// Too many macros are waiting; whatever this one has left is sent now
+		macroCounters.overflows++;
+		const ProgramCommand* program = arena.at<ProgramCommand>(cursor.command);
+		while (cursor.command != 0)
+			program->resume(arena, *sink, cursor);
+	}
+
+	DWORD Remapper::executeDelayedSteps()
+	{
+		unsigned long long now = CurrentMilliseconds();
+		bool executed = false;
+		DelayedMacro delayed;
+		while (scheduler.take(now, &delayed))
+		{
+			// Same as for actions; a macro whose layout is gone can't continue, but
+			// the keys it pressed are still released
+			const CompiledLayout* macroLayout = _findExecutedLayout(delayed.generation);
+			const Arena* arena = (macroLayout == nullptr ? nullptr : macroLayout->getKeyboardArena(delayed.keyboard));
+			executed = true;
+			if (arena == nullptr)
+			{
+				ProgramCommand::releaseHeldKeys(*sink, delayed.cursor);
+				macroCounters.dropped++;
+				continue;
+			}
+			arena->at<ProgramCommand>(delayed.cursor.command)->resume(*arena, *sink, delayed.cursor);
+			// The next delay counts from when this step was due, so that lateness doesn't add up
+			if (delayed.cursor.command != 0)
+				_delayMacro(*arena, delayed.cursor, delayed.generation, delayed.keyboard, delayed.due);
+		}
+
+		// Steps that came due together are sent together
+		if (executed)
+			sink->flush();
+		return scheduler.timeUntilNext(now);
+	}
+
+	void Remapper::abandonDelayedSteps()
+	{
+		bool released = false;
+		DelayedMacro delayed;
+		while (scheduler.takeAny(&delayed))
+		{
+			ProgramCommand::releaseHeldKeys(*sink, delayed.cursor);
+			macroCounters.dropped++;
+			released = true;
+		}
+		if (released)
+			sink->flush();
+	}
+
+	void Remapper::getMacroCounters(OUT MacroSchedulerCounters* const counters)
+	{
+		*counters = scheduler.getCounters();
+		counters->overflows = macroCounters.overflows;
+		counters->dropped = macroCounters.dropped;
+	}
+
+	void Remapper::setOutputSink(POutputSink const sink)
+	{
+		this->sink = (sink == nullptr ? &defaultSink : sink);
+	}
+
+	void Remapper::setLaunchCallback(LaunchCallback const callback, void* const context)
+	{
+		launcher.setCallback(callback, context);
+	}
+
+	void Remapper::forgetDevice(HANDLE const device)
+	{
+		router.forget(device);
 	}
 
 	Remapper::~Remapper()
 	{
-		for (auto it = keyboards.begin();
-			it != keyboards.end();
-			it++)
+		// Nothing may be loaded while this is destroyed
+		delete watcher;
+
+		// Keys held by waiting macros would stay pressed system-wide
+		abandonDelayedSteps();
+
+		// Keyboards and commands are destroyed along with the layouts,
+		// unless something else still holds a reference to them
+		const CompiledLayout* layouts[6] = { pendingLayout.load(), layout, pendingExecution.load(),
+			executedLayouts[0], executedLayouts[1], lastLoaded };
+		for (int i = 0; i < 6; i++)
 		{
-			// Dereference iterator to get a Keyboard*
-			// Delete Keyboard*
-			delete (*it);
+			if (layouts[i] != nullptr)
+				layouts[i]->release();
 		}
+		// Releases Xerces as well
+		delete validator;
 	}
 
 	void Create(OUT PRemapper* instance)
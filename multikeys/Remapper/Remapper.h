@@ -4,30 +4,134 @@
 #include "RemapperAPI.h"
 #include "KeystrokeCommands.h"
 #include "Keyboard.h"
+#include "CompiledLayout.h"
+#include "DeviceRouter.h"
+#include "OutputSink.h"
+#include "SchemaValidator.h"
+#include "SettingsWatcher.h"
+#include "MacroScheduler.h"
+
+#include <atomic>
+#include <mutex>
 
 // method readSettings() implemented in a separate cpp.
 
 namespace Multikeys
 {
 
+	// Greatest amount of threads that compile keyboards at once while settings are loaded.
+	const size_t MAX_COMPILER_THREADS = 8;
+
+
 	class Remapper : public IRemapper
 	{
 	private:
 
-		mutable Scancode workScancode;
-		std::vector<Keyboard*> keyboards;
+		// Layouts move from the loading thread to the evaluating thread, and from there to the
+		// executing thread, through atomic pointers; no thread ever waits for another.
+		// Every pointer here holds one reference to its layout.
+
+		// Layout that was loaded, but not yet adopted by the evaluating thread; usually null.
+		std::atomic<const CompiledLayout*> pendingLayout;
+
+		// Evaluating thread only. Keyboards and commands of the loaded configuration; null until
+		// settings are loaded and the first key is evaluated.
+		const CompiledLayout* layout;
+
+		// Finds the keyboard that corresponds to each device, and keeps each device's state.
+		// Evaluating thread only.
+		DeviceRouter router;
+
+		// Layout that was adopted by the evaluating thread, but not yet seen by the executing thread.
+		std::atomic<const CompiledLayout*> pendingExecution;
+
+		// Executing thread only. The latest layout it has seen, and the one before it, so that
+		// actions evaluated before the last reload can still be executed.
+		const CompiledLayout* executedLayouts[2];
+
+		// Executing thread only. Macros waiting for a delay, and the counters that the wheel
+		// doesn't keep itself.
+		MacroScheduler scheduler;
+		MacroSchedulerCounters macroCounters;
+
+		// Loads are made one at a time; this is never held by the evaluating or executing threads.
+		std::mutex loadMutex;
+
+		// Generation of the last layout loaded. Guarded by loadMutex.
+		unsigned int lastGeneration;
+
+		// Last layout loaded, whose keyboards may be reused by the next load; holds one
+		// reference to it. Guarded by loadMutex.
+		const CompiledLayout* lastLoaded;
+
+		// Reads and validates settings files; created by the first load, and kept
+		// (along with the schema) until this object is destroyed. Guarded by loadMutex.
+		SchemaValidator* validator;
+
+		// Loads the settings again when they change; null if nothing is being watched.
+		SettingsWatcher* watcher;
+
+		// Opens files requested by commands, in a separate thread.
+		ExecutableLauncher launcher;
+
+		// Output of executed commands goes to sink, which is either defaultSink
+		// or a sink given by the user of this library.
+		SendInputSink defaultSink;
+		IOutputSink* sink;
+
+		// Compiles the contents of a settings file into a new arena, or returns null if they
+		// can't be used. Only keyboards that changed since the last load are compiled, each in
+		// a document of its own, by up to MAX_COMPILER_THREADS threads at once.
+		// Implemented in XmlParser.cpp
+		Arena* _compileSettings(const std::wstring& filename, const std::vector<BYTE>& content);
+
+		// Parses every document at the same time, and places the keyboards compiled from each
+		// one in the same position of out_results. Returns false if any document can't be used.
+		// Implemented in XmlParser.cpp
+		bool _parseDocuments(const std::wstring& filename, const std::vector<std::vector<BYTE>>& documents,
+			OUT std::vector<std::vector<std::vector<BYTE>>> *const out_results);
+
+		// Evaluating thread only. Replaces the current layout with the pending one, if there's any.
+		void _adoptPendingLayout();
+
+		// Executing thread only. Returns the layout of the given generation (that an action was
+		// made from), or null if it's no longer kept.
+		const CompiledLayout* _findExecutedLayout(const unsigned int generation);
+
+		// Executing thread only. Schedules the rest of a macro that reached a delay; the delay
+		// counts from start. If too many macros are waiting, the rest is sent without waiting.
+		void _delayMacro(const Arena& arena, MacroCursor cursor, const unsigned int generation,
+			const unsigned int keyboard, const unsigned long long start);
 
 	public:
 		Remapper();
 
-		// This will fill the keyboard vector with pointers to allocated keyboards.
-		// Implemented in XmlParser.cpp
+		// This will compile a new layout (or map the image of one compiled before) and replace
+		// the current one. Implemented in XmlParser.cpp
 		bool loadSettings(const std::wstring filename) override;
 
+		bool watchSettings(const std::wstring filename) override;
+
 		bool evaluateKey(
 			RAWKEYBOARD* const keypressed,
-			wchar_t* const deviceName,
-			OUT PKeystrokeCommand* const out_action) override;
+			HANDLE const device,
+			OUT PKeystrokeAction const out_action) override;
+
+		bool isPassThrough(const RAWKEYBOARD* const keypressed) override;
+
+		bool executeAction(const KeystrokeAction action, bool keyup, bool repeated) override;
+
+		DWORD executeDelayedSteps() override;
+
+		void abandonDelayedSteps() override;
+
+		void getMacroCounters(OUT MacroSchedulerCounters* const counters) override;
+
+		void setOutputSink(POutputSink const sink) override;
+
+		void setLaunchCallback(LaunchCallback const callback, void* const context) override;
+
+		void forgetDevice(HANDLE const device) override;
 
 		~Remapper() override;
 
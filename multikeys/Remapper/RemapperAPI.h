@@ -7,49 +7,194 @@
 
 namespace Multikeys
 {
-	// Class that represents a sequence of keystrokes or characters
-	// or an executable file.
-	typedef class IKeystrokeCommand
+	// Kinds of commands. This is what tells how a command should be executed.
+	// enum classes are strongly typed
+	enum class KeystrokeOutputType : unsigned int
 	{
-	protected:
-		IKeystrokeCommand() { }
-	public:
+		NoCommand = 0,			// <- not a command; a zeroed KeystrokeCommand is of this type
+		UnicodeCommand,
+		MacroCommand,
+		ScriptCommand,
+		DeadKeyCommand,
+		EmptyCommand			// <- performs no action when executed (good for modifier keys)
+	};
+
+	// Reference to a command that represents a sequence of keystrokes or characters
+	// or an executable file. This is a small value that may be copied freely; it can only be
+	// executed by the remapper that produced it, as part of a KeystrokeAction.
+	typedef struct KeystrokeCommand
+	{
+		KeystrokeOutputType type;
 
-		// Execute this command. This method may have a variety of effects.
-		virtual bool execute(bool keyup, bool repeated) const = 0;
+		// Position of the command's data inside the remapper; meaningless outside of it.
+		unsigned int offset;
 
-		// Virtual destructor
-		virtual ~IKeystrokeCommand() = 0;
+		// True if this refers to no command at all.
+		inline bool isNull() const { return type == KeystrokeOutputType::NoCommand; }
 
 	} *PKeystrokeCommand;
 
+	// Everything that should be done in response to a keystroke, as decided when the keystroke
+	// was evaluated. This is a value that doesn't depend on any state inside the remapper, so it
+	// may be queued, batched or replayed, and executed at any later time, as long as the settings
+	// aren't reloaded more than once in the meantime.
+	typedef struct KeystrokeAction
+	{
+		// Dead key whose own character must be sent before command, because the key that followed it
+		// didn't combine with it; null otherwise (including when it was replaced by a combination).
+		KeystrokeCommand deadKey;
+
+		// Command to be executed; if a dead key combined with this keystroke, this is the replacement.
+		KeystrokeCommand command;
+
+		// Identify the loaded settings, and the keyboard in them, that both commands belong to;
+		// set by the remapper.
+		unsigned int generation;
+		unsigned int keyboard;
+
+	} *PKeystrokeAction;
+
+
+	// Destination of the output of executed commands. Commands append the keystrokes they
+	// produce to a sink, and the remapper flushes it once after each command is executed,
+	// so that all output for a single keystroke is sent at once.
+	typedef class IOutputSink
+	{
+	public:
+
+		// Returns space for count keystrokes at the end of the pending output, which the caller
+		// must fill in. The pointer is only valid until the next call to a method of this sink.
+		virtual INPUT* appendKeystrokes(const size_t count) = 0;
+
+		// Opens a file (such as an executable) with the given arguments. Pending keystrokes
+		// must be sent before the file is opened. Returns FALSE if the file couldn't be opened
+		// (or, if it's opened asynchronously, couldn't be requested).
+		virtual bool openFile(const wchar_t* const filename, const wchar_t* const arguments) = 0;
+
+		// Sends all pending keystrokes. Returns FALSE if not every keystroke could be sent.
+		virtual bool flush() = 0;
+
+		virtual ~IOutputSink() = 0;
+
+	} *POutputSink;
+
+
+	// Counters of the scheduler that continues macros after their delays (see IRemapper::getMacroCounters).
+	struct MacroSchedulerCounters
+	{
+		// Delays that were scheduled, and delayed steps that were run
+		unsigned long long scheduled;
+		unsigned long long fired;
+
+		// Milliseconds between the time each delayed step was due and the time it was run;
+		// added up, and the most of them
+		unsigned long long totalLateness;
+		unsigned long long maxLateness;
+
+		// Times a waiting macro was moved from a coarser level of the timer wheel to a finer one
+		unsigned long long cascades;
+
+		// Delays that were skipped because too many macros were waiting; the rest of the macro
+		// was sent at once
+		unsigned long long overflows;
+
+		// Delayed steps that were dropped because their settings were reloaded twice in the meantime
+		unsigned long long dropped;
+	};
+
+
+	// Function that receives the result of opening a file requested by a command.
+	// Files are opened in a separate thread, and this is called from that thread.
+	// filename, arguments - what was opened; only valid during the call.
+	// error - zero if the file was opened; otherwise, the error returned by ShellExecute.
+	// context - the value given along with this function.
+	typedef void(*LaunchCallback)(const wchar_t* filename, const wchar_t* arguments, DWORD error, void* context);
+
 
 	// Class that holds an internal model of the user's remapped keyboards;
 	// can be queried for a remapped command of a given keypress
+	// evaluateKey, isPassThrough and forgetDevice must always be called from the same thread (the evaluating
+	// thread), and so must executeAction and executeDelayedSteps (possibly a different one). Settings may be loaded
+	// from any thread.
 	typedef class IRemapper
 	{
 	public:
 
 		// Opens configuration file at filename and loads
 		// its remaps it into this instance. Returns FALSE if any
-		// error was encountered.
+		// error was encountered, in which case the previous settings remain.
+		// The new settings are compiled in the calling thread, and replace the previous ones
+		// when the evaluating thread evaluates its next key, which never waits for a load.
+		// Devices then keep the modifiers they're holding, if the new settings have modifiers
+		// with the same names.
 		virtual bool loadSettings(const std::wstring xmlFilename) = 0;
 
+		// Loads the settings at xmlFilename again whenever that file changes, in a thread of
+		// its own, until this remapper is destroyed or this is called again with another file.
+		// The file should already be loaded. Returns FALSE if the file can't be watched.
+		virtual bool watchSettings(const std::wstring xmlFilename) = 0;
+
 		// Evaluates a user keypress according to loaded remaps.
 		// -- Parameters --
 		// RAWKEYBOARD* keypressed - information about the user keypress
-		// WCHAR* deviceName - full name of the device that generated the input
-		// OUT IKeystrokeCommand** out_action - command to be executed instead
+		// HANDLE device - Raw Input handle of the device that generated the input
+		//			(hDevice in the RAWINPUTHEADER)
+		// OUT KeystrokeAction* out_action - action to be executed instead
 		//			of the user input, in case it should be blocked.
 		// -- Return value --
 		// TRUE - User input should be blocked, and out_action should be executed.
 		// FALSE - Do not block user input and do not execute out_action.
 		virtual bool evaluateKey(
 			RAWKEYBOARD* const keypressed,
-			WCHAR* const deviceName,
-			OUT PKeystrokeCommand* const out_action
+			HANDLE const device,
+			OUT PKeystrokeAction const out_action
 		)= 0;
 
+		// Returns TRUE if evaluateKey would certainly return FALSE for a keystroke, from any device,
+		// and change nothing; the keystroke may then be passed through without evaluating it
+		// (and without waiting for its decision). Only a couple of bits are checked.
+		// Only the scancode, the E0 and E1 flags and the break flag of keypressed are used.
+		virtual bool isPassThrough(const RAWKEYBOARD* const keypressed) = 0;
+
+		// Executes an action obtained from evaluateKey. This method may have a variety of effects.
+		// KeystrokeAction action - action to be executed
+		// bool keyup - true if the keystroke that produced the command is a key release
+		// bool repeated - true if the keystroke is a repetition of a key being held down
+		// Output is sent to this remapper's output sink, which is flushed before returning.
+		// Executing an action doesn't change the state of the remapper.
+		// If the action is a macro with delays, only the steps before its first delay are sent;
+		// the rest are sent by executeDelayedSteps when they're due.
+		// Returns FALSE if the action failed.
+		virtual bool executeAction(const KeystrokeAction action, bool keyup, bool repeated) = 0;
+
+		// Sends the steps of macros whose delays have passed, and flushes the output sink.
+		// Returns the amount of milliseconds until this should be called again, or INFINITE if no
+		// macro is waiting; executeAction may shorten that. Executing thread only.
+		virtual DWORD executeDelayedSteps() = 0;
+
+		// Releases every key held down by macros that are waiting for a delay, flushes the output
+		// sink, and forgets those macros (they're counted as dropped). Call this before the
+		// executing thread stops; the destructor does it too. Executing thread only.
+		virtual void abandonDelayedSteps() = 0;
+
+		// Fills in the counters of delayed macros since this remapper was created. Executing thread
+		// only; other threads need the executing thread to publish a copy (see Injector).
+		virtual void getMacroCounters(OUT MacroSchedulerCounters* const counters) = 0;
+
+		// Replaces the sink that receives the output of executed commands. By default, output
+		// is sent to the system with SendInput. The sink is not owned by this object and
+		// must outlive it; pass null to go back to the default sink.
+		virtual void setOutputSink(POutputSink const sink) = 0;
+
+		// Sets the function that receives the result of each file opened by the default output sink.
+		// Pass null to stop receiving results.
+		virtual void setLaunchCallback(LaunchCallback const callback, void* const context) = 0;
+
+		// Device handles are associated with keyboards the first time they're seen.
+		// Call this when a device is removed (WM_INPUT_DEVICE_CHANGE), since its
+		// handle may be given to another device later.
+		virtual void forgetDevice(HANDLE const device) = 0;
+
 		virtual ~IRemapper() = 0;
 
 	} *PRemapper;
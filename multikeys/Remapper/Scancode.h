@@ -6,6 +6,19 @@
 
 namespace Multikeys
 {
+
+	// Amount of distinct values returned by Scancode::index();
+	// one row of 256 make codes for each prefix (none, 0xE0 and 0xE1).
+	const size_t SCANCODE_TABLE_SIZE = 3 * 256;
+
+	// Amount of words in a bitmap with one bit for each value of Scancode::index().
+	const size_t SCANCODE_BITMAP_WORDS = SCANCODE_TABLE_SIZE / 32;
+
+	// True if the bit of the given index (see Scancode::index) is set in a scancode bitmap.
+	inline bool TestScancodeBit(const unsigned int * const bitmap, const unsigned short index)
+	{
+		return ((bitmap[index >> 5] >> (index & 31)) & 1) != 0;
+	}
 	
 	// This structure uniquely represents a physical key on a keyboard;
 	// a scancode is represented by a single byte, optionally prefixed
@@ -31,6 +44,19 @@ namespace Multikeys
 		Scancode(BYTE makeCode) : Scancode(false, false, makeCode)
 		{}
 
+		// Position of this scancode in tables that are indexed by scancode.
+		// Always smaller than SCANCODE_TABLE_SIZE.
+		inline unsigned short index() const
+		{
+			return (flgE1 ? 0x200 : flgE0 ? 0x100 : 0) | makeCode;
+		}
+
+		// Inverse of index(); receives a value smaller than SCANCODE_TABLE_SIZE.
+		static inline Scancode fromIndex(unsigned short index)
+		{
+			return Scancode(index >= 0x200, (index & 0x300) == 0x100, index & 0xff);
+		}
+
 	};
 
 	// operators
@@ -0,0 +1,139 @@
+#include "stdafx.h"
+#include "SchemaValidator.h"
+
+#include <xercesc/sax2/XMLReaderFactory.hpp>
+#include <xercesc/framework/XMLGrammarPoolImpl.hpp>
+#include <xercesc/util/XMLUni.hpp>
+#include <xercesc/util/OutOfMemoryException.hpp>
+
+// Implementation of methods defined in SchemaValidator.h
+
+namespace Multikeys
+{
+	SchemaValidator::SchemaValidator(const std::wstring& schemaFilename)
+		: grammarPool(nullptr), grammarLoaded(false)
+	{
+		// Xerces stays initialized until this object is destroyed
+		xercesc::XMLPlatformUtils::Initialize();
+
+		grammarPool = new xercesc::XMLGrammarPoolImpl(xercesc::XMLPlatformUtils::fgMemoryManager);
+		xercesc::SAX2XMLReader* reader = _createReader();
+		readers.push_back(reader);
+
+		// Parse the schema once, and keep it in the pool
+		try
+		{
+			grammarLoaded = reader->loadGrammar(
+				(const XMLCh*)schemaFilename.c_str(), xercesc::Grammar::SchemaGrammarType, true) != nullptr;
+		}
+		catch (const xercesc::XMLException&)
+		{
+			grammarLoaded = false;
+		}
+		catch (const xercesc::SAXException&)
+		{
+			grammarLoaded = false;
+		}
+		if (grammarLoaded)
+			grammarPool->lockPool();		// <- settings files can't add grammars of their own
+		else
+			OutputDebugString(L"Schema not found; settings will be read without validation.\n");
+	}
+
+	xercesc::SAX2XMLReader* SchemaValidator::_createReader()
+	{
+		xercesc::SAX2XMLReader* reader = xercesc::XMLReaderFactory::createXMLReader(
+			xercesc::XMLPlatformUtils::fgMemoryManager, grammarPool);
+		reader->setFeature(xercesc::XMLUni::fgSAX2CoreNameSpaces, true);
+		reader->setFeature(xercesc::XMLUni::fgXercesSchema, true);
+		// Settings are checked against the cached schema only, never against
+		// a schema named inside the settings file.
+		reader->setFeature(xercesc::XMLUni::fgXercesLoadSchema, false);
+		reader->setFeature(xercesc::XMLUni::fgXercesUseCachedGrammarInParse, true);
+		return reader;
+	}
+
+	std::wstring SchemaValidator::DefaultSchemaFilename()
+	{
+		WCHAR path[MAX_PATH];
+		DWORD length = GetModuleFileName(NULL, path, MAX_PATH);
+		if (length == 0 || length == MAX_PATH)
+			return std::wstring(SCHEMA_FILENAME);		// <- then try the working directory
+
+		// Replace the executable's name with the schema's
+		std::wstring filename(path, length);
+		size_t separator = filename.find_last_of(L"\\/");
+		filename.erase(separator == std::wstring::npos ? 0 : separator + 1);
+		return filename.append(SCHEMA_FILENAME);
+	}
+
+	unsigned long long SchemaValidator::HashContent(const BYTE* const content, const size_t length,
+		const unsigned long long seed)
+	{
+		unsigned long long hash = seed;
+		for (size_t i = 0; i < length; i++)
+		{
+			hash ^= content[i];
+			hash *= 1099511628211ull;							// FNV prime
+		}
+		return hash;
+	}
+
+	bool SchemaValidator::needsValidation(const unsigned long long contentHash) const
+	{
+		return grammarLoaded && validHashes.count(contentHash) == 0;
+	}
+
+	void SchemaValidator::rememberValid(const unsigned long long contentHash)
+	{
+		if (validHashes.size() >= MAX_VALID_HASHES)
+			validHashes.clear();
+		validHashes.insert(contentHash);
+	}
+
+	size_t SchemaValidator::prepareReaders(const size_t count)
+	{
+		// Readers can only share the pool after it's locked; otherwise they're not shared at all
+		if (!grammarLoaded)
+			return 1;
+		try
+		{
+			while (readers.size() < count)
+				readers.push_back(_createReader());
+		}
+		catch (const xercesc::OutOfMemoryException&)
+		{
+			// Make do with the readers that exist
+		}
+		catch (const std::bad_alloc&)
+		{
+			// Same as above
+		}
+		return (readers.size() < count ? readers.size() : count);
+	}
+
+	xercesc::SAX2XMLReader* SchemaValidator::getReader(const size_t index, const bool validate)
+	{
+		xercesc::SAX2XMLReader* reader = readers[index];
+		reader->setFeature(xercesc::XMLUni::fgSAX2CoreValidation, validate);
+		reader->setFeature(xercesc::XMLUni::fgXercesDynamic, false);
+		reader->setFeature(xercesc::XMLUni::fgXercesSchemaFullChecking, false);
+		return reader;
+	}
+
+	SchemaValidator::~SchemaValidator()
+	{
+		// Readers use the pool, and all of them use Xerces
+		for (auto it = readers.begin(); it != readers.end(); it++)
+			delete (*it);
+		delete grammarPool;
+		try
+		{
+			xercesc::XMLPlatformUtils::Terminate();
+		}
+		catch (const xercesc::XMLException&)
+		{
+			// Nothing else to be done
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <xercesc/sax2/SAX2XMLReader.hpp>
+#include <xercesc/framework/XMLGrammarPool.hpp>
+
+#include <unordered_set>
+
+namespace Multikeys
+{
+
+	// Name of the schema for settings files, which is looked for in the same folder as the executable.
+	const wchar_t* const SCHEMA_FILENAME = L"Multikeys.xsd";
+
+	// Amount of content hashes remembered as valid; older ones are forgotten all at once.
+	const size_t MAX_VALID_HASHES = 256;
+
+	// Hash of empty content (see SchemaValidator::HashContent).
+	const unsigned long long FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+
+	// This class keeps everything needed for reading settings files for as long as it exists:
+	// Xerces itself, readers, and the schema (Multikeys.xsd), loaded once into a grammar pool.
+	// It also remembers which content was already found valid, so that reloading the same
+	// settings doesn't validate them again.
+	// Only one thread may call the methods of an object of this class; but the readers it returns
+	// may be used by several threads at once, one thread per reader, since the pool is locked.
+	class SchemaValidator
+	{
+	private:
+
+		// Holds the schema, once loaded; shared by every parse.
+		xercesc::XMLGrammarPool* grammarPool;
+
+		// Readers for settings files, one per thread that parses them; the first one also
+		// loaded the schema.
+		std::vector<xercesc::SAX2XMLReader*> readers;
+
+		// False if the schema couldn't be loaded, in which case nothing is validated.
+		bool grammarLoaded;
+
+		// Content hashes of settings that were recently found valid.
+		std::unordered_set<unsigned long long> validHashes;
+
+		// Makes a reader that uses the grammar pool.
+		xercesc::SAX2XMLReader* _createReader();
+
+	public:
+
+		// Initializes Xerces, and loads the schema at schemaFilename into the grammar pool.
+		// If the schema can't be loaded, settings are read without validation.
+		// Throws xercesc::XMLException if Xerces can't be initialized.
+		SchemaValidator(const std::wstring& schemaFilename);
+
+		SchemaValidator(const SchemaValidator&) = delete;
+		SchemaValidator& operator=(const SchemaValidator&) = delete;
+
+		// Returns the full name of the schema that comes with the running executable.
+		static std::wstring DefaultSchemaFilename();
+
+		// Hashes the content of a settings file (FNV-1a, 64 bits).
+		// seed - hash of whatever came before content, to hash several pieces as if they were one.
+		static unsigned long long HashContent(const BYTE* const content, const size_t length,
+			const unsigned long long seed = FNV_OFFSET_BASIS);
+
+		// True if content with this hash needs to be validated before being used;
+		// that is, if a schema is loaded and the same content wasn't found valid last time.
+		bool needsValidation(const unsigned long long contentHash) const;
+
+		// Call after content with this hash was read and found valid.
+		void rememberValid(const unsigned long long contentHash);
+
+		// Makes sure there are at least count readers, so that count threads can parse settings
+		// at once. Returns the amount of readers available, which is less than count if Xerces
+		// runs out of memory (but never less than one).
+		size_t prepareReaders(const size_t count);
+
+		// Returns a reader to be used for parsing settings, with validation against the
+		// schema turned on or off. The reader belongs to this object; set its handlers
+		// before using it, and reset them afterwards.
+		// index - which reader; must be less than the amount returned by prepareReaders.
+		//			Different threads must use different readers.
+		// This method may be called by the thread that uses the reader.
+		xercesc::SAX2XMLReader* getReader(const size_t index, const bool validate);
+
+		// Releases the reader and the schema, then Xerces itself.
+		~SchemaValidator();
+
+	};
+
+}
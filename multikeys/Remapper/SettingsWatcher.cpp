@@ -0,0 +1,62 @@
+#include "stdafx.h"
+#include "SettingsWatcher.h"
+
+// Implementation of methods defined in SettingsWatcher.h
+
+namespace Multikeys
+{
+	SettingsWatcher::SettingsWatcher(IRemapper* const remapper, const std::wstring& filename)
+		: remapper(remapper), filename(filename)
+	{
+		// Everything up to the last separator; a name without one is in the working directory
+		size_t separator = filename.find_last_of(L"\\/");
+		directory = (separator == std::wstring::npos ? std::wstring(L".") : filename.substr(0, separator + 1));
+
+		if (!GetLayoutSource(filename, &lastSource))
+			ZeroMemory(&lastSource, sizeof(lastSource));
+
+		stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		change = FindFirstChangeNotification(directory.c_str(), FALSE,
+			FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+		// The thread is started last, after every member it uses is initialized
+		if (change != INVALID_HANDLE_VALUE)
+			worker = std::thread(&SettingsWatcher::_run, this);
+	}
+
+	void SettingsWatcher::_run()
+	{
+		HANDLE handles[2] = { stopEvent, change };
+		while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+		{
+			// Let the writer finish; whatever else it does in the meantime is part of the same change
+			if (WaitForSingleObject(stopEvent, SETTINGS_SETTLE_MILLISECONDS) == WAIT_OBJECT_0)
+				break;
+			if (!FindNextChangeNotification(change))
+				break;
+
+			LayoutSource source;
+			if (!GetLayoutSource(filename, &source))
+				continue;		// <- such as while the file is being replaced
+			if (source.size == lastSource.size
+				&& source.lastWriteTime.dwLowDateTime == lastSource.lastWriteTime.dwLowDateTime
+				&& source.lastWriteTime.dwHighDateTime == lastSource.lastWriteTime.dwHighDateTime)
+				continue;		// <- something else in the directory changed
+
+			// A file that can't be loaded is not tried again until it changes; the current
+			// layout stays in use until then.
+			lastSource = source;
+			if (!remapper->loadSettings(filename))
+				OutputDebugString(L"SettingsWatcher: The changed settings could not be loaded.\n");
+		}
+	}
+
+	SettingsWatcher::~SettingsWatcher()
+	{
+		SetEvent(stopEvent);
+		if (worker.joinable())
+			worker.join();
+		if (change != INVALID_HANDLE_VALUE)
+			FindCloseChangeNotification(change);
+		CloseHandle(stopEvent);
+	}
+}
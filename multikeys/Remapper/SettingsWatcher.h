@@ -0,0 +1,67 @@
+#pragma once
+
+#include "stdafx.h"
+#include "RemapperAPI.h"
+#include "LayoutImage.h"
+
+#include <thread>
+
+namespace Multikeys
+{
+
+	// Time to wait after a change is noticed before loading the settings, since editors usually
+	// save a file in several steps (and each of them is noticed).
+	const DWORD SETTINGS_SETTLE_MILLISECONDS = 200;
+
+
+	// This class watches a settings file in a thread of its own, and asks a remapper to load it
+	// again every time it changes. The remapper keeps using its current layout while the new one
+	// is compiled, so nothing that evaluates keys ever waits for this.
+	// Changes are recognized by the size and time of the last write of the file, so changes to
+	// other files in the same directory (including the file's layout image) are ignored.
+	class SettingsWatcher
+	{
+	private:
+
+		// Remapper that loads the settings; not owned by this object.
+		IRemapper* remapper;
+
+		std::wstring filename;
+
+		// Directory that contains the file; that's what Windows is able to watch.
+		std::wstring directory;
+
+		// Settings file as it was when it was last loaded (or when loading it last failed).
+		LayoutSource lastSource;
+
+		// Signaled by Windows when something in the directory changes.
+		HANDLE change;
+
+		// Manual-reset event that is signaled when the worker should stop.
+		HANDLE stopEvent;
+
+		// Thread that waits for changes and loads the settings.
+		std::thread worker;
+
+		// Body of the worker thread.
+		void _run();
+
+	public:
+
+		// remapper - loads the settings; must outlive this object.
+		// filename - settings file, which is assumed to be already loaded.
+		// The worker thread starts immediately, unless the directory can't be watched.
+		SettingsWatcher(IRemapper* const remapper, const std::wstring& filename);
+
+		SettingsWatcher(const SettingsWatcher&) = delete;
+		SettingsWatcher& operator=(const SettingsWatcher&) = delete;
+
+		// False if the directory can't be watched; the object does nothing then.
+		inline bool isWatching() const { return change != INVALID_HANDLE_VALUE; }
+
+		// Stops the worker thread. A load that is already under way is waited for.
+		~SettingsWatcher();
+
+	};
+
+}
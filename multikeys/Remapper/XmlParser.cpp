@@ -5,80 +5,215 @@
 #include "Remapper.h"
 #include "Keyboard.h"
 #include "Layer.h"
+#include "CommandTable.h"
 #include "Scancode.h"
 #include "KeystrokeCommands.h"
-
-#include <stdexcept>
-#include <algorithm>	// for string replacement
+#include "Arena.h"
+#include "CompiledLayout.h"
+#include "SchemaValidator.h"
+#include "LayoutImage.h"
 
 // Xerces
-#include <xercesc/dom/DOM.hpp>
-#include <xercesc/parsers/XercesDOMParser.hpp>
-#include <xercesc/sax/HandlerBase.hpp>
-
-
-// helper function to convert a const XMLCh* into a wchar_t*
-const wchar_t* xmlch_to_wcs(const XMLCh* from)
+#include <xercesc/sax2/SAX2XMLReader.hpp>
+#include <xercesc/sax2/DefaultHandler.hpp>
+#include <xercesc/sax2/Attributes.hpp>
+#include <xercesc/sax/SAXParseException.hpp>
+#include <xercesc/framework/XMLPScanToken.hpp>
+#include <xercesc/framework/MemBufInputSource.hpp>
+#include <xercesc/util/XMLString.hpp>
+#include <xercesc/util/XMLUni.hpp>
+
+#include <algorithm>		// std::search
+#include <atomic>
+#include <thread>
+
+
+// helper function to build a wstring from a sequence of XMLCh.
+std::wstring xmlch_to_wstring(const XMLCh* from, size_t length)
 {
-	return reinterpret_cast<const wchar_t*>(from);
+	return std::wstring(from, from + length);
 }
 
-// helper function to build a wstring from a const XMLCh*.
-std::wstring xmlch_to_wstring(const XMLCh* from)
+// helper function to check whether an XMLCh* (which may be null) is equal to a UTF-16 literal
+bool xmlch_equals(const XMLCh* first, const XMLCh* second)
 {
-	if (!from) throw std::invalid_argument("XMLCh* argument was null.");
-	auto u16 = std::u16string(from);
-	return std::wstring(u16.begin(), u16.end());
-}
-
-// helper function to compare an XMLCh* with a wide string
-int u16wcscmp(const XMLCh* first, const wchar_t* second)
-{
-	return wcscmp(
-		xmlch_to_wcs(first),
-		second
-	);
+	return first != nullptr && xercesc::XMLString::equals(first, second);
 }
 
 // implementation of readSettings in Remapper class
 
 
 // Typedefs for ease of use
-typedef xercesc::XercesDOMParser	XercesDOMParser, *PXercesDOMParser;
-typedef xercesc::XMLString			XmlString, *PXmlString;
-typedef xercesc::DOMDocument		XmlDocument, *PXmlDocument;
-typedef xercesc::DOMNode			XmlNode, *PXmlNode;
-typedef xercesc::DOMNodeList		XmlNodeList, *PXmlNodeList;
-typedef xercesc::DOMAttr			XmlAttribute, *PXmlAttribute;
-typedef xercesc::DOMNamedNodeMap	XmlNamedNodeMap, *PXmlNamedNodeMap;
-typedef xercesc::DOMElement			XmlElement, *PXmlElement;
+typedef xercesc::SAX2XMLReader		SAX2XMLReader, *PSAX2XMLReader;
+typedef xercesc::Attributes			XmlAttributes;
 
 using namespace Multikeys;
 
 
 /*---Prototypes for functions used in this file---*/
-// Parses an entire document node and extracts an array of keyboards from it.
-// PXmlDocument document - node representing the entire document to be parsed
-// keyboardArray - array of Keyboard* (Keyboard pointers) that will contain the final result
-// keyboardCount - will contain the amount of keyboards read (length of keyboard array)
-bool ParseDocument(const PXmlDocument document,
-	OUT Keyboard* **const keyboardArray,
-	OUT unsigned int *const keyboardCount);
+// Reads an entire file into content. Returns false if the file can't be read.
+bool ReadWholeFile(const std::wstring& filename, OUT std::vector<BYTE> *const content);
+
+// Reads a hexadecimal number from length characters of text, without allocating anything.
+// Whitespace around the number is ignored, and so are colons (as in "E0:38") and a "0x" prefix.
+// Returns false if there's no number, if there's anything else in the text,
+// or if the number doesn't fit in 32 bits.
+bool ParseHex(const XMLCh* text, size_t length, OUT unsigned int *const value);
+
+// Same as ParseHex, for a decimal number (such as the attributes of a macro's delays).
+// Nothing but digits and whitespace around them is accepted.
+bool ParseDecimal(const XMLCh* text, size_t length, OUT unsigned int *const value);
+
+// Turns a number such as 0x1e or 0xe038 into a scancode.
+// Returns false if the number is longer than two bytes.
+bool MakeScancode(const unsigned int value, OUT Scancode *const scancode);
+
+// Range of bytes of a settings document that holds one keyboard element, and its content hash.
+// The hash also covers everything before the first keyboard and after the last one (such as the
+// prolog, which may declare entities used by the keyboard), but not the other keyboards.
+struct SettingsSection
+{
+	size_t begin;
+	size_t end;
+	unsigned long long hash;
+};
+
+// Parses a settings document with reader, and compiles every keyboard in it, in order, into
+// out_keyboards (one section per keyboard; see LayoutImage.h). Returns false if the document
+// can't be used. Any thread may call this, as long as no other thread is using the same reader.
+bool ParseSettings(PSAX2XMLReader const reader, const std::wstring& filename, const BYTE* const document,
+	const size_t size, OUT std::vector<std::vector<BYTE>> *const out_keyboards);
+
+// Finds every keyboard element of a UTF-8 settings document, in order, without parsing it
+// (comments, CDATA and processing instructions are skipped). Returns false if none is found,
+// or if the document isn't laid out as expected; the document must then be parsed as a whole.
+bool SplitKeyboards(const std::vector<BYTE>& content, OUT std::vector<SettingsSection> *const sections);
+
+
+// Receives the contents of a settings document from the Xerces SAX2 parser, one element at a time,
+// and compiles each keyboard as it goes, without a document tree. Keyboards are compiled into a
+// scratch arena, one at a time, and copied out as a section (see LayoutImage.h) once complete.
+// Elements are expected in the order given by the schema (Multikeys.xsd); once anything can't be
+// read, failed() becomes true and the rest of the document is ignored.
+class SettingsHandler : public xercesc::DefaultHandler
+{
+private:
+
+	// Elements of the settings; "modifier" is a different element inside "modifiers" and "layer".
+	enum class Element
+	{
+		Unknown, Root, Keyboard, Modifiers, ModifierKey, Layer, LayerModifier,
+		Unicode, Macro, VKey, Delay, Repeat, Restore, Execute, Path, Parameter,
+		DeadKey, Independent, Replacement, From, To, Codepoint
+	};
+
+	// A remap read from a layer; remaps are placed in the command table once the whole keyboard
+	// is read, because the table needs to know how many layers there are.
+	struct Remap
+	{
+		size_t layer;
+		Scancode scancode;
+		KeystrokeCommand command;
+	};
+
+	// Arena that receives the keyboard being compiled; it's reset for every keyboard.
+	Arena& arena;
+
+	// Set as soon as anything can't be read, along with the reason.
+	bool failure;
+	const wchar_t* failureReason;
+
+	// Set when the end of the document is reached.
+	bool finished;
+
+	// Elements that are currently open, innermost last.
+	std::vector<Element> openElements;
+
+	// Text of the current element, if it's an element whose text is used.
+	// Its memory is reused from one element to the next.
+	std::u16string text;
+	bool collectingText;
+
+	// Sections of the keyboards that were completely read and compiled, in order.
+	std::vector<std::vector<BYTE>> keyboards;
+
+	// Keyboard being read
+	std::wstring keyboardName;
+	std::vector<std::pair<std::wstring, Scancode>> modifierScancodes;
+	ModifierStateMap* modifiers;		// owned by this object; only needed until the keyboard is compiled
+	std::vector<Layer*> layers;			// also owned by this object
+	std::vector<Remap> remaps;
 
-// Parses a keyboard element and places its data in a Keyboard class;
-// Keyboard* - (pointer to) keyboard structure that will hold this node's data.
-bool ParseKeyboard(const PXmlElement kbElement, OUT Keyboard* *const pKeyboard);
+	// Layer being read
+	std::vector<std::wstring> layerModifierNames;
 
-// Receives a keyboard element, and instantiates a modifier state map with its remap in it
-bool ParseModifier(const PXmlElement modElement, OUT ModifierStateMap* *const pModifiers);
+	// Remap being read; its kind is the innermost element among the open ones.
+	Scancode remapScancode;
+	bool triggerOnRepeat;
+	std::vector<unsigned int> codepoints;				// unicode, and independent codepoints of dead keys
+	std::vector<unsigned short> keypresses;				// macro
+	std::wstring path;									// execute
+	std::wstring parameter;
+	size_t pathCount, parameterCount;
+	std::vector<unsigned int> fromCodepoints;			// one replacement of a dead key
+	std::vector<unsigned int> toCodepoints;
+	std::vector<UnicodeCommand*> replacementsFrom;		// every replacement of a dead key
+	std::vector<UnicodeCommand*> replacementsTo;
+	size_t independentCount;
+	bool vkeyUp;
+	// Where the codepoint being read goes
+	std::vector<unsigned int>* codepointTarget;
 
-// Parses a layer element and places its data in a Layer class;
-// pLayer - (pointer to) layer structure that will hold this node's data
-bool ParseLayer(const PXmlElement lvlElement, OUT Layer* *const pLayer);
-bool ParseUnicode(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand);
-bool ParseMacro(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand);
-bool ParseExecutable(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand);
-bool ParseDeadKey(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand);
+	// Marks the document as impossible to read.
+	void _fail(const wchar_t* const reason);
+
+	// Element that contains the one being opened or closed; Unknown at the root.
+	Element _parent() const;
+
+	// Each of these is called when the element named in it closes.
+	void _endModifiers();
+	void _endLayer();
+	void _endKeyboard();
+	void _endRemap(const KeystrokeCommand command);
+
+	// Deletes every object owned by this handler that belongs to the keyboard being read.
+	void _discardKeyboard();
+
+public:
+
+	// arena - scratch arena for compiling keyboards; anything in it is lost.
+	SettingsHandler(Arena& arena);
+
+	SettingsHandler(const SettingsHandler&) = delete;
+	SettingsHandler& operator=(const SettingsHandler&) = delete;
+
+	// True if the document can't be used.
+	inline bool failed() const { return failure; }
+
+	// True if the whole document was read.
+	inline bool complete() const { return finished && !failure; }
+
+	// Why the document can't be used; null if no reason was given.
+	inline const wchar_t* getFailureReason() const { return failureReason; }
+
+	// Places the section of every keyboard read in out_keyboards.
+	// Only call this if complete() is true.
+	void releaseKeyboards(OUT std::vector<std::vector<BYTE>> *const out_keyboards);
+
+	// Methods called by the parser
+	void startElement(const XMLCh* const uri, const XMLCh* const localname,
+		const XMLCh* const qname, const XmlAttributes& attrs) override;
+	void endElement(const XMLCh* const uri, const XMLCh* const localname,
+		const XMLCh* const qname) override;
+	void characters(const XMLCh* const chars, const XMLSize_t length) override;
+	void endDocument() override;
+	// Only called when validating; anything that doesn't follow the schema makes the document unusable.
+	void error(const xercesc::SAXParseException& exc) override;
+
+	// Deletes whatever belongs to a keyboard that wasn't completely read.
+	~SettingsHandler() override;
+
+};
 
 
 
@@ -87,584 +222,896 @@ namespace Multikeys
 {
 	bool Remapper::loadSettings(const std::wstring filename)
 	{
-		try
+		// Only one load at a time (such as a load requested by the user while the watcher loads)
+		std::lock_guard<std::mutex> lock(loadMutex);
+
+		// A layout compiled before from the same settings is used directly, without parsing anything.
+		// The file is first recognized by the time of its last write, and otherwise by its content.
+		std::wstring imageFilename = GetLayoutImageFilename(filename);
+		LayoutSource layoutSource;
+		if (!GetLayoutSource(filename, &layoutSource))
+			return false;
+		Arena* newArena = MapLayoutImage(imageFilename, layoutSource);
+
+		if (newArena == nullptr)
 		{
-			xercesc::XMLPlatformUtils::Initialize();
+			std::vector<BYTE> content;
+			if (!ReadWholeFile(filename, &content))
+				return false;
+			layoutSource.size = content.size();
+			layoutSource.hash = SchemaValidator::HashContent(content.data(), content.size());
+			layoutSource.hasHash = true;
+			// Such as when the file was saved again without changes
+			newArena = MapLayoutImage(imageFilename, layoutSource);
+
+			if (newArena == nullptr)
+			{
+				newArena = _compileSettings(filename, content);
+				if (newArena == nullptr)
+					return false;
+				// Without an image, the next load simply compiles the settings again
+				if (!WriteLayoutImage(imageFilename, *newArena, layoutSource))
+					OutputDebugString(L"Could not save the compiled layout.\n");
+			}
 		}
-		catch (const xercesc::XMLException&)
+
+		// Set!
+		// The layout takes ownership of the arena. It's adopted by the evaluating thread at the next
+		// keystroke; a layout loaded before that, and never adopted, is simply discarded.
+		const CompiledLayout* newLayout = new CompiledLayout(newArena, ++lastGeneration);
+
+		// Kept for the next load, which may reuse its keyboards
+		newLayout->addRef();
+		if (this->lastLoaded != nullptr)
+			this->lastLoaded->release();
+		this->lastLoaded = newLayout;
+
+		const CompiledLayout* skipped = this->pendingLayout.exchange(newLayout, std::memory_order_acq_rel);
+		if (skipped != nullptr)
+			skipped->release();
+
+		return true;
+	}
+
+
+	Arena* Remapper::_compileSettings(const std::wstring& filename, const std::vector<BYTE>& content)
+	{
+		// Xerces and the schema are only loaded the first time, and kept until this object is destroyed
+		if (validator == nullptr)
 		{
-			// OutputDebugString(L"Error during initialization of Xerces: " + e.getMessage() + L"\n");
-			return false;
+			try
+			{
+				validator = new SchemaValidator(SchemaValidator::DefaultSchemaFilename());
+			}
+			catch (const xercesc::XMLException&)
+			{
+				// OutputDebugString(L"Error during initialization of Xerces: " + e.getMessage() + L"\n");
+				return nullptr;
+			}
 		}
 
-		PXercesDOMParser parser = new XercesDOMParser();
-		parser->setValidationScheme(XercesDOMParser::Val_Always);
-		parser->setDoNamespaces(true);
-		parser->setCreateCommentNodes(false);		// Do not create comments
+		// Keyboards whose elements are exactly the same as in the last load are copied from it,
+		// already compiled. Every other keyboard is parsed in a document of its own, made of the
+		// beginning and end of the settings with only that keyboard in between, so that they can
+		// all be parsed at the same time.
+		std::vector<SettingsSection> sections;
+		std::vector<CompiledKeyboard> keyboards;
+		std::vector<std::vector<std::vector<BYTE>>> results;
+		bool split = SplitKeyboards(content, &sections);
+		if (split)
+		{
+			std::vector<size_t> changed;
+			std::vector<std::vector<BYTE>> documents;
+			keyboards.resize(sections.size());
+			for (size_t i = 0; i < sections.size(); i++)
+			{
+				if (lastLoaded == nullptr || !lastLoaded->findCompiledKeyboard(sections[i].hash, &keyboards[i]))
+					changed.push_back(i);
+			}
+			// The rest of the document may have changed as well (such as whitespace between the
+			// keyboards), so something is always parsed, and it must have at least one keyboard to
+			// follow the schema. That keyboard was reused, so only whether it parses matters.
+			bool validationOnly = changed.empty();
+			if (validationOnly)
+				changed.push_back(0);
+			for (auto it = changed.begin(); it != changed.end(); it++)
+			{
+				std::vector<BYTE> document(content.begin(), content.begin() + sections.front().begin);
+				document.insert(document.end(), content.begin() + sections[*it].begin, content.begin() + sections[*it].end);
+				document.insert(document.end(), content.begin() + sections.back().end, content.end());
+				documents.push_back(std::move(document));
+			}
+
+			// Splitting only skips comments, CDATA sections and processing instructions, so text such
+			// as "<keyboard" inside a DOCTYPE makes documents that don't parse; and each keyboard
+			// element always makes one keyboard. If anything is off, the whole document is parsed below.
+			split = _parseDocuments(filename, documents, &results);
+			for (size_t i = 0; split && i < changed.size(); i++)
+				split = (results[i].size() == 1);
 
-		xercesc::ErrorHandler* errorHandler = (xercesc::ErrorHandler*) new xercesc::HandlerBase();
-		parser->setErrorHandler(errorHandler);
+			// Merge the results in the order of the document; if nothing changed, the reused copy is kept
+			if (split && !validationOnly)
+			{
+				for (size_t i = 0; i < changed.size(); i++)
+					keyboards[changed[i]] = CompiledKeyboard{ results[i][0].data(), (unsigned int)results[i][0].size(),
+						sections[changed[i]].hash };
+			}
+		}
+		if (!split)
+		{
+			// Nothing can be reused, or splitting didn't work; the whole document is parsed at once
+			keyboards.clear();
+			if (!_parseDocuments(filename, std::vector<std::vector<BYTE>>(1, content), &results))
+				return nullptr;
+			for (auto it = results[0].begin(); it != results[0].end(); it++)
+				keyboards.push_back(CompiledKeyboard{ it->data(), (unsigned int)it->size(), 0 });
+		}
 
-		// Load the xml file at filename and generate a tree
 		try
 		{
-			parser->parse((XMLCh*)(filename.c_str()));	// this build of xerces expects char16_t
+			return AssembleLayout(keyboards);
 		}
-		catch (const xercesc::XMLException&)
+		catch (const std::bad_alloc&)
 		{
-			return false;
+			return nullptr;
 		}
+	}
 
 
-		// Do the actual processing
-		PXmlDocument document = parser->getDocument();	// Root of the document to be parsed
-
-														// Actually loading stuff into this parser's list of keyboards is delegated into another function:
-		Keyboard** keyboards = nullptr;
-		unsigned int keyboardCount = 0;
-		ParseDocument(document, &keyboards, &keyboardCount);
-		if (keyboards == nullptr)
+	bool Remapper::_parseDocuments(const std::wstring& filename, const std::vector<std::vector<BYTE>>& documents,
+		OUT std::vector<std::vector<std::vector<BYTE>>> *const out_results)
+	{
+		// Only the loading thread uses the validator itself
+		size_t documentCount = documents.size();
+		std::vector<unsigned long long> hashes(documentCount);
+		std::vector<char> validate(documentCount);
+		for (size_t i = 0; i < documentCount; i++)
 		{
-			OutputDebugString(L"No keyboard found!");
-			return false;
+			hashes[i] = SchemaValidator::HashContent(documents[i].data(), documents[i].size());
+			validate[i] = validator->needsValidation(hashes[i]);
 		}
 
-		// Set!
-		this->keyboards.clear();		// 'this' refers to this instance of Remapper.
-		this->keyboards.assign(keyboards, keyboards + keyboardCount);
-
-																		// At the very end
-		
-		// apparently we can't free the parser and also release the document. Doing both causes an exception.
-		// document->release();
-		delete parser;
-		delete errorHandler;
-		
-		try
+		// Each thread takes the next document that nobody took yet, and places the result in that
+		// document's own slot, so the order of the results doesn't depend on the threads.
+		size_t threadCount = std::thread::hardware_concurrency();
+		if (threadCount > MAX_COMPILER_THREADS) threadCount = MAX_COMPILER_THREADS;
+		if (threadCount > documentCount) threadCount = documentCount;
+		if (threadCount == 0) threadCount = 1;
+		threadCount = validator->prepareReaders(threadCount);
+
+		std::vector<std::vector<std::vector<BYTE>>>& results = *out_results;
+		results.clear();
+		results.resize(documentCount);
+		std::vector<char> parsed(documentCount, 0);
+		std::atomic<size_t> nextDocument(0);
+		std::atomic<bool> failed(false);
+		auto work = [&](const size_t reader)
 		{
-			xercesc::XMLPlatformUtils::Terminate();
-		}
-		catch (xercesc::XMLException&)
+			size_t i;
+			while (!failed.load(std::memory_order_relaxed) && (i = nextDocument.fetch_add(1)) < documentCount)
+			{
+				parsed[i] = ParseSettings(validator->getReader(reader, validate[i] != 0), filename,
+					documents[i].data(), documents[i].size(), &results[i]);
+				if (!parsed[i])
+					failed.store(true, std::memory_order_relaxed);		// <- the others can stop early
+			}
+		};
+
+		// This thread is one of the workers
+		std::vector<std::thread> threads;
+		for (size_t reader = 1; reader < threadCount; reader++)
 		{
-			return false;
+			try
+			{
+				threads.push_back(std::thread(work, reader));
+			}
+			catch (const std::system_error&)
+			{
+				break;		// <- the threads that did start take the remaining documents
+			}
 		}
+		work(0);
+		for (auto it = threads.begin(); it != threads.end(); it++)
+			it->join();
+		if (failed.load())
+			return false;
 
+		for (size_t i = 0; i < documentCount; i++)
+		{
+			if (validate[i])
+				validator->rememberValid(hashes[i]);
+		}
 		return true;
 	}
 }
 
 
-
-
-
 /* Implementing prototypes */
 
 
-bool ParseDocument(const PXmlDocument document,
-	OUT Keyboard* **const keyboardArray,
-	OUT unsigned int *const keyboardCount)
+bool ParseSettings(PSAX2XMLReader const reader, const std::wstring& filename, const BYTE* const document,
+	const size_t size, OUT std::vector<std::vector<BYTE>> *const out_keyboards)
 {
-	// Get root element
-	PXmlElement root = document->getDocumentElement();
-
-	// Get all children elements named "keyboard"
-	PXmlNodeList keyboardElements = document->getElementsByTagName(u"keyboard");
-
-	// keyboardArray is Keyboard***const
-	// first pointer is because it's an out parameter; where it points to is changed
-	// second pointer is an array
-	// third pointer is because the array contains pointers to Keyboard objects
-	*keyboardCount = keyboardElements->getLength();
-	*keyboardArray = new Keyboard*[*keyboardCount];
-	// At this point, *keyboardArray is array of Keyboard*,
-	//		but each Keyboard* is itself an uninitialized pointer.
-
-	for (XMLSize_t i = 0; i < keyboardElements->getLength(); i++)
+	xercesc::MemBufInputSource source(document, size, (const XMLCh*)filename.c_str());
+
+	// Keyboards are compiled one at a time in this arena, and copied out of it
+	bool success = false;
+	const wchar_t* reason = L"The settings are incomplete.";
+	try
 	{
-		// We do this cast here because
-		// Xerces' getElementsByTagName returns Nodes that are all Elements.
-		if (keyboardElements->item(i)->getNodeType() != xercesc::DOMNode::ELEMENT_NODE)
-			return false;
-		PXmlElement keyboardElement = (PXmlElement)keyboardElements->item(i);
-
-		// 1. keyboardArray is a pointer to an array of Keyboard*s (Keyboard* **const)
-		// 2. *keyboardArray is the array of Keyboard*s, already allocated
-		// 3. (*keyboardArray)[i] is one Keyboard* in that array, at position i
-		// 4. &((*keyboardArray)[i]) is a reference to a Keyboard* at position i
-		// 5. After this call, (*keyboardArray)[i] will be a Keyboard* pointing to
-		//			an instantiated Keyboard structure.
-		if (!ParseKeyboard(keyboardElement, &((*keyboardArray)[i])))
-			return false;
+		Arena scratch(KEYBOARD_ARENA_RESERVE);
+		SettingsHandler handler(scratch);
+		reader->setContentHandler(&handler);
+		reader->setErrorHandler(&handler);
+
+		// Read the document one piece at a time, so that it's possible to stop at the first problem
+		xercesc::XMLPScanToken token;
+		bool more = reader->parseFirst(source, token);
+		while (more && !handler.failed())
+			more = reader->parseNext(token);
+		if (handler.failed())
+			reader->parseReset(token);
+
+		success = handler.complete();
+		if (success)
+			handler.releaseKeyboards(out_keyboards);
+		else if (handler.getFailureReason() != nullptr)
+			reason = handler.getFailureReason();
+	}
+	catch (const xercesc::XMLException&)
+	{
+		success = false;
+		reason = L"Xerces could not read the settings.";
+	}
+	catch (const xercesc::SAXException&)
+	{
+		// Such as when the document is not well-formed
+		success = false;
+		reason = L"The settings are not well-formed XML.";
 	}
+	catch (const std::bad_alloc&)
+	{
+		// A keyboard doesn't fit in the arena
+		success = false;
+		reason = L"A keyboard is too large to compile.";
+	}
+	// The reader is kept for the next load, but not the handler
+	reader->setContentHandler(nullptr);
+	reader->setErrorHandler(nullptr);
 
-	return true;
+	if (!success)
+	{
+		OutputDebugString(reason);
+		OutputDebugString(L"\n");
+	}
+	return success;
 }
 
 
-bool ParseKeyboard(const PXmlElement kbElement, OUT Keyboard* *const pKeyboard)
+bool ReadWholeFile(const std::wstring& filename, OUT std::vector<BYTE> *const content)
 {
-	// Get name
-	std::wstring keyboardName = xmlch_to_wstring( kbElement->getAttribute(u"Name") );
-	// Keyboards also have an alias attribute, but that's for the UI
-
-	// There should be one "modifiers" tag:
-	PXmlNodeList modifierElements = kbElement->getElementsByTagName(u"modifiers");
-	if (modifierElements->getLength() != 1)
-		return false;
-	PXmlNode modifierElement = modifierElements->item(0);
-	if (modifierElement->getNodeType() != XmlNode::ELEMENT_NODE)
-		return false;
-	// Get pointer to modifier state map
-	ModifierStateMap * ptrModStateMap = nullptr;
-	// Pass it to the function that will instantiate it
-	if (!ParseModifier((PXmlElement)modifierElement, &ptrModStateMap))
+	HANDLE file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
 		return false;
-	if (!ptrModStateMap) return false;
-	// ptrModStateMap should now point to an instantiated modifier state map.
-	// We'll instantiate it after making all layers
 
+	LARGE_INTEGER size;
+	bool success = GetFileSizeEx(file, &size) && size.QuadPart < MAXDWORD;
+	if (success)
+	{
+		content->resize((size_t)size.QuadPart);
+		DWORD read = 0;
+		success = ReadFile(file, content->data(), (DWORD)content->size(), &read, NULL)
+			&& read == content->size();
+	}
+	CloseHandle(file);
+	return success;
+}
 
-	// Get all layers
-	PXmlNodeList layerElements = kbElement->getElementsByTagName(u"layer");
 
-	// Allocate memory for layers
-	std::vector<Layer*> layerVector;
+bool ParseHex(const XMLCh* text, size_t length, OUT unsigned int *const value)
+{
+	unsigned int result = 0;
+	size_t digits = 0;
+	bool numberEnded = false;		// <- set by whitespace after the number
 
-	for (XMLSize_t i = 0; i < layerElements->getLength(); i++)
+	for (size_t i = 0; i < length; i++)
 	{
-		if (layerElements->item(i)->getNodeType() != XmlNode::ELEMENT_NODE)
-			return false;	// there was a "layer" that's not an element
-		PXmlElement layerElement = (PXmlElement)layerElements->item(i);
-
-		// Declare a pointer to layer
-		Layer* pLayer = nullptr;
-		// This call will place an actual instance there
-		if (!ParseLayer(layerElement, &pLayer))
+		XMLCh c = text[i];
+		unsigned int digit;
+		if (c >= u'0' && c <= u'9') digit = c - u'0';
+		else if (c >= u'a' && c <= u'f') digit = c - u'a' + 10;
+		else if (c >= u'A' && c <= u'F') digit = c - u'A' + 10;
+		else if (c == u':')
+			continue;
+		else if ((c == u'x' || c == u'X') && digits == 1 && result == 0 && !numberEnded && text[i - 1] == u'0')
+		{
+			digits = 0;		// <- "0x" prefix, as accepted by std::stoi
+			continue;
+		}
+		else if (c == u' ' || c == u'\t' || c == u'\r' || c == u'\n')
+		{
+			if (digits > 0) numberEnded = true;
+			continue;
+		}
+		else
 			return false;
-		// Add the new instance into the vector
-		if (!pLayer) return false;
-		layerVector.push_back(pLayer);
-		// The pointer dies, but not the object.
-	}
 
-	// layerArray is ready, and so is the modifier state map
-	*pKeyboard =
-		new Keyboard(keyboardName, layerVector, ptrModStateMap);
+		// Digits after whitespace would be a second number; more than 8 digits don't fit
+		if (numberEnded || digits == 8)
+			return false;
+		result = (result << 4) | digit;
+		digits++;
+	}
 
+	if (digits == 0)
+		return false;
+	*value = result;
 	return true;
 }
 
-
-
-bool ParseModifier(const PXmlElement modElement, OUT ModifierStateMap**const pModifiers)
+bool ParseDecimal(const XMLCh* text, size_t length, OUT unsigned int *const value)
 {
-	// This element contains any number of "modifier" tags in it
-	PXmlNodeList modifierElements = modElement->getElementsByTagName(u"modifier");
+	unsigned int result = 0;
+	size_t digits = 0;
+	bool numberEnded = false;
 
-	// Get a multimap to place stuff in
-	std::multimap<std::wstring, unsigned int> modMultimap;
-
-	for (XMLSize_t i = 0; i < modifierElements->getLength(); i++)
+	for (size_t i = 0; i < length; i++)
 	{
-		// for each element, place a pair in the multimap containing its name and value
-		if (modifierElements->item(i)->getNodeType() != XmlNode::ELEMENT_NODE)
-			return false;		// there was a "modifier" that's not an element
-		PXmlElement thisElement = (PXmlElement)modifierElements->item(i);
-		// get name
-		std::wstring modifierName = xmlch_to_wstring(thisElement->getAttribute(u"Name"));
-		// get value
-		std::wstring modifierScancode = xmlch_to_wstring(thisElement->getTextContent());
-		unsigned int iModifierValue = 0;
-		try
+		XMLCh c = text[i];
+		if (c == u' ' || c == u'\t' || c == u'\r' || c == u'\n')
 		{
-			// Some modifiers have E0 flags; in that case, there will be a ':' complicating things,
-			// so we must remove it to get a number like e038.
-			modifierScancode.erase(std::remove(modifierScancode.begin(), modifierScancode.end(), L':'), modifierScancode.end());
-			// Place the value (without the colon) into an integer
-			iModifierValue = std::stoi(modifierScancode, 0, 16);
+			if (digits > 0) numberEnded = true;
+			continue;
 		}
-		catch (std::exception e)
-		{
-			// handle errors
+		if (c < u'0' || c > u'9' || numberEnded || digits == 9)		// <- 9 digits always fit
 			return false;
-		}
-		auto thisPair =
-			std::pair<std::wstring, unsigned int>(
-				std::wstring(modifierName.begin(), modifierName.end()),
-				iModifierValue
-				);
-		modMultimap.insert(thisPair);
-
+		result = result * 10 + (c - u'0');
+		digits++;
 	}
 
+	if (digits == 0)
+		return false;
+	*value = result;
+	return true;
+}
 
-	// modMultimap contains a number of pairs equal to the amount of modifiers read
-	// some keys are the same; the amount of keys is equal to the amount of modifiers
-	// pairs with the same key (name) are composite modifiers
 
-	std::vector<PModifier> modVector;		// getting a list of modifiers
-	decltype(modMultimap.equal_range(L"")) range;	// range is of whatever type equal_range returns
-													// range will become an std::pair of unknown.
-													// range.second points to the first element that does not have a key of the specified parameter
-	for (auto it = modMultimap.begin(); it != modMultimap.end(); it = range.second)
-	{
-		range = modMultimap.equal_range(it->first);
-		// notice the step: range.second, which will go to the next key
+bool MakeScancode(const unsigned int value, OUT Scancode *const scancode)
+{
+	if (value <= 0xff)			// One byte scancode
+		*scancode = Scancode((BYTE)value);
+	else if (value <= 0xffff)	// Two byte scancode
+		*scancode = Scancode((BYTE)(value >> 8), (BYTE)(value & 0xff));
+	else
+		return false;
+	return true;
+}
 
-		// Just figure out the length
-		size_t length = 0;
-		for (auto d = range.first; d != range.second; d++)
-			length++;
 
-		// see if a simple or composite modifier is needed
-		PModifier pModifier;
-		if (length == 1)		// simple modifier, there is one scancode
+// Helper for SplitKeyboards: true if the text at position starts with prefix.
+static bool StartsWith(const std::vector<BYTE>& content, const size_t position, const char* const prefix)
+{
+	size_t length = strlen(prefix);
+	return position + length <= content.size() && memcmp(content.data() + position, prefix, length) == 0;
+}
+
+// Helper for SplitKeyboards: position right after the first occurrence of terminator at or after
+// position, or npos if there's none.
+static size_t SkipPast(const std::vector<BYTE>& content, const size_t position, const char* const terminator)
+{
+	const BYTE* end = content.data() + content.size();
+	size_t length = strlen(terminator);
+	const BYTE* found = std::search(content.data() + position, end, terminator, terminator + length);
+	return (found == end ? std::string::npos : (size_t)(found - content.data()) + length);
+}
+
+bool SplitKeyboards(const std::vector<BYTE>& content, OUT std::vector<SettingsSection> *const sections)
+{
+	sections->clear();
+	size_t open = std::string::npos;		// <- start of the keyboard element that is open
+	size_t position = 0;
+	while (position < content.size())
+	{
+		if (content[position] != '<')
 		{
-			int scCode = range.first->second;
-			if (scCode <= 0xff)	// One byte scancode
-				pModifier = new SimpleModifier(it->first, Scancode(scCode));
-			else				// Two byte scancode
-				pModifier = new SimpleModifier(it->first, Scancode(scCode >> 8, scCode & 0xff));
+			position++;
+			continue;
 		}
-		else if (length > 1)	// composite modifier, there are many scancodes
+
+		// Markup that may contain anything, including what looks like a keyboard element
+		if (StartsWith(content, position, "<!--"))
+			position = SkipPast(content, position, "-->");
+		else if (StartsWith(content, position, "<![CDATA["))
+			position = SkipPast(content, position, "]]>");
+		else if (StartsWith(content, position, "<?"))
+			position = SkipPast(content, position, "?>");
+		// Element names must be followed by whitespace, '>' or '/'
+		else if (StartsWith(content, position, "<keyboard") && position + 9 < content.size()
+			&& strchr(" \t\r\n>/", content[position + 9]) != nullptr && content[position + 9] != 0)
 		{
-			std::vector<Scancode> scVector;	// temporarily hold scancodes
-			for (auto d = range.first; d != range.second; d++)
-			{
-				if (d->second <= 0xff)	// One byte scancode
-					scVector.push_back(Scancode(d->second));
-				else					// Two byte scancode
-					scVector.push_back(Scancode(d->second >> 8, d->second & 0xff));
-			}
-			pModifier = new CompositeModifier(it->first, scVector);
+			if (open != std::string::npos)
+				return false;		// <- keyboards are never nested
+			open = position;
+			position += 9;
+		}
+		else if (StartsWith(content, position, "</keyboard") && open != std::string::npos)
+		{
+			position = SkipPast(content, position, ">");
+			if (position == std::string::npos)
+				return false;
+			sections->push_back(SettingsSection{ open, position, 0 });
+			open = std::string::npos;
 		}
+		else
+			position++;
 
-		// add to the vector
-		modVector.push_back(pModifier);
+		if (position == std::string::npos)
+			return false;
 	}
+	if (open != std::string::npos || sections->empty())
+		return false;
 
-	*pModifiers =
-		new ModifierStateMap(modVector);
-
+	// A keyboard compiles the same only if the parts of the document around the keyboards are the same
+	size_t tail = sections->back().end;
+	unsigned long long context = SchemaValidator::HashContent(content.data(), sections->front().begin);
+	context = SchemaValidator::HashContent(content.data() + tail, content.size() - tail, context);
+	for (auto it = sections->begin(); it != sections->end(); it++)
+		it->hash = SchemaValidator::HashContent(content.data() + it->begin, it->end - it->begin, context);
 	return true;
 }
 
 
 
-bool ParseLayer(const PXmlElement lvlElement, OUT Layer** const pLayer)
+/*
+SettingsHandler
+*/
+
+SettingsHandler::SettingsHandler(Arena& arena)
+	: arena(arena), failure(false), failureReason(nullptr), finished(false), collectingText(false),
+	modifiers(nullptr), triggerOnRepeat(false), pathCount(0), parameterCount(0),
+	independentCount(0), vkeyUp(false), codepointTarget(nullptr)
 {
-	// Get a copy of the modifier state map
-	// ModifierStateMap * ptrLayerModMap = new ModifierStateMap(*pModifiers);
-	// no longer necessary to create a modifier state map
+	// Settings are never nested very deeply
+	openElements.reserve(16);
+}
 
-	// This will contain the modifiers that are necessary to trigger this layer,
-	// identified only by name.
-	std::vector<std::wstring> modifierCombination;
+void SettingsHandler::_fail(const wchar_t* const reason)
+{
+	// Only the first reason is kept; whatever fails after it is a consequence
+	if (!failure)
+		failureReason = reason;
+	failure = true;
+}
 
-	// Get all modifiers that are required to trigger this layer
-	PXmlNodeList modifierList = lvlElement->getElementsByTagName(u"modifier");
-	for (XMLSize_t i = 0; i < modifierList->getLength(); i++)
-	{
-		PXmlNode modifier = modifierList->item(i);
-		if (modifier->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			return false;		// there was a non-element "modifier"
-		std::wstring modifierName = xmlch_to_wstring(modifier->getTextContent());
-		modifierCombination.push_back(modifierName);		// <- adds new modifier name to necessary modifiers
-	}
+SettingsHandler::Element SettingsHandler::_parent() const
+{
+	return (openElements.empty() ? Element::Unknown : openElements.back());
+}
 
-	// At this point, modifierCombination contains the modifiers and will only go out of scope at
-	// the end of this function.
+void SettingsHandler::startElement(const XMLCh* const uri, const XMLCh* const localname,
+	const XMLCh* const qname, const XmlAttributes& attrs)
+{
+	if (failure) return;
 
-	// Read all remaps
-	PXmlNodeList allChildren = lvlElement->getChildNodes();
-	std::unordered_map<Scancode, BaseKeystrokeCommand*> layout;
+	Element parent = _parent();
+	Element element = Element::Unknown;
+	collectingText = false;
 
-	for (XMLSize_t i = 0; i < allChildren->getLength(); i++)
+	// Elements are only recognized where the schema allows them;
+	// anything else (including the contents of unknown elements) is ignored.
+	switch (parent)
 	{
-		PXmlNode child = allChildren->item(i);
-		if (child->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			continue;
+	case Element::Unknown:
+		if (openElements.empty() && xmlch_equals(localname, u"Multikeys"))
+			element = Element::Root;
+		break;
 
-		std::wstring childTagName = xmlch_to_wstring(child->getNodeName());
-		BaseKeystrokeCommand* commandPointer = nullptr;
-
-		if (childTagName.compare(L"unicode") == 0)
+	case Element::Root:
+		if (xmlch_equals(localname, u"keyboard"))
 		{
-			if (!ParseUnicode((PXmlElement)child, &commandPointer))
-				return false;
+			element = Element::Keyboard;
+			// Keyboards also have an alias attribute, but that's for the UI
+			const XMLCh* name = attrs.getValue(u"Name");
+			if (name == nullptr)
+				return _fail(L"Keyboard without a name.");
+			keyboardName.assign(name, name + xercesc::XMLString::stringLen(name));
+			// Each keyboard's image must be the first thing in its section, at offset 0
+			arena.reset();
+			arena.make<KeyboardImage>();
 		}
-		else if (childTagName.compare(L"macro") == 0)
+		break;
+
+	case Element::Keyboard:
+		if (xmlch_equals(localname, u"modifiers"))
 		{
-			if (!ParseMacro((PXmlElement)child, &commandPointer))
-				return false;
+			element = Element::Modifiers;
+			// There should be only one "modifiers" tag, and it comes before the layers
+			if (modifiers != nullptr || !layers.empty())
+				return _fail(L"Unexpected modifiers element.");
+			modifierScancodes.clear();
 		}
-		else if (childTagName.compare(L"execute") == 0)
+		else if (xmlch_equals(localname, u"layer"))
 		{
-			if (!ParseExecutable((PXmlElement)child, &commandPointer))
-				return false;
+			element = Element::Layer;
+			if (modifiers == nullptr)
+				return _fail(L"Layer found before the keyboard's modifiers.");
+			layerModifierNames.clear();
 		}
-		else if (childTagName.compare(L"deadkey") == 0)
+		break;
+
+	case Element::Modifiers:
+		if (xmlch_equals(localname, u"modifier"))
 		{
-			if (!ParseDeadKey((PXmlElement)child, &commandPointer))
-				return false;
+			element = Element::ModifierKey;
+			const XMLCh* name = attrs.getValue(u"Name");
+			if (name == nullptr)
+				return _fail(L"Modifier without a name.");
+			// The scancode is added when the element ends
+			modifierScancodes.push_back(std::pair<std::wstring, Scancode>(
+				xmlch_to_wstring(name, xercesc::XMLString::stringLen(name)), Scancode()));
+			collectingText = true;
 		}
-		// The only other kind of node that can appear is a modifier,
-		// and those are read elsewhere.
-		else continue;
-
+		break;
 
-		// commandPointer should contain a command now
-		// no matter what kind of node was read (unicode, macro, etc), it must contain a Scancode attribute
-		std::wstring scancode = xmlch_to_wstring(((PXmlElement)child)->getAttribute(u"Scancode"));
-		// the bytes of a scancode may be optionally separated by a colon, in which case we remove it
-		scancode.erase(std::remove(scancode.begin(), scancode.end(), L':'), scancode.end());
-		try
+	case Element::Layer:
+		if (xmlch_equals(localname, u"modifier"))
 		{
-			unsigned short iScancode = std::stoi(scancode.c_str(), 0, 16);
-			if (iScancode <= 0xFF)
-			{													// remember that layout
-				Scancode sc = Scancode(iScancode & 0xFF);		// is a map!
-				layout[sc] = commandPointer;					// operator[] creates a
-			}													// new entry.
-			else
-			{
-				Scancode sc = Scancode(iScancode >> 8, iScancode & 0xFF);
-				layout[sc] = commandPointer;
-			}
+			element = Element::LayerModifier;
+			collectingText = true;
 		}
-		catch (std::exception e)
+		else
 		{
-			// handle errors
-			return false;
+			if (xmlch_equals(localname, u"unicode")) element = Element::Unicode;
+			else if (xmlch_equals(localname, u"macro")) element = Element::Macro;
+			else if (xmlch_equals(localname, u"execute")) element = Element::Execute;
+			else if (xmlch_equals(localname, u"deadkey")) element = Element::DeadKey;
+			else break;
+
+			// no matter what kind of remap this is (unicode, macro, etc), it must contain a Scancode attribute
+			const XMLCh* scancode = attrs.getValue(u"Scancode");
+			unsigned int scancodeValue;
+			if (scancode == nullptr
+				|| !ParseHex(scancode, xercesc::XMLString::stringLen(scancode), &scancodeValue)
+				|| !MakeScancode(scancodeValue, &remapScancode))
+				return _fail(L"Remap with an invalid scancode.");
+			triggerOnRepeat = xmlch_equals(attrs.getValue(u"TriggerOnRepeat"), u"True");
+
+			// Start with an empty remap; vectors keep their memory from the previous one
+			codepoints.clear();
+			keypresses.clear();
+			path.clear();
+			parameter.clear();
+			pathCount = parameterCount = independentCount = 0;
+			replacementsFrom.clear();
+			replacementsTo.clear();
+			codepointTarget = (element == Element::Unicode ? &codepoints : nullptr);
 		}
+		break;
 
-	}
-
-	*pLayer =
-		new Layer(modifierCombination, layout);
-	// It's okay that these containers die at the end of this function.
-	// Layer will copy them in its constructor.
-
-	return true;
-}
-
-
-
+	case Element::Unicode:
+	case Element::Independent:
+	case Element::From:
+	case Element::To:
+		if (xmlch_equals(localname, u"codepoint") && codepointTarget != nullptr)
+		{
+			element = Element::Codepoint;
+			collectingText = true;
+		}
+		break;
 
-bool ParseUnicode(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand)
-{
-	// retrieve trigger on repeat attribute
-	bool triggerOnRepeat =
-		u16wcscmp(rmpElement->getAttribute(u"TriggerOnRepeat"), L"True") == 0;
+	case Element::Macro:
+	case Element::Repeat:
+		if (xmlch_equals(localname, u"vkey"))
+		{
+			element = Element::VKey;
+			vkeyUp = xmlch_equals(attrs.getValue(u"Keypress"), u"Up");
+			collectingText = true;
+		}
+		else if (xmlch_equals(localname, u"delay"))
+		{
+			element = Element::Delay;
+			const XMLCh* milliseconds = attrs.getValue(u"Milliseconds");
+			unsigned int value;
+			if (milliseconds == nullptr
+				|| !ParseDecimal(milliseconds, xercesc::XMLString::stringLen(milliseconds), &value)
+				|| value > PROGRAM_STEP_ARGUMENT)
+				return _fail(L"Macro delay with an invalid amount of milliseconds.");
+			keypresses.push_back((unsigned short)(PROGRAM_STEP_DELAY | value));
+		}
+		else if (xmlch_equals(localname, u"repeat") && parent == Element::Macro)
+		{
+			// Repeated blocks are never nested, so that a macro only needs one counter
+			element = Element::Repeat;
+			const XMLCh* count = attrs.getValue(u"Count");
+			unsigned int value;
+			if (count == nullptr
+				|| !ParseDecimal(count, xercesc::XMLString::stringLen(count), &value)
+				|| value == 0 || value > PROGRAM_STEP_ARGUMENT)
+				return _fail(L"Macro repeat with an invalid count.");
+			keypresses.push_back((unsigned short)(PROGRAM_STEP_REPEAT | value));
+		}
+		else if (xmlch_equals(localname, u"restore"))
+		{
+			element = Element::Restore;
+			keypresses.push_back(PROGRAM_STEP_RESTORE);
+		}
+		break;
 
-	std::vector<unsigned int> codepointVector;
+	case Element::Execute:
+		if (xmlch_equals(localname, u"path"))
+		{
+			element = Element::Path;
+			collectingText = true;
+		}
+		else if (xmlch_equals(localname, u"parameter"))
+		{
+			element = Element::Parameter;
+			collectingText = true;
+		}
+		break;
 
-	// read each codepoint
-	PXmlNodeList codepointElements = rmpElement->getElementsByTagName(u"codepoint");
-	for (XMLSize_t i = 0; i < codepointElements->getLength(); i++)
-	{
-		if (codepointElements->item(i)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			continue;		// found codepoint node that wasn't element
+	case Element::DeadKey:
+		if (xmlch_equals(localname, u"independent"))
+		{
+			element = Element::Independent;
+			codepointTarget = &codepoints;
+		}
+		else if (xmlch_equals(localname, u"replacement"))
+		{
+			element = Element::Replacement;
+			codepointTarget = nullptr;
+			fromCodepoints.clear();
+			toCodepoints.clear();
+		}
+		break;
 
-		try
+	case Element::Replacement:
+		if (xmlch_equals(localname, u"from"))
 		{
-			unsigned int codepoint = std::stoi(
-				xmlch_to_wcs(codepointElements->item(i)->getTextContent()),
-				0,
-				16
-			);
-			codepointVector.push_back(codepoint);
+			element = Element::From;
+			codepointTarget = &fromCodepoints;
 		}
-		catch (std::exception e)
+		else if (xmlch_equals(localname, u"to"))
 		{
-			// handle errors
-			return false;
+			element = Element::To;
+			codepointTarget = &toCodepoints;
 		}
+		break;
+
+	default:
+		break;
 	}
 
-	*pCommand =
-		new UnicodeCommand(codepointVector.data(), codepointVector.size(), triggerOnRepeat);
-	return true;
+	if (collectingText)
+		text.clear();		// <- does not release memory
+	openElements.push_back(element);
+}
 
+void SettingsHandler::characters(const XMLCh* const chars, const XMLSize_t length)
+{
+	// The text of an element may arrive in several pieces
+	if (collectingText && !failure)
+		text.append(chars, length);
 }
 
-bool ParseMacro(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand)
+void SettingsHandler::endElement(const XMLCh* const uri, const XMLCh* const localname,
+	const XMLCh* const qname)
 {
-	// retrieve trigger on repeat attribute
-	bool triggerOnRepeat =
-		u16wcscmp(rmpElement->getAttribute(u"TriggerOnRepeat"), L"True") == 0;
+	if (failure || openElements.empty()) return;
 
-	std::vector<unsigned short> vkeyVector;
+	Element element = openElements.back();
+	openElements.pop_back();
+	collectingText = false;
 
-	// read each vKey
-	PXmlNodeList vkeyElements = rmpElement->getElementsByTagName(u"vkey");
-	for (XMLSize_t i = 0; i < vkeyElements->getLength(); i++)
+	unsigned int value;
+	switch (element)
 	{
-		if (vkeyElements->item(i)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			continue;
-
-		try
-		{
-			unsigned short vkey = std::stoi(
-				xmlch_to_wcs(vkeyElements->item(i)->getTextContent()),
-				0,
-				16
-			);
-
-			bool isKeyUp =
-				u16wcscmp(
-				((PXmlElement)vkeyElements->item(i))->getAttribute(u"Keypress"),
-					L"Up"
-				) == 0;
-
-			if (isKeyUp)		// turn on the most significant bit of a 16-bit variable
-				vkey |= 0x8000;
+	case Element::ModifierKey:
+		// Some modifiers have E0 flags; in that case, there will be a ':' (as in E0:38),
+		// which ParseHex skips.
+		if (!ParseHex(text.data(), text.size(), &value)
+			|| !MakeScancode(value, &modifierScancodes.back().second))
+			return _fail(L"Modifier with an invalid scancode.");
+		break;
+
+	case Element::Modifiers:
+		_endModifiers();
+		break;
+
+	case Element::LayerModifier:
+		layerModifierNames.push_back(xmlch_to_wstring(text.data(), text.size()));
+		break;
+
+	case Element::Layer:
+		_endLayer();
+		break;
+
+	case Element::Keyboard:
+		_endKeyboard();
+		break;
+
+	case Element::Codepoint:
+		if (!ParseHex(text.data(), text.size(), &value))
+			return _fail(L"Invalid codepoint.");
+		codepointTarget->push_back(value);
+		break;
+
+	case Element::VKey:
+		if (!ParseHex(text.data(), text.size(), &value) || value > 0xff)
+			return _fail(L"Invalid virtual key.");
+		// the most significant bit of a 16-bit variable marks a key release
+		keypresses.push_back((unsigned short)((vkeyUp ? PROGRAM_STEP_RELEASE : PROGRAM_STEP_PRESS) | value));
+		break;
+
+	case Element::Repeat:
+		keypresses.push_back(PROGRAM_STEP_END);
+		break;
+
+	case Element::Path:
+		path.assign(text.begin(), text.end());
+		pathCount++;
+		break;
+
+	case Element::Parameter:
+		parameter.assign(text.begin(), text.end());
+		parameterCount++;
+		break;
+
+	case Element::Independent:
+		independentCount++;
+		codepointTarget = nullptr;
+		break;
+
+	case Element::Replacement:
+	{
+		// Both of them live in the arena
+		// Note: currently, dead keys can only map from unicode commands to other unicode commands.
+		if (fromCodepoints.empty() || toCodepoints.empty())
+			return _fail(L"Dead key replacement without a from or a to.");
+		replacementsFrom.push_back(arena.make<UnicodeCommand>(arena, fromCodepoints, true));
+		replacementsTo.push_back(arena.make<UnicodeCommand>(arena, toCodepoints, true));
+		break;
+	}
 
-			vkeyVector.push_back(vkey);
-		}
-		catch (std::exception e)
-		{
-			// handle errors
-			return false;
-		}
+	case Element::From:
+	case Element::To:
+		codepointTarget = nullptr;
+		break;
+
+	case Element::Unicode:
+		_endRemap(MakeCommandReference(arena,
+			arena.make<UnicodeCommand>(arena, codepoints.data(), (UINT)codepoints.size(), triggerOnRepeat)));
+		break;
+
+	case Element::Macro:
+		_endRemap(MakeCommandReference(arena,
+			arena.make<MacroCommand>(arena, keypresses.data(), keypresses.size(), triggerOnRepeat)));
+		break;
+
+	case Element::Execute:
+		// One "path" element, one optional "parameter" element
+		if (pathCount != 1 || parameterCount > 1)
+			return _fail(L"Execute remap without exactly one path.");
+		_endRemap(MakeCommandReference(arena,
+			arena.make<ExecutableCommand>(arena, path, parameter)));
+		break;
+
+	case Element::DeadKey:
+		if (independentCount != 1)
+			return _fail(L"Dead key without exactly one independent element.");
+		_endRemap(MakeCommandReference(arena,
+			arena.make<DeadKeyCommand>(arena, codepoints, replacementsFrom, replacementsTo)));
+		break;
+
+	default:
+		break;
 	}
+}
 
-	*pCommand =
-		new MacroCommand(vkeyVector.data(), vkeyVector.size(), triggerOnRepeat);
-	return true;
+void SettingsHandler::endDocument()
+{
+	finished = true;
 }
 
-bool ParseExecutable(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand)
+void SettingsHandler::error(const xercesc::SAXParseException& exc)
 {
-	// One "path" element, one "parameter" element
-	PXmlNodeList pathElementList = rmpElement->getElementsByTagName(u"path");
-	if (pathElementList->getLength() != 1)
-		return false;
-	if (pathElementList->item(0)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-		return false;
-	std::wstring path = xmlch_to_wstring(pathElementList->item(0)->getTextContent());
+	_fail(L"The settings don't follow the schema.");
+}
 
-	PXmlNodeList parameterElementList = rmpElement->getElementsByTagName(u"parameter");
-	if (parameterElementList->getLength() == 1)
+void SettingsHandler::_endModifiers()
+{
+	// Pairs with the same name are the scancodes of a single (composite) modifier.
+	// Modifiers take their bits in the order of their first appearance.
+	std::vector<PModifier> modVector;
+	for (size_t i = 0; i < modifierScancodes.size(); i++)
 	{
-		if (parameterElementList->item(0)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			return false;
-		std::wstring parameter = xmlch_to_wstring(parameterElementList->item(0)->getTextContent());
+		const std::wstring& name = modifierScancodes[i].first;
+		bool seen = false;
+		for (size_t j = 0; j < i && !seen; j++)
+			seen = (modifierScancodes[j].first == name);
+		if (seen) continue;
+
+		std::vector<Scancode> scVector;
+		for (size_t j = i; j < modifierScancodes.size(); j++)
+		{
+			if (modifierScancodes[j].first == name)
+				scVector.push_back(modifierScancodes[j].second);
+		}
 
-		*pCommand =
-			new ExecutableCommand(path, parameter);
+		// see if a simple or composite modifier is needed
+		if (scVector.size() == 1)
+			modVector.push_back(new SimpleModifier(name, scVector[0]));
+		else
+			modVector.push_back(new CompositeModifier(name, scVector));
 	}
-	else
+
+	// Each modifier takes one bit of the state mask
+	if (modVector.size() > MAX_MODIFIERS)
 	{
-		*pCommand =
-			new ExecutableCommand(path);
+		for (auto it = modVector.begin(); it != modVector.end(); it++)
+			delete (*it);
+		return _fail(L"Too many modifiers in a single keyboard!");
 	}
 
-	return true;
+	modifiers = new ModifierStateMap(modVector);
 }
 
-bool ParseIndependentCodepoints(
-	const PXmlElement indElement,
-	OUT std::vector<unsigned int>* codepoints)
+void SettingsHandler::_endRemap(const KeystrokeCommand command)
 {
-	// Similar to Unicode command parsing
-	std::vector<unsigned int> codepointVector;
+	// The layer being read is the next one to be added to the keyboard.
+	remaps.push_back(Remap{ layers.size(), remapScancode, command });
+}
 
-	// read each codepoint
-	PXmlNodeList codepointElements = indElement->getElementsByTagName(u"codepoint");
-	for (XMLSize_t i = 0; i < codepointElements->getLength(); i++)
-	{
-		if (codepointElements->item(i)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			continue;		// found codepoint node that wasn't element
+void SettingsHandler::_endLayer()
+{
+	// Names are only needed here; the layer keeps the equivalent state mask.
+	layers.push_back(new Layer(modifiers->getModifierMask(layerModifierNames), layers.size()));
+}
 
-		try
-		{
-			unsigned int codepoint = std::stoi(
-				xmlch_to_wcs(codepointElements->item(i)->getTextContent()),
-				0,
-				16
-			);
-			codepointVector.push_back(codepoint);
-		}
-		catch (std::exception e)
+void SettingsHandler::_endKeyboard()
+{
+	if (modifiers == nullptr)
+		return _fail(L"Keyboard without modifiers.");
+
+	// Every layer places its remaps in its own row of this table
+	CommandTable * commandTable = new CommandTable(arena, layers.size());
+	for (auto it = remaps.begin(); it != remaps.end(); it++)
+	{
+		// A repeated scancode replaces the previous command (which stays in the arena).
+		if (!commandTable->setCommand(it->layer, it->scancode, it->command))
 		{
-			// handle errors
-			return false;
+			delete commandTable;
+			return _fail(L"Too many commands in a single keyboard!");
 		}
 	}
-	*codepoints = codepointVector;
-	return true;
-}
-bool ParseReplacements(
-	const PXmlNodeList replList,
-	OUT std::unordered_map<UnicodeCommand*, UnicodeCommand*>* replacements)	// <-should not be null
-{
-	PXmlNodeList workList;
-	// Each node in replList is an element called <replacement> containing one <from> tag and a <to> tag.
-	// Both the <from> and the <to> tag contain a list of <codepoint>s each.
 
-	replacements->clear();
-	for (XMLSize_t i = 0; i < replList->getLength(); i++)
-	{
-		if (replList->item(i)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-			continue;
+	// Everything the keyboard needs is placed in the arena; the rest is no longer needed
+	Keyboard::Compile(arena, keyboardName, *modifiers, layers, *commandTable, arena.at<KeyboardImage>(0));
+	delete commandTable;
+	_discardKeyboard();
 
-		// Retrieve both <from> and <to> tags
-		// Put them in their own UnicodeCommands
-		// Note: currently, dead keys can only map from unicode commands to other unicode commands.
-		PXmlElement replacementNode = (PXmlElement)replList->item(i);
-		// From
-		std::vector<unsigned int> pFromCodepoints;
-		workList = replacementNode->getElementsByTagName(u"from");
-		if (workList->getLength() != 1) return false;
-		if (workList->item(0)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE) return false;
-		if (!ParseIndependentCodepoints((PXmlElement)workList->item(0), &pFromCodepoints)) return false;
-		// To
-		std::vector<unsigned int> pToCodepoints;
-		workList = replacementNode->getElementsByTagName(u"to");
-		if (workList->getLength() != 1) return false;
-		if (workList->item(0)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE) return false;
-		if (!ParseIndependentCodepoints((PXmlElement)workList->item(0), &pToCodepoints)) return false;
-		// make both Unicode commands, store them in the map
-		UnicodeCommand * pFromCommand = new UnicodeCommand(pFromCodepoints, true);
-		UnicodeCommand * pToCommand = new UnicodeCommand(pToCodepoints, true);
-		(*replacements)[pFromCommand] = pToCommand;		// These UnicodeCommands don't die
-	}
-	// replacements have already been inserted
-	return true;
+	const BYTE* section = (const BYTE*)arena.data();
+	keyboards.push_back(std::vector<BYTE>(section, section + arena.size()));
 }
-bool ParseDeadKey(const PXmlElement rmpElement, OUT BaseKeystrokeCommand* *const pCommand)
-{
-	// Unicode characters that represent this key independently
-	std::vector<unsigned int> codepointVector;
 
-	// Map that contains all replacements this dead key can make
-	std::unordered_map<UnicodeCommand*, UnicodeCommand*> replacementsMap;
-
-	// Retrieve independent codepoints
-	PXmlNodeList workList;
+void SettingsHandler::_discardKeyboard()
+{
+	delete modifiers;
+	modifiers = nullptr;
+	for (auto it = layers.begin(); it != layers.end(); it++)
+		delete (*it);
+	layers.clear();
+	remaps.clear();
+}
 
-	workList = rmpElement->getElementsByTagName(u"independent");
-	if (workList->getLength() != 1)
-		return false;
-	if (workList->item(0)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-		return false;
-	if (!ParseIndependentCodepoints((PXmlElement)workList->item(0), &codepointVector))
-		return false;
-	// At this point, codepointVector contains a valid Unicode sequence
-
-	// Retrieve replacements
-	workList = rmpElement->getElementsByTagName(u"replacement");
-	/*if (workList->getLength() != 1)	// nonsense; there may be many replacements
-		return false;*/
-	/*if (workList->item(0)->getNodeType() != XmlNode::NodeType::ELEMENT_NODE)
-		return false;*/
-	if (!ParseReplacements(workList, &replacementsMap))
-		return false;
-	// At this point, replacementsMap contains valid replacements
+void SettingsHandler::releaseKeyboards(OUT std::vector<std::vector<BYTE>> *const out_keyboards)
+{
+	out_keyboards->swap(keyboards);
+	keyboards.clear();
+}
 
-	// set dead key pointer
-	*pCommand =
-		new DeadKeyCommand(codepointVector, replacementsMap);
-	return true;
-}
\ No newline at end of file
+SettingsHandler::~SettingsHandler()
+{
+	_discardKeyboard();
+}